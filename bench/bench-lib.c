@@ -0,0 +1,461 @@
+/**
+ * @file bench-lib.c
+ * @brief Microbenchmarks of the imgStore library against the size of the store.
+ *
+ * For each size, a synthetic store is written directly: the header, the whole
+ * metadata array in one write and the image once, all the entries pointing to
+ * it under distinct ids and NB_SHAS distinct SHAs. Each operation is then timed
+ * a number of times, and its statistics written as one JSON line:
+ *
+ *   {"op":"find_img_id","files":100000,"iterations":200,"mean_ns":...,
+ *    "min_ns":...,"p50_ns":...,"p99_ns":...,"max_ns":...}
+ *
+ * so that two runs can be compared line by line.
+ *
+ * The stores are written in -dir: each takes its metadata and one image, and
+ * do_gbcollect writes up to NB_SHAS copies of the image in its new store.
+ */
+#define _XOPEN_SOURCE 700 // for posix_fadvise and fsync
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <inttypes.h> // for PRIu64
+#include <vips/vips.h> // for VIPS_INIT and vips shutdown
+#include "imgStore.h"
+#include "image_content.h"
+#include "dedup.h"
+#include "metrics.h" // for metrics_now()
+#include "util.h"
+
+#define MAX_SIZES 16
+#define MAX_SAMPLES 100000
+#define MAX_SIZE_DIGITS 6
+#define MAX_PATH 512
+#define NB_SHAS 64 // distinct SHAs of a synthetic store, do_gbcollect writes the image once per SHA
+
+/**
+ * @brief Benchmark configuration, set from the command line
+ */
+static struct {
+    uint32_t sizes[MAX_SIZES]; // max_files of the stores
+    size_t nb_sizes;
+    uint32_t repeat; // iterations of the fast operations
+    uint32_t resizes; // iterations of lazily_resize and of the cold reads
+    uint32_t inserts; // iterations of do_insert, left free in the stores
+    uint32_t gc_max; // largest store collected, do_gbcollect being quadratic
+    const char* dir; // where the stores are written
+} s_options = {
+    .sizes = {1000, 10000, MAX_MAX_FILES},
+    .nb_sizes = 3,
+    .repeat = 200,
+    .resizes = 10,
+    .inserts = 32,
+    .gc_max = 10000,
+    .dir = "/tmp"
+};
+
+static uint64_t s_samples[MAX_SAMPLES];
+static size_t s_nb_samples;
+static uint64_t s_random = 0x9E3779B97F4A7C15ull;
+
+/**
+ * @brief Draws a pseudo-random number (xorshift64*), the same on every run
+ */
+static uint64_t next_random(void)
+{
+    s_random ^= s_random >> 12;
+    s_random ^= s_random << 25;
+    s_random ^= s_random >> 27;
+    return s_random * 0x2545F4914F6CDD1Dull;
+}
+
+/**
+ * @brief Records a duration of the operation being timed
+ *
+ * @param start when it started, from metrics_now()
+ */
+static void sample(uint64_t start)
+{
+    const uint64_t duration = metrics_now() - start;
+    if (s_nb_samples < MAX_SAMPLES) s_samples[s_nb_samples++] = duration;
+}
+
+/**
+ * @brief Compares two durations, for qsort
+ */
+static int compare_samples(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Writes the statistics of the samples of an operation as a JSON line,
+ * and a summary to stderr, then forgets the samples
+ *
+ * @param out where to write
+ * @param op name of the operation
+ * @param files max_files of the store
+ */
+static void report(FILE* out, const char* op, uint32_t files)
+{
+    if (s_nb_samples == 0) return;
+    qsort(s_samples, s_nb_samples, sizeof(uint64_t), compare_samples);
+    uint64_t total = 0;
+    for (size_t i = 0; i < s_nb_samples; i++) total += s_samples[i];
+    const uint64_t mean = total / s_nb_samples;
+    const uint64_t p50 = s_samples[(s_nb_samples - 1) / 2];
+    const uint64_t p99 = s_samples[(s_nb_samples * 99 + 99) / 100 - 1];
+    fprintf(out, "{\"op\":\"%s\",\"files\":%" PRIu32 ",\"iterations\":%zu,\"mean_ns\":%" PRIu64
+            ",\"min_ns\":%" PRIu64 ",\"p50_ns\":%" PRIu64 ",\"p99_ns\":%" PRIu64 ",\"max_ns\":%" PRIu64 "}\n",
+            op, files, s_nb_samples, mean, s_samples[0], p50, p99, s_samples[s_nb_samples - 1]);
+    fflush(out);
+    fprintf(stderr, "%-22s %6" PRIu32 " files %6zu x %12.3f us (p99 %12.3f us)\n", op, files, s_nb_samples,
+            (double) mean * 1e-3, (double) p99 * 1e-3);
+    s_nb_samples = 0;
+}
+
+/**
+ * @brief Writes a synthetic store: the header, the metadata, and the image
+ * once, which all the entries point to
+ *
+ * @param path file of the store
+ * @param max_files entries of the store
+ * @param nb_files valid entries, the first ones, named "img<index>"
+ * @param image the image
+ * @param size size of the image
+ * @return int Some error code. 0 if no error.
+ */
+static int create_synthetic(const char* path, uint32_t max_files, uint32_t nb_files, const char* image, size_t size)
+{
+    uint32_t width = 0, height = 0;
+    M_EXIT_IF_ERR(get_resolution(&height, &width, image, size));
+    // the defaults of imgStoreMgr create
+    struct imgst_file store = {.header = {
+            .imgst_name = CAT_TXT, .max_files = max_files, .nb_resized = NB_DEFAULT_RESIZED,
+            .res_resized = {64, 64, 256, 256}, .res_names = {"thumb", "small"},
+            .res_encoding = {{ENC_JPEG, DEFAULT_QUALITY, SUBSAMPLE_AUTO, 1}, {ENC_JPEG, DEFAULT_QUALITY, SUBSAMPLE_AUTO, 1}}
+        }
+    };
+    store.header.num_files = nb_files;
+    store.metadata = calloc(max_files, sizeof(struct img_metadata));
+    M_EXIT_IF_NULL(store.metadata, max_files * sizeof(struct img_metadata));
+
+    const uint64_t offset = sizeof(struct imgst_header) + (uint64_t) max_files * sizeof(struct img_metadata);
+    for (uint32_t i = 0; i < nb_files; i++) {
+        struct img_metadata* metadata = &store.metadata[i];
+        snprintf(metadata->img_id, sizeof(metadata->img_id), "img%" PRIu32, i);
+        // SHAs shared by groups of entries, which no real image has
+        const uint32_t group = i % NB_SHAS;
+        memset(metadata->SHA, 0xbe, SHA256_DIGEST_LENGTH);
+        memcpy(metadata->SHA, &group, sizeof(group));
+        metadata->res_orig[0] = width;
+        metadata->res_orig[1] = height;
+        metadata->size[RES_ORIG] = (uint32_t) size;
+        metadata->offset[RES_ORIG] = offset;
+        metadata->is_valid = NON_EMPTY;
+    }
+
+    int err = ERR_NONE;
+    FILE* file = fopen(path, "wb");
+    if (file == NULL
+        || fwrite(&store.header, sizeof(struct imgst_header), 1, file) != 1
+        || fwrite(store.metadata, sizeof(struct img_metadata), max_files, file) != max_files
+        || fwrite(image, 1, size, file) != size) {
+        err = ERR_IO;
+    }
+    if (file != NULL && fclose(file) != 0) err = ERR_IO;
+    free(store.metadata);
+    return err;
+}
+
+/**
+ * @brief Picks a valid entry of a synthetic store at random
+ */
+static uint32_t random_index(uint32_t nb_files)
+{
+    return (uint32_t) (next_random() % nb_files);
+}
+
+/**
+ * @brief Evicts a store file from the page cache, so that the next read goes to the disk
+ */
+static void evict(FILE* file)
+{
+    fflush(file);
+    // only clean pages are evicted
+    fsync(fileno(file));
+    posix_fadvise(fileno(file), 0, 0, POSIX_FADV_DONTNEED);
+}
+
+#define COMMENT_SIZE 8 // COM marker, its length and a 32-bit counter
+/**
+ * @brief Copies a JPEG image with a comment segment after its SOI marker, so
+ * that writing a counter in the comment (see set_comment()) gives images with
+ * distinct bytes and SHAs, which dedup cannot share
+ *
+ * @param image the image
+ * @param size its size
+ * @return char* the copy, COMMENT_SIZE bytes larger, to be freed by the caller; NULL on error
+ */
+static char* with_comment(const char* image, size_t size)
+{
+    static const unsigned char comment[] = {0xFF, 0xFE, 0, COMMENT_SIZE - 2, 0, 0, 0, 0};
+    if (size < 2) return NULL;
+    char* copy = malloc(size + COMMENT_SIZE);
+    if (copy == NULL) return NULL;
+    memcpy(copy, image, 2);
+    memcpy(copy + 2, comment, COMMENT_SIZE);
+    memcpy(copy + 2 + COMMENT_SIZE, image + 2, size - 2);
+    return copy;
+}
+
+/**
+ * @brief Writes a counter in the comment added by with_comment()
+ */
+static void set_comment(char* image, uint32_t counter)
+{
+    for (size_t i = 0; i < 4; i++) {
+        image[2 + COMMENT_SIZE - 1 - i] = (char) (counter >> (8 * i) & 0xFF);
+    }
+}
+
+/**
+ * @brief Times the operations of the library on a store of one size
+ *
+ * @param out where to write the results
+ * @param max_files size of the store
+ * @param image the image inserted
+ * @param size its size
+ * @return int Some error code. 0 if no error.
+ */
+static int bench_size(FILE* out, uint32_t max_files, const char* image, size_t size)
+{
+    char path[MAX_PATH] = "";
+    char tmp_path[MAX_PATH] = "";
+    snprintf(path, sizeof(path), "%s/bench-lib-%" PRIu32 ".imgst", s_options.dir, max_files);
+    snprintf(tmp_path, sizeof(tmp_path), "%s/bench-lib-%" PRIu32 ".tmp", s_options.dir, max_files);
+    M_REQUIRE(max_files > s_options.inserts, ERR_INVALID_ARGUMENT, "store too small", NULL);
+    const uint32_t nb_files = max_files - s_options.inserts;
+
+    uint64_t start = metrics_now();
+    M_EXIT_IF_ERR(create_synthetic(path, max_files, nb_files, image, size));
+    sample(start);
+    report(out, "create_synthetic", max_files);
+
+    struct imgst_file store;
+    for (uint32_t i = 0; i < s_options.repeat / 10 + 1; i++) {
+        start = metrics_now();
+        M_EXIT_IF_ERR(do_open(path, "rb+", &store));
+        sample(start);
+        do_close(&store);
+    }
+    report(out, "do_open", max_files);
+    M_EXIT_IF_ERR(do_open(path, "rb+", &store));
+
+    int err = ERR_NONE;
+    size_t index = 0;
+    char img_id[MAX_IMG_ID + 1] = "";
+    for (uint32_t i = 0; i < s_options.repeat && err == ERR_NONE; i++) {
+        snprintf(img_id, sizeof(img_id), "img%" PRIu32, random_index(nb_files));
+        start = metrics_now();
+        err = find_img_id(&index, &store, img_id);
+        sample(start);
+    }
+    report(out, "find_img_id", max_files);
+    for (uint32_t i = 0; i < s_options.repeat && err == ERR_NONE; i++) {
+        start = metrics_now();
+        // scans the whole store
+        if (find_img_id(&index, &store, "missing") != ERR_FILE_NOT_FOUND) err = ERR_INVALID_ARGUMENT;
+        sample(start);
+    }
+    report(out, "find_img_id_missing", max_files);
+
+    for (uint32_t i = 0; i < s_options.repeat && err == ERR_NONE; i++) {
+        const uint32_t checked = random_index(nb_files);
+        // dedup rewrites the offsets of the entry in memory
+        const struct img_metadata saved = store.metadata[checked];
+        start = metrics_now();
+        err = do_name_and_content_dedup(&store, checked);
+        sample(start);
+        store.metadata[checked] = saved;
+    }
+    report(out, "dedup", max_files);
+
+    // each insert writes its own image, as dedup would make the others free
+    char* inserted = with_comment(image, size);
+    if (inserted == NULL) err = ERR_OUT_OF_MEMORY;
+    for (uint32_t i = 0; i < s_options.inserts && err == ERR_NONE; i++) {
+        snprintf(img_id, sizeof(img_id), "new%" PRIu32, i);
+        set_comment(inserted, i);
+        start = metrics_now();
+        err = do_insert(inserted, size + COMMENT_SIZE, img_id, &store);
+        sample(start);
+    }
+    free(inserted);
+    report(out, "do_insert", max_files);
+
+    for (uint32_t i = 0; i < s_options.resizes && err == ERR_NONE; i++) {
+        snprintf(img_id, sizeof(img_id), "img%" PRIu32, random_index(nb_files));
+        char* buffer = NULL;
+        uint32_t read = 0;
+        evict(store.file);
+        start = metrics_now();
+        err = do_read(img_id, RES_ORIG, &buffer, &read, &store);
+        sample(start);
+        free(buffer);
+    }
+    report(out, "do_read_cold", max_files);
+    for (uint32_t i = 0; i < s_options.repeat && err == ERR_NONE; i++) {
+        snprintf(img_id, sizeof(img_id), "img%" PRIu32, random_index(nb_files));
+        char* buffer = NULL;
+        uint32_t read = 0;
+        start = metrics_now();
+        err = do_read(img_id, RES_ORIG, &buffer, &read, &store);
+        sample(start);
+        free(buffer);
+    }
+    report(out, "do_read_warm", max_files);
+
+    for (uint32_t i = 0; i < s_options.resizes && err == ERR_NONE; i++) {
+        const uint32_t resized = random_index(nb_files);
+        if (store.metadata[resized].offset[RES_THUMB] != 0) continue;
+        start = metrics_now();
+        err = lazily_resize(RES_THUMB, &store, resized);
+        sample(start);
+    }
+    report(out, "lazily_resize", max_files);
+    do_close(&store);
+
+    if (err == ERR_NONE && max_files <= s_options.gc_max) {
+        start = metrics_now();
+        err = do_gbcollect(path, tmp_path);
+        sample(start);
+        report(out, "do_gbcollect", max_files);
+    }
+    remove(path);
+    remove(tmp_path);
+    return err;
+}
+
+/**
+ * @brief Reads the image the benchmarks insert
+ *
+ * @param filename the image
+ * @param image output: its bytes, to be freed by the caller
+ * @param size output: its size
+ * @return int Some error code. 0 if no error.
+ */
+static int load_image(const char* filename, char** image, size_t* size)
+{
+    FILE* file = fopen(filename, "rb");
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(file, ERR_IO);
+    int err = ERR_NONE;
+    long length = 0;
+    if (fseek(file, 0, SEEK_END) != 0 || (length = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0) {
+        err = ERR_IO;
+    } else if ((*image = malloc((size_t) length)) == NULL) {
+        err = ERR_OUT_OF_MEMORY;
+    } else if (fread(*image, 1, (size_t) length, file) != (size_t) length) {
+        err = ERR_IO;
+    } else {
+        *size = (size_t) length;
+    }
+    fclose(file);
+    return err;
+}
+
+/**
+ * @brief Parses a comma separated list of store sizes into s_options.sizes
+ *
+ * @param list the list, e.g. "1000,10000,100000"
+ * @return int Some error code. 0 if no error.
+ */
+static int parse_sizes(const char* list)
+{
+    size_t nb = 0;
+    const char* start = list;
+    while (*start != '\0') {
+        char number[MAX_SIZE_DIGITS + 1] = "";
+        const size_t length = strcspn(start, ",");
+        M_REQUIRE(length > 0 && length <= MAX_SIZE_DIGITS, ERR_INVALID_ARGUMENT, "invalid size", NULL);
+        M_REQUIRE(nb < MAX_SIZES, ERR_INVALID_ARGUMENT, "too many sizes", NULL);
+        strncpy(number, start, length);
+        const uint32_t files = atouint32(number);
+        M_REQUIRE(files > s_options.inserts && files <= MAX_MAX_FILES, ERR_MAX_FILES, "invalid size", NULL);
+        s_options.sizes[nb++] = files;
+        start += length;
+        if (*start == ',') ++start;
+    }
+    M_REQUIRE(nb > 0, ERR_INVALID_ARGUMENT, "no size", NULL);
+    s_options.nb_sizes = nb;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Parses the command line options into s_options
+ *
+ * @param argc number of options
+ * @param argv the options
+ * @return int Some error code. 0 if no error.
+ */
+static int parse_options(int argc, char* argv[])
+{
+    for (int i = 0; i < argc;) {
+        if (!strcmp(argv[i], "-sizes") && i + 1 < argc) {
+            M_EXIT_IF_ERR(parse_sizes(argv[i + 1]));
+            i += 2;
+        } else if (!strcmp(argv[i], "-repeat") && i + 1 < argc) {
+            s_options.repeat = atouint32(argv[i + 1]);
+            M_REQUIRE(s_options.repeat > 0 && s_options.repeat <= MAX_SAMPLES, ERR_INVALID_ARGUMENT,
+                      "invalid repeat", NULL);
+            i += 2;
+        } else if (!strcmp(argv[i], "-resizes") && i + 1 < argc) {
+            s_options.resizes = atouint32(argv[i + 1]);
+            M_REQUIRE(s_options.resizes > 0 && s_options.resizes <= MAX_SAMPLES, ERR_INVALID_ARGUMENT,
+                      "invalid number of resizes", NULL);
+            i += 2;
+        } else if (!strcmp(argv[i], "-gc_max") && i + 1 < argc) {
+            s_options.gc_max = atouint32(argv[i + 1]);
+            i += 2;
+        } else if (!strcmp(argv[i], "-dir") && i + 1 < argc) {
+            s_options.dir = argv[i + 1];
+            i += 2;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    return ERR_NONE;
+}
+
+// ======================================================================
+int main(int argc, char *argv[])
+{
+    int err = argc < 3 ? ERR_NOT_ENOUGH_ARGUMENTS : parse_options(argc - 3, argv + 3);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "%s\n", ERR_MESSAGES[err]);
+        fprintf(stderr, "usage: %s <jpeg> <results.jsonl|-> [-sizes N1,N2,...] [-repeat N] [-resizes N]"
+                " [-gc_max N] [-dir DIR]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    if (VIPS_INIT(argv[0]) != 0) {
+        vips_error_exit("Error while starting Vips");
+    }
+    char* image = NULL;
+    size_t size = 0;
+    FILE* out = NULL;
+    if ((err = load_image(argv[1], &image, &size)) == ERR_NONE
+        && (out = strcmp(argv[2], "-") ? fopen(argv[2], "w") : stdout) == NULL) {
+        err = ERR_IO;
+    }
+    for (size_t i = 0; i < s_options.nb_sizes && err == ERR_NONE; i++) {
+        err = bench_size(out, s_options.sizes[i], image, size);
+    }
+    if (err != ERR_NONE) fprintf(stderr, "%s\n", ERR_MESSAGES[err]);
+    if (out != NULL && out != stdout) fclose(out);
+    free(image);
+    vips_shutdown();
+    return err == ERR_NONE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
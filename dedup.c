@@ -38,10 +38,10 @@ int do_name_and_content_dedup(const struct imgst_file* file, const uint32_t inde
                 M_REQUIRE(strcmp(file->metadata[i].img_id, file->metadata[index].img_id), ERR_DUPLICATE_ID, ERR_MESSAGES[ERR_DUPLICATE_ID], NULL);
                 if (found == 0 && (!compare_sha(file->metadata[i].SHA, file->metadata[index].SHA))) {
                     file->metadata[index].offset[RES_ORIG] = file->metadata[i].offset[RES_ORIG];
-                    file->metadata[index].offset[RES_THUMB] = file->metadata[i].offset[RES_THUMB];
-                    file->metadata[index].offset[RES_SMALL] = file->metadata[i].offset[RES_SMALL];
-                    file->metadata[index].size[RES_SMALL] = file->metadata[i].size[RES_SMALL];
-                    file->metadata[index].size[RES_THUMB] = file->metadata[i].size[RES_THUMB];
+                    for (int res = 0; res < file->header.nb_resized; res++) {
+                        file->metadata[index].offset[res] = file->metadata[i].offset[res];
+                        file->metadata[index].size[res] = file->metadata[i].size[res];
+                    }
                     found = 1;
                 }
             }
@@ -0,0 +1,271 @@
+/**
+ * @file derivative_cache.c
+ * @brief Size-bounded on-disk cache of on-the-fly resized images, with LRU eviction.
+ */
+#define _XOPEN_SOURCE 700 // for mkdir, stat, opendir
+#include "derivative_cache.h"
+#include "imgStore.h"
+#include "error.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <dirent.h>
+
+#define DCACHE_MAX_PATH (DCACHE_MAX_DIR + 1 + DCACHE_MAX_KEY)
+
+/**
+ * @brief Hashes a key (djb2)
+ */
+static size_t dcache_hash(const char* key)
+{
+    size_t hash = 5381;
+    for (const char* c = key; *c != '\0'; c++) {
+        hash = hash * 33 + (unsigned char) *c;
+    }
+    return hash % DCACHE_NB_BUCKETS;
+}
+
+/**
+ * @brief Writes the key of a variant: <sha hex>_<width>_q<quality>_s<subsample>_m<strip><extension>
+ */
+static int dcache_key(const unsigned char SHA[SHA256_DIGEST_LENGTH], uint16_t width,
+                      const struct res_encoding* encoding, char key[DCACHE_MAX_KEY + 1])
+{
+    const char* extension = encoder_extension(encoding->encoder);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(extension, ERR_INVALID_ARGUMENT);
+    char sha_string[2*SHA256_DIGEST_LENGTH + 1];
+    sha_to_string(SHA, sha_string);
+    snprintf(key, DCACHE_MAX_KEY + 1, "%s_%u_q%u_s%u_m%u%s", sha_string, (unsigned) width,
+             (unsigned) encoding->quality, (unsigned) encoding->subsample, (unsigned) encoding->strip, extension);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Finds an entry by key, NULL if absent
+ */
+static struct dcache_entry* dcache_find(const struct derivative_cache* cache, const char* key)
+{
+    struct dcache_entry* entry = cache->buckets[dcache_hash(key)];
+    while (entry != NULL && strcmp(entry->key, key)) {
+        entry = entry->chain;
+    }
+    return entry;
+}
+
+/**
+ * @brief Removes an entry from the LRU list
+ */
+static void dcache_unlink(struct derivative_cache* cache, struct dcache_entry* entry)
+{
+    if (entry->prev != NULL) entry->prev->next = entry->next;
+    else cache->head = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev;
+    else cache->tail = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+}
+
+/**
+ * @brief Inserts an entry at the head (most recently used) of the LRU list
+ */
+static void dcache_push_front(struct derivative_cache* cache, struct dcache_entry* entry)
+{
+    entry->prev = NULL;
+    entry->next = cache->head;
+    if (cache->head != NULL) cache->head->prev = entry;
+    cache->head = entry;
+    if (cache->tail == NULL) cache->tail = entry;
+}
+
+/**
+ * @brief Adds a new entry to the index (the file must already exist)
+ */
+static int dcache_add(struct derivative_cache* cache, const char* key, size_t size)
+{
+    struct dcache_entry* entry = calloc(1, sizeof(struct dcache_entry));
+    M_EXIT_IF_NULL(entry, sizeof(struct dcache_entry));
+    strncpy(entry->key, key, DCACHE_MAX_KEY);
+    entry->size = size;
+    const size_t bucket = dcache_hash(key);
+    entry->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    dcache_push_front(cache, entry);
+    cache->bytes += size;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Removes an entry from the index and deletes its file
+ */
+static void dcache_evict(struct derivative_cache* cache, struct dcache_entry* entry)
+{
+    struct dcache_entry** link = &cache->buckets[dcache_hash(entry->key)];
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+    dcache_unlink(cache, entry);
+    cache->bytes -= entry->size;
+
+    char path[DCACHE_MAX_PATH + 1];
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, entry->key);
+    remove(path);
+    free(entry);
+}
+
+/**
+ * @brief Evicts least recently used entries until extra bytes fit in the bound
+ */
+static void dcache_make_room(struct derivative_cache* cache, size_t extra)
+{
+    while (cache->tail != NULL && cache->bytes + extra > cache->max_bytes) {
+        dcache_evict(cache, cache->tail);
+    }
+}
+
+/********************************************************************//**
+ * Opens (and creates if needed) a cache directory and indexes its variants.
+ */
+int dcache_init(struct derivative_cache* cache, const char* dir, uint64_t max_bytes)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(dir);
+    M_REQUIRE(strlen(dir) > 0 && strlen(dir) <= DCACHE_MAX_DIR, ERR_INVALID_FILENAME, "invalid cache directory", NULL);
+
+    memset(cache, 0, sizeof(struct derivative_cache));
+    strncpy(cache->dir, dir, DCACHE_MAX_DIR);
+    cache->max_bytes = max_bytes;
+
+    M_IO_CHECK_WITH_CODE(mkdir(dir, 0700) != 0 && errno != EEXIST, {});
+
+    // indexes the variants left by a previous run
+    DIR* directory = opendir(dir);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(directory, ERR_IO);
+    struct dirent* file = NULL;
+    while ((file = readdir(directory)) != NULL) {
+        char path[DCACHE_MAX_PATH + 1];
+        struct stat st;
+        if (strlen(file->d_name) > DCACHE_MAX_KEY || file->d_name[0] == '.') continue;
+        const int length = snprintf(path, sizeof(path), "%s/%s", cache->dir, file->d_name);
+        if (length < 0 || (size_t) length >= sizeof(path) || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        M_EXIT_IF_ERR_DO_SOMETHING(dcache_add(cache, file->d_name, (size_t) st.st_size), {
+            closedir(directory);
+            dcache_free(cache);
+        });
+    }
+    closedir(directory);
+    dcache_make_room(cache, 0);
+
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Frees the in-memory index of a cache.
+ */
+void dcache_free(struct derivative_cache* cache)
+{
+    if (cache == NULL) return;
+    struct dcache_entry* entry = cache->head;
+    while (entry != NULL) {
+        struct dcache_entry* next = entry->next;
+        free(entry);
+        entry = next;
+    }
+    memset(cache->buckets, 0, sizeof(cache->buckets));
+    cache->head = NULL;
+    cache->tail = NULL;
+    cache->bytes = 0;
+}
+
+/********************************************************************//**
+ * Reads a variant from the cache and marks it as most recently used.
+ */
+int dcache_get(struct derivative_cache* cache, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+               uint16_t width, const struct res_encoding* encoding, char** buffer, size_t* size)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(SHA);
+    M_REQUIRE_NON_NULL(encoding);
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(size);
+
+    char key[DCACHE_MAX_KEY + 1];
+    M_EXIT_IF_ERR(dcache_key(SHA, width, encoding, key));
+    struct dcache_entry* entry = dcache_find(cache, key);
+    if (entry == NULL) return ERR_FILE_NOT_FOUND;
+
+    char path[DCACHE_MAX_PATH + 1];
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, key);
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        // removed behind our back: forget it
+        dcache_evict(cache, entry);
+        return ERR_FILE_NOT_FOUND;
+    }
+
+    *buffer = malloc(entry->size);
+    M_CHECK_WITH_CODE(*buffer == NULL, fclose(file), ERR_OUT_OF_MEMORY);
+    M_IO_CHECK_WITH_CODE(
+    fread(*buffer, entry->size, 1, file) != 1, {
+        fclose(file);
+        free(*buffer);
+        *buffer = NULL;
+    });
+    fclose(file);
+    *size = entry->size;
+
+    // most recently used
+    dcache_unlink(cache, entry);
+    dcache_push_front(cache, entry);
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Stores a variant in the cache, evicting least recently used variants.
+ */
+int dcache_put(struct derivative_cache* cache, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+               uint16_t width, const struct res_encoding* encoding, const void* buffer, size_t size)
+{
+    M_REQUIRE_NON_NULL(cache);
+    M_REQUIRE_NON_NULL(SHA);
+    M_REQUIRE_NON_NULL(encoding);
+    M_REQUIRE_NON_NULL(buffer);
+
+    // a variant larger than the whole cache is simply not cached
+    if (size > cache->max_bytes) return ERR_NONE;
+
+    char key[DCACHE_MAX_KEY + 1];
+    M_EXIT_IF_ERR(dcache_key(SHA, width, encoding, key));
+    struct dcache_entry* entry = dcache_find(cache, key);
+    if (entry != NULL) dcache_evict(cache, entry);
+    dcache_make_room(cache, size);
+
+    char path[DCACHE_MAX_PATH + 1];
+    snprintf(path, sizeof(path), "%s/%s", cache->dir, key);
+    FILE* file = fopen(path, "wb");
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(file, ERR_IO);
+    M_IO_CHECK_WITH_CODE(
+    fwrite(buffer, size, 1, file) != 1, {
+        fclose(file);
+        remove(path);
+    });
+    M_IO_CHECK_WITH_CODE(fclose(file) != 0, remove(path));
+
+    M_EXIT_IF_ERR_DO_SOMETHING(dcache_add(cache, key, size), remove(path));
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Tells whether a variant is in the cache.
+ */
+int dcache_contains(const struct derivative_cache* cache, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                    uint16_t width, const struct res_encoding* encoding)
+{
+    char key[DCACHE_MAX_KEY + 1];
+    if (cache == NULL || SHA == NULL || encoding == NULL
+        || dcache_key(SHA, width, encoding, key) != ERR_NONE) return 0;
+    return dcache_find(cache, key) != NULL;
+}
@@ -0,0 +1,100 @@
+/**
+ * @file derivative_cache.h
+ * @brief Size-bounded on-disk cache of on-the-fly resized images, with LRU eviction.
+ *
+ * Entries are keyed by the SHA of the original image, the width bucket and the
+ * encoding settings, so that duplicated images share their variants, deleted
+ * images simply age out of the cache, and variants encoded with other settings
+ * (e.g. after a change of -w_enc) are never served.
+ */
+#pragma once
+#include "imgStore.h"
+#include <stdint.h>
+#include <stddef.h>
+
+#define DCACHE_MAX_DIR 128
+#define DCACHE_NB_BUCKETS 1024
+// <sha hex>_<width>_q<quality>_s<subsample>_m<strip><extension>
+#define DCACHE_MAX_KEY (2*SHA256_DIGEST_LENGTH + 1 + 5 + 2 + 3 + 2 + 1 + 2 + 1 + 5)
+
+/**
+ * @brief One cached variant. Entries are linked both in a hash chain and in
+ * the LRU list (most recently used first).
+ */
+struct dcache_entry {
+    char key[DCACHE_MAX_KEY + 1]; // file name of the variant in the cache directory
+    size_t size; // size of the variant in bytes
+    struct dcache_entry* prev; // more recently used entry
+    struct dcache_entry* next; // less recently used entry
+    struct dcache_entry* chain; // next entry in the same hash bucket
+};
+
+/**
+ * @brief In-memory index of the cache directory
+ */
+struct derivative_cache {
+    char dir[DCACHE_MAX_DIR + 1]; // directory holding the variants
+    uint64_t max_bytes; // bound on the total size of the variants
+    uint64_t bytes; // current total size of the variants
+    struct dcache_entry* buckets[DCACHE_NB_BUCKETS]; // hash table on the keys
+    struct dcache_entry* head; // most recently used entry
+    struct dcache_entry* tail; // least recently used entry
+};
+
+/**
+ * @brief Opens (and creates if needed) a cache directory and indexes the variants it already holds.
+ *
+ * @param cache the cache to initialize
+ * @param dir the cache directory
+ * @param max_bytes bound on the total size of the cached variants
+ * @return int Some error code. 0 if no error.
+ */
+int dcache_init(struct derivative_cache* cache, const char* dir, uint64_t max_bytes);
+
+/**
+ * @brief Frees the in-memory index of a cache. Cached files are kept on disk.
+ *
+ * @param cache the cache to free
+ */
+void dcache_free(struct derivative_cache* cache);
+
+/**
+ * @brief Reads a variant from the cache and marks it as most recently used.
+ *
+ * @param cache the cache
+ * @param SHA SHA of the original image
+ * @param width width bucket of the variant
+ * @param encoding encoding settings of the variant
+ * @param buffer output: the variant, to be freed by the caller
+ * @param size output: size of the variant
+ * @return int ERR_FILE_NOT_FOUND on a miss, some other error code, 0 if no error.
+ */
+int dcache_get(struct derivative_cache* cache, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+               uint16_t width, const struct res_encoding* encoding, char** buffer, size_t* size);
+
+/**
+ * @brief Stores a variant in the cache, evicting least recently used variants to stay in bounds.
+ *
+ * @param cache the cache
+ * @param SHA SHA of the original image
+ * @param width width bucket of the variant
+ * @param encoding encoding settings of the variant
+ * @param buffer the variant
+ * @param size size of the variant
+ * @return int Some error code. 0 if no error.
+ */
+int dcache_put(struct derivative_cache* cache, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+               uint16_t width, const struct res_encoding* encoding, const void* buffer, size_t size);
+
+/**
+ * @brief Tells whether a variant is in the cache, without reading it nor
+ * marking it as used.
+ *
+ * @param cache the cache
+ * @param SHA SHA of the original image
+ * @param width width bucket of the variant
+ * @param encoding encoding settings of the variant
+ * @return int 1 if it is cached
+ */
+int dcache_contains(const struct derivative_cache* cache, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                    uint16_t width, const struct res_encoding* encoding);
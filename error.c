@@ -19,6 +19,10 @@ const char * const ERR_MESSAGES[] = {
     "Not implemented (yet?)",
     "Existing image ID",
     "Image manipulation library error",
+    "Image too large",
+    "Read-only imgStore",
+    "Server busy, retry later",
+    "Batch too large, ask for fewer images",
     "Debug",
 
     "no error (shall not be displayed)" // ERR_LAST
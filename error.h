@@ -41,6 +41,10 @@ typedef enum {
     NOT_IMPLEMENTED,
     ERR_DUPLICATE_ID,
     ERR_IMGLIB,
+    ERR_IMAGE_TOO_LARGE,
+    ERR_READ_ONLY,
+    ERR_BUSY,
+    ERR_BATCH_TOO_LARGE,
     ERR_DEBUG,
 
     NB_ERR // not an actual error but to have the total number of errors
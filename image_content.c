@@ -9,6 +9,7 @@
 #include <vips/vips.h>
 #include "error.h"
 #include <stdlib.h>
+#include <string.h> // for memcmp
 
 /**
  * @brief Computes the shrinking factor (keeping aspect ratio)
@@ -21,6 +22,61 @@ double shrink_value(const VipsImage *image,
                     int max_width,
                     int max_height);
 
+// limits enforced on inserted and resized images, see set_resize_limits()
+static uint64_t max_pixels = DEFAULT_MAX_PIXELS;
+static uint64_t max_memory = DEFAULT_RESIZE_MEMORY;
+
+// JPEG decoding may have up to 4 bands (CMYK)
+#define MAX_BANDS 4
+// rows held by vips in sequential mode: a few tiles plus the resampling kernel
+#define WINDOW_ROWS 256
+#define KERNEL_ROWS 6
+
+/**
+ * @brief Chooses the JPEG shrink-on-load factor (1, 2, 4 or 8), leaving at
+ * least a factor of 2 to vips_resize so that quality does not suffer.
+ *
+ * @param width width of the original
+ * @param height height of the original
+ * @param max_width The maximum width allowed for resized creation.
+ * @param max_height The maximum height allowed for resized creation.
+ * @return int the shrink factor
+ */
+static int load_shrink(uint32_t width, uint32_t height, int max_width, int max_height);
+
+/**
+ * @brief Estimates the peak memory of a resize operation in sequential mode.
+ *
+ * @param metadata metadata of the image (size and res_orig)
+ * @param shrink shrink-on-load factor
+ * @param max_width The maximum width allowed for resized creation.
+ * @param max_height The maximum height allowed for resized creation.
+ * @return uint64_t the estimate, in bytes
+ */
+static uint64_t resize_memory(const struct img_metadata* metadata, int shrink, int max_width, int max_height);
+
+/**
+ * @brief Encodes an image with the settings of a resized resolution.
+ *
+ * @param image The image to be encoded.
+ * @param encoding The encoder, quality, chroma subsampling and stripping to use.
+ * @param buffer output: the encoded image, to be freed with g_free().
+ * @param size output: size of the encoded image
+ * @return int 0 if no error, non-zero vips error otherwise.
+ */
+int encode_image(VipsImage *image, const struct res_encoding* encoding, void** buffer, size_t* size);
+
+/**
+ * @brief Points a resized resolution at bytes already in the file when resizing
+ * would not shrink the image, without writing anything.
+ *
+ * @param internal_code resized resolution code
+ * @param imgst_file file
+ * @param index index of image
+ * @return int 1 if the resolution was aliased, 0 if it has to be resized.
+ */
+static int alias_resolution(int internal_code, struct imgst_file* imgst_file, size_t index);
+
 /**
  * @brief Creates a new resized image and updates size and offset in the file.
  *
@@ -41,15 +97,17 @@ int lazily_resize(int internal_code, struct imgst_file* imgst_file, size_t index
     M_REQUIRE_NON_NULL_IMGST_FILE(imgst_file);
     M_CHECK_IMGST_FILE_INDEX(imgst_file, index);
     // check resolution
-    M_REQUIRE(internal_code < NB_RES && internal_code >= 0, ERR_RESOLUTIONS, ERR_MESSAGES[ERR_RESOLUTIONS], NULL);
+    M_REQUIRE(is_valid_resolution(&imgst_file->header, internal_code), ERR_RESOLUTIONS, ERR_MESSAGES[ERR_RESOLUTIONS], NULL);
 
 
     // if internal_code is RES_ORIG, do nothing and return ERR_NONE
     if (internal_code != RES_ORIG) {
         // if the offset is not 0, that means the image already exists in this resolution
         if (imgst_file->metadata[index].offset[internal_code] == 0) {
-            // Resize the image using vips
-            M_EXIT_IF_ERR(resize_image(internal_code, imgst_file, index));
+            // Resize the image using vips, unless existing bytes can be reused
+            if (!alias_resolution(internal_code, imgst_file, index)) {
+                M_EXIT_IF_ERR(resize_image(internal_code, imgst_file, index));
+            }
 
             // updates matadata after resizing
             M_EXIT_IF_ERR(update_disk_metadata(imgst_file, index));
@@ -58,32 +116,163 @@ int lazily_resize(int internal_code, struct imgst_file* imgst_file, size_t index
     return ERR_NONE;
 }
 
+/********************************************************************//**
+ * Computes the dimensions of an image resized to fit given bounds (keeping aspect ratio).
+ */
+static void resized_dimensions(const struct img_metadata* metadata, int max_width, int max_height,
+                               uint32_t* width, uint32_t* height)
+{
+    const double h_shrink = (double) max_width  / (double) metadata->res_orig[0];
+    const double v_shrink = (double) max_height / (double) metadata->res_orig[1];
+    const double ratio = h_shrink > v_shrink ? v_shrink : h_shrink;
+    *width  = (uint32_t) (metadata->res_orig[0] * ratio + 0.5);
+    *height = (uint32_t) (metadata->res_orig[1] * ratio + 0.5);
+}
+
+/********************************************************************//**
+ * Points a resized resolution at the original if the original already fits in
+ * its bounds, or at another resolution resized to the same dimensions with the
+ * same encoding.
+ */
+static int alias_resolution(int internal_code, struct imgst_file* imgst_file, size_t index)
+{
+    const struct imgst_header* header = &imgst_file->header;
+    struct img_metadata* metadata = &imgst_file->metadata[index];
+    if (metadata->res_orig[0] == 0 || metadata->res_orig[1] == 0) return 0;
+
+    const int max_width  = header->res_resized[internal_code*2];
+    const int max_height = header->res_resized[internal_code*2+1];
+    if (metadata->res_orig[0] <= (uint32_t) max_width && metadata->res_orig[1] <= (uint32_t) max_height) {
+        metadata->offset[internal_code] = metadata->offset[RES_ORIG];
+        metadata->size[internal_code] = metadata->size[RES_ORIG];
+        return 1;
+    }
+
+    uint32_t width = 0, height = 0;
+    resized_dimensions(metadata, max_width, max_height, &width, &height);
+    for (int res = 0; res < header->nb_resized; res++) {
+        if (res == internal_code || metadata->offset[res] == 0 || metadata->offset[res] == metadata->offset[RES_ORIG]
+            || memcmp(&header->res_encoding[res], &header->res_encoding[internal_code], sizeof(struct res_encoding))) {
+            continue;
+        }
+        uint32_t other_width = 0, other_height = 0;
+        resized_dimensions(metadata, header->res_resized[res*2], header->res_resized[res*2+1], &other_width, &other_height);
+        if (other_width == width && other_height == height) {
+            metadata->offset[internal_code] = metadata->offset[res];
+            metadata->size[internal_code] = metadata->size[res];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/********************************************************************//**
+ * Points the resized resolutions of a newly inserted image at its original
+ * when the original already fits in their bounds.
+ */
+void alias_small_original(struct imgst_file* imgst_file, size_t index)
+{
+    if (imgst_file == NULL || imgst_file->metadata == NULL || index >= imgst_file->header.max_files) return;
+    for (int res = 0; res < imgst_file->header.nb_resized; res++) {
+        if (imgst_file->metadata[index].offset[res] == 0) {
+            const int max_width  = imgst_file->header.res_resized[res*2];
+            const int max_height = imgst_file->header.res_resized[res*2+1];
+            if (imgst_file->metadata[index].res_orig[0] <= (uint32_t) max_width
+                && imgst_file->metadata[index].res_orig[1] <= (uint32_t) max_height) {
+                alias_resolution(res, imgst_file, index);
+            }
+        }
+    }
+}
+
 /********************************************************************//**
  * Resizes the image and updates on disk the size and offset.
  */
 int resize_image(int internal_code, struct imgst_file* imgst_file, size_t index)
 {
+    // resizes the original into a new buffer
+    void* new_buffer = NULL;
+    size_t new_size = 0;
+    M_EXIT_IF_ERR(resize_to_buffer(imgst_file, index,
+                                   imgst_file->header.res_resized[internal_code*2],
+                                   imgst_file->header.res_resized[internal_code*2+1],
+                                   &imgst_file->header.res_encoding[internal_code],
+                                   &new_buffer, &new_size));
+
+    // writes resized image at the end of file
+    long next_position;
+    M_EXIT_IF_ERR_DO_SOMETHING(
+    write_disk_image(imgst_file, new_buffer, new_size, &next_position), {
+        g_free(new_buffer);
+        new_buffer = NULL;
+    });
+
+    // updates size and offset of the resized file in the metadata
+    imgst_file->metadata[index].size[internal_code] = (uint32_t) new_size;
+    imgst_file->metadata[index].offset[internal_code] = (uint64_t) next_position;
+
+    g_free(new_buffer);
+    new_buffer = NULL;
+
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Resizes the original of an image to fit given bounds and encodes it.
+ */
+int resize_to_buffer(const struct imgst_file* imgst_file, size_t index,
+                     int max_width, int max_height, const struct res_encoding* encoding,
+                     void** new_buffer, size_t* new_size)
+{
+    M_REQUIRE_NON_NULL_IMGST_FILE(imgst_file);
+    M_CHECK_IMGST_FILE_INDEX(imgst_file, index);
+    M_REQUIRE_NON_NULL(encoding);
+    M_REQUIRE_NON_NULL(new_buffer);
+    M_REQUIRE_NON_NULL(new_size);
+    M_REQUIRE(max_width > 0 && max_height > 0, ERR_RESOLUTIONS, ERR_MESSAGES[ERR_RESOLUTIONS], NULL);
+
+    // rejects oversized originals before reading anything
+    const struct img_metadata* metadata = &imgst_file->metadata[index];
+    M_EXIT_IF_ERR(check_image_size(metadata->res_orig[0], metadata->res_orig[1]));
+    const int shrink = load_shrink(metadata->res_orig[0], metadata->res_orig[1], max_width, max_height);
+    M_REQUIRE(resize_memory(metadata, shrink, max_width, max_height) <= max_memory,
+              ERR_IMAGE_TOO_LARGE, ERR_MESSAGES[ERR_IMAGE_TOO_LARGE], NULL);
+
     // original image object
     VipsObject *original = VIPS_OBJECT(vips_image_new());
     VipsImage **original_array = (VipsImage**) vips_object_local_array (original, 1);
 
     // allocates buffer with original size
-    uint32_t size_orig =  imgst_file->metadata[index].size[RES_ORIG];
+    uint32_t size_orig =  metadata->size[RES_ORIG];
     void* buffer = malloc(size_orig);
-    M_EXIT_IF_NULL(buffer, size_orig);
-    read_disk_image(imgst_file->file, &buffer, size_orig, (long)imgst_file->metadata[index].offset[RES_ORIG]);
+    M_CHECK_WITH_CODE(buffer == NULL, g_object_unref(original), ERR_OUT_OF_MEMORY);
+    M_EXIT_IF_ERR_DO_SOMETHING(
+    read_disk_image(imgst_file->file, &buffer, size_orig, (long)metadata->offset[RES_ORIG]), {
+        g_object_unref(original);
+        free(buffer);
+        buffer = NULL;
+    });
 
-    // loads vips image from buffer
+    // loads vips image from buffer: decoded row by row, already shrunk by the JPEG decoder
     M_IMGLIB_CHECK_WITH_CODE(
-    vips_jpegload_buffer (buffer, size_orig, original_array, NULL) != 0, {
+    vips_jpegload_buffer (buffer, size_orig, original_array,
+                          "access", VIPS_ACCESS_SEQUENTIAL, "shrink", shrink, NULL) != 0, {
         g_object_unref(original);
         free(buffer);
         buffer = NULL;
     });
 
+    // the metadata may not match the actual content: checks again from the JPEG header
+    M_EXIT_IF_ERR_DO_SOMETHING(
+    check_image_size((uint32_t) original_array[0]->Xsize * (uint32_t) shrink,
+                     (uint32_t) original_array[0]->Ysize * (uint32_t) shrink), {
+        g_object_unref(original);
+        free(buffer);
+        buffer = NULL;
+    });
 
     // calulates scale factor
-    const double ratio = shrink_value(original_array[0], imgst_file->header.res_resized[internal_code*2], imgst_file->header.res_resized[internal_code*2+1]);
+    const double ratio = shrink_value(original_array[0], max_width, max_height);
 
     // resized image object
     VipsObject *resized = VIPS_OBJECT(vips_image_new());
@@ -99,46 +288,105 @@ int resize_image(int internal_code, struct imgst_file* imgst_file, size_t index)
     });
 
     // saves resized image into a new buffer
-    void* new_buffer = NULL;
-    size_t new_size = 0;
+    *new_buffer = NULL;
+    *new_size = 0;
 
     M_IMGLIB_CHECK_WITH_CODE(
-    vips_jpegsave_buffer(resized_array[0], &new_buffer, &new_size, NULL) != 0, {
-        g_object_unref(resized);
-        g_object_unref(original);
-        free(buffer);
-        buffer = NULL;
-    });
-
-    // updates size in the matadata
-    imgst_file->metadata[index].size[internal_code] = (uint32_t) new_size;
-
-    // writes resized image at the end of file
-    long next_position;
-    M_EXIT_IF_ERR_DO_SOMETHING(
-    write_disk_image(imgst_file, new_buffer, new_size, &next_position), {
+    encode_image(resized_array[0], encoding, new_buffer, new_size) != 0, {
         g_object_unref(resized);
         g_object_unref(original);
-        g_free(new_buffer);
-        new_buffer = NULL;
         free(buffer);
         buffer = NULL;
     });
 
-    // updates the offset of the resized file in the metadata
-    imgst_file->metadata[index].offset[internal_code] = (uint64_t) next_position;
-
     // dereference objects and free buffer
     g_object_unref(resized);
     g_object_unref(original);
-    g_free(new_buffer);
-    new_buffer = NULL;
     free(buffer);
     buffer = NULL;
 
     return ERR_NONE;
 }
 
+/********************************************************************//**
+ * Chooses the JPEG shrink-on-load factor.
+ */
+static int load_shrink(uint32_t width, uint32_t height, int max_width, int max_height)
+{
+    const double h_shrink = (double) width  / (double) max_width;
+    const double v_shrink = (double) height / (double) max_height;
+    const double total = h_shrink > v_shrink ? h_shrink : v_shrink;
+    int shrink = 1;
+    while (shrink < 8 && 4.0 * shrink <= total) {
+        shrink *= 2;
+    }
+    return shrink;
+}
+
+/********************************************************************//**
+ * Estimates the peak memory of a resize operation: the compressed original,
+ * the window of decoded rows and the resized image handed to the encoder.
+ */
+static uint64_t resize_memory(const struct img_metadata* metadata, int shrink, int max_width, int max_height)
+{
+    const uint64_t decoded_width = (metadata->res_orig[0] + (uint32_t) shrink - 1) / (uint32_t) shrink;
+    const uint64_t residual = metadata->res_orig[0] / (uint32_t) shrink / (uint32_t) max_width
+                              + metadata->res_orig[1] / (uint32_t) shrink / (uint32_t) max_height + 1;
+    return metadata->size[RES_ORIG]
+           + decoded_width * MAX_BANDS * (WINDOW_ROWS + KERNEL_ROWS * residual)
+           + (uint64_t) max_width * (uint64_t) max_height * MAX_BANDS;
+}
+
+/********************************************************************//**
+ * Sets the limits enforced on every image that is inserted or resized.
+ */
+void set_resize_limits(uint64_t pixels, uint64_t memory)
+{
+    max_pixels = pixels;
+    max_memory = memory;
+    // results kept by the vips operation cache count in the budget as well
+    vips_cache_set_max_mem((size_t) memory);
+}
+
+/********************************************************************//**
+ * Checks the dimensions of an original against the pixel limit.
+ */
+int check_image_size(uint32_t width, uint32_t height)
+{
+    M_REQUIRE(width > 0 && height > 0, ERR_IMGLIB, ERR_MESSAGES[ERR_IMGLIB], NULL);
+    M_REQUIRE((uint64_t) width * height <= max_pixels, ERR_IMAGE_TOO_LARGE,
+              ERR_MESSAGES[ERR_IMAGE_TOO_LARGE], NULL);
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Encodes an image with the settings of a resized resolution.
+ */
+int encode_image(VipsImage *image, const struct res_encoding* encoding, void** buffer, size_t* size)
+{
+    const int quality = encoding->quality > 0 && encoding->quality <= MAX_QUALITY ? encoding->quality : DEFAULT_QUALITY;
+    const gboolean strip = encoding->strip ? TRUE : FALSE;
+    VipsForeignSubsample subsample = VIPS_FOREIGN_SUBSAMPLE_AUTO;
+    if (encoding->subsample == SUBSAMPLE_ON) subsample = VIPS_FOREIGN_SUBSAMPLE_ON;
+    if (encoding->subsample == SUBSAMPLE_OFF) subsample = VIPS_FOREIGN_SUBSAMPLE_OFF;
+
+    switch (encoding->encoder) {
+    case ENC_JPEG:
+        return vips_jpegsave_buffer(image, buffer, size, "Q", quality, "strip", strip,
+                                    "subsample_mode", subsample, NULL);
+    case ENC_WEBP:
+        // lossy WebP is always 4:2:0, turning subsampling off asks for the sharper "smart" subsampling
+        return vips_webpsave_buffer(image, buffer, size, "Q", quality, "strip", strip,
+                                    "smart_subsample", encoding->subsample == SUBSAMPLE_OFF ? TRUE : FALSE, NULL);
+    case ENC_AVIF:
+        return vips_heifsave_buffer(image, buffer, size, "Q", quality, "strip", strip,
+                                    "compression", VIPS_FOREIGN_HEIF_COMPRESSION_AV1,
+                                    "subsample_mode", subsample, NULL);
+    default:
+        return -1;
+    }
+}
+
 /********************************************************************//**
  * Computes the shrinking factor (keeping aspect ratio)
  */
@@ -163,7 +411,8 @@ int get_resolution(uint32_t* height, uint32_t* width, const char* image_buffer,
 
     // load vips image
     M_IMGLIB_CHECK_WITH_CODE(
-    vips_jpegload_buffer((void*) image_buffer, image_size, loaded_image, NULL) != 0,
+    vips_jpegload_buffer((void*) image_buffer, image_size, loaded_image,
+                         "access", VIPS_ACCESS_SEQUENTIAL, NULL) != 0,
     g_object_unref(loaded));
 
     // get height and width
@@ -8,6 +8,9 @@
 #include <stdint.h>
 #include "imgStore.h"
 
+#define DEFAULT_MAX_PIXELS (100 * 1000 * 1000) // 100 Mpx, e.g. 12000x8000
+#define DEFAULT_RESIZE_MEMORY (256 * 1024 * 1024) // bytes
+
 /**
  * @brief Creates a new variant of the specified image, only if it is absent from the file.
  * Creates a copy of the image at the end of the file and updates the metadata accordingly.
@@ -20,7 +23,53 @@
 int lazily_resize (int internal_code, struct imgst_file* imgst_file, size_t index);
 
 /**
- * @brief Get the resolution of an image
+ * @brief Points the resized resolutions of a newly inserted image at its
+ * original when the original already fits in their bounds, so that no
+ * re-encoded copy is ever stored. Only updates the in-memory metadata.
+ *
+ * @param imgst_file imgStore file that we are working with
+ * @param index position of the image to treat, its res_orig must be set
+ */
+void alias_small_original(struct imgst_file* imgst_file, size_t index);
+
+/**
+ * @brief Resizes the original of an image so that it fits in the given bounds
+ * (keeping aspect ratio) and encodes it, without touching the imgStore file.
+ *
+ * @param imgst_file imgStore file that we are working with
+ * @param index position of the image to treat
+ * @param max_width maximum width of the resized image
+ * @param max_height maximum height of the resized image
+ * @param encoding encoder settings of the resized image
+ * @param new_buffer output: the resized image, to be freed with g_free()
+ * @param new_size output: size of the resized image
+ * @return int Some error code. 0 if no error.
+ */
+int resize_to_buffer(const struct imgst_file* imgst_file, size_t index,
+                     int max_width, int max_height, const struct res_encoding* encoding,
+                     void** new_buffer, size_t* new_size);
+
+/**
+ * @brief Sets the limits enforced on every image that is inserted or resized.
+ * Must be called after VIPS_INIT, as it also bounds the vips operation cache.
+ *
+ * @param max_pixels maximum number of pixels (width x height) of an original
+ * @param max_memory memory budget of one resize operation, in bytes
+ */
+void set_resize_limits(uint64_t max_pixels, uint64_t max_memory);
+
+/**
+ * @brief Checks the dimensions of an original against the pixel limit,
+ * before anything gets decoded.
+ *
+ * @param width width of the image
+ * @param height height of the image
+ * @return int ERR_IMAGE_TOO_LARGE if over the limit, ERR_IMGLIB for an empty image, 0 if no error.
+ */
+int check_image_size(uint32_t width, uint32_t height);
+
+/**
+ * @brief Get the resolution of an image. Only the JPEG header is decoded.
  *
  * @param height height
  * @param width width
@@ -32,21 +32,52 @@
 #define MAX_MAX_FILES 100000
 #define MAX_THUMB_RES 128
 #define MAX_SMALL_RES 512
+#define MAX_RESIZED_RES 4096 // max. resolution of an additional resized resolution
+#define MAX_RES_NAME    15  // max. size of a resolution name
+#define MAX_NB_RES       8  // max. number of resolutions, original included
 
 /* For is_valid in imgst_metadata */
 #define EMPTY 0
 #define NON_EMPTY 1
 
 // imgStore library internal codes for different image resolutions.
+// Resized resolutions use the codes 0 to imgst_header.nb_resized-1,
+// thumbnail and small being always the first two of them.
 #define RES_THUMB 0
 #define RES_SMALL 1
-#define RES_ORIG  2
-#define NB_RES    3
+#define RES_ORIG  (MAX_NB_RES - 1)
+#define NB_DEFAULT_RESIZED 2
+
+// imgStore library internal codes for the encoders of resized images.
+#define ENC_JPEG 0
+#define ENC_WEBP 1
+#define ENC_AVIF 2
+#define NB_ENC   3
+#define MAX_EXT_NAME 5 // length of the longest extension
+
+// imgStore library internal codes for chroma subsampling of resized images.
+#define SUBSAMPLE_AUTO 0
+#define SUBSAMPLE_ON   1
+#define SUBSAMPLE_OFF  2
+
+#define DEFAULT_QUALITY 75
+#define MAX_QUALITY    100
 
 #ifdef __cplusplus
 extern "C" {
 #endif
 
+/**
+ * @brief Encoding settings of one resized resolution
+ *
+ */
+struct res_encoding {
+    uint8_t encoder; // ENC_JPEG, ENC_WEBP or ENC_AVIF
+    uint8_t quality; // quality factor of the encoder, from 1 to MAX_QUALITY
+    uint8_t subsample; // chroma subsampling: SUBSAMPLE_AUTO, SUBSAMPLE_ON or SUBSAMPLE_OFF
+    uint8_t strip; // 1 if metadata (EXIF, ICC, XMP) is removed from the resized image
+};
+
 /**
  * @brief Header containing the configuration information of imgStore
  *
@@ -56,7 +87,10 @@ struct imgst_header {
     uint32_t imgst_version; // image database version, increased after each modification
     uint32_t num_files; // number of valid images in the database
     const uint32_t max_files; // maximum number of files, does not change after creation
-    const uint16_t res_resized[2*(NB_RES-1)]; // maximum resolutions of different image resolutions, elements do not change after creation
+    const uint16_t nb_resized; // number of resized resolutions, does not change after creation
+    const uint16_t res_resized[2*(MAX_NB_RES-1)]; // maximum resolutions of different image resolutions, elements do not change after creation
+    const char res_names[MAX_NB_RES-1][MAX_RES_NAME+1]; // names of the resized resolutions, elements do not change after creation
+    const struct res_encoding res_encoding[MAX_NB_RES-1]; // encoding of the resized resolutions, elements do not change after creation
     uint32_t unused_32;
     uint64_t unused_64;
 };
@@ -69,8 +103,8 @@ struct img_metadata {
     char img_id[MAX_IMG_ID+1]; // image id
     unsigned char SHA[SHA256_DIGEST_LENGTH]; // hash code of the image
     uint32_t res_orig[2]; // resolution of the original image
-    uint32_t size[NB_RES]; // size of the images of different resolutions in the file of the database
-    uint64_t offset[NB_RES]; // positions of the images in the file of the database
+    uint32_t size[MAX_NB_RES]; // size of the images of different resolutions in the file of the database
+    uint64_t offset[MAX_NB_RES]; // positions of the images in the file of the database
     uint16_t is_valid; // indicates if the image is still used
     uint16_t unused_16;
 };
@@ -92,12 +126,21 @@ struct imgst_file {
  */
 void print_header(const struct imgst_header* header);
 
+/**
+ * @brief Writes a SHA as a human-readable hexadecimal string.
+ *
+ * @param SHA The SHA to be converted.
+ * @param sha_string output: at least 2*SHA256_DIGEST_LENGTH+1 characters.
+ */
+void sha_to_string(const unsigned char* SHA, char* sha_string);
+
 /**
  * @brief Prints image metadata informations.
  *
  * @param metadata The metadata of one image.
+ * @param header The header of the imgStore, giving the names of the resolutions.
  */
-void print_metadata (const struct img_metadata*  metadata);
+void print_metadata (const struct img_metadata*  metadata, const struct imgst_header* header);
 
 /**
  * @brief Open imgStore file, read the header and all the metadata.
@@ -109,6 +152,30 @@ void print_metadata (const struct img_metadata*  metadata);
  */
 int do_open (const char* imgst_filename, const char* open_mode, struct imgst_file* imgst_file);
 
+/**
+ * @brief Reads the version of the store on disk, without touching the header in
+ * memory: a process that opened the store read-only compares it with its own
+ * imgst_version to notice that the writer modified the store.
+ *
+ * @param imgst_file the open store
+ * @param version output: imgst_version on disk
+ * @return int Some error code. 0 if no error.
+ */
+int read_disk_version(const struct imgst_file* imgst_file, uint32_t* version);
+
+/**
+ * @brief Reads the header and the metadata again from disk, e.g. in a read-only
+ * process after read_disk_version() changed. Writers update the metadata before
+ * the header, so the metadata read is at least as recent as the version read.
+ * If the version moves during the read, nothing is changed.
+ *
+ * @param imgst_file the open store
+ * @param previous output, can be NULL: the metadata that was replaced, to be
+ * freed by the caller; NULL if nothing was replaced
+ * @return int Some error code. 0 if no error.
+ */
+int do_refresh(struct imgst_file* imgst_file, struct img_metadata** previous);
+
 /**
  * @brief Do some clean-up for imgStore file handling.
  *
@@ -135,6 +202,44 @@ enum do_list_mode {STDOUT, JSON};
  */
 char* do_list(const struct imgst_file* imgst_file, const enum do_list_mode mode);
 
+/**
+ * @brief Returns the image ids of several imgStores as one JSON object, as
+ * do_list does in JSON mode for one. The resolutions are those of the first.
+ *
+ * @param stores In memory structures with header and metadata.
+ * @param nb_stores number of stores, at least 1
+ * @return the JSON object converted to string, NULL on error. The string must be freed by the caller.
+ */
+char* do_list_json(const struct imgst_file* const stores[], size_t nb_stores);
+
+// end of a page: ],"Next":"<20 digits>"} and a null byte
+#define LIST_PAGE_TAIL 32
+// smallest page buffer: the resolution names and one image id, escaped in the worst case, and the end
+#define LIST_PAGE_MIN_SIZE (32 + MAX_NB_RES * (6 * MAX_RES_NAME + 3) + 6 * MAX_IMG_ID + 3 + LIST_PAGE_TAIL)
+
+/**
+ * @brief Writes one page of the image ids of one or several imgStores as a
+ * JSON object {"Resolutions":[...],"Images":[...],"Next":"<cursor>"|null} into
+ * a buffer, without building a JSON tree. The cursor of slot i of store s is
+ * s * MAX_MAX_FILES + i, so that it is the slot itself with a single store.
+ * The page holds the valid images from the cursor on, at most limit of them,
+ * and stops early if the buffer is full. Slots do not move, so pages stay
+ * consistent with inserts and deletes, except that images inserted into slots
+ * already listed are not seen. The resolutions are those of the first store.
+ *
+ * @param stores In memory structures with header and metadata.
+ * @param nb_stores number of stores, at least 1
+ * @param cursor position to start from, 0 for the first page
+ * @param limit maximal number of images in the page
+ * @param buffer output: the page, null-terminated
+ * @param buffer_size size of buffer, at least LIST_PAGE_MIN_SIZE
+ * @param length output: length of the page
+ * @param next output: cursor of the next page, 0 if this is the last one
+ * @return int Some error code. 0 if no error.
+ */
+int do_list_page(const struct imgst_file* const stores[], size_t nb_stores, size_t cursor, size_t limit,
+                 char* buffer, size_t buffer_size, size_t* length, size_t* next);
+
 /**
  * @brief Creates the imgStore called imgst_filename. Writes the header and the
  *        preallocated empty metadata array to imgStore file.
@@ -163,10 +268,74 @@ int do_delete(const char* img_id, struct imgst_file* imgst_file);
  * @brief Transforms resolution string to its int value.
  *
  * @param resolution The resolution string. Shall be "original",
- *        "orig", "thumbnail", "thumb" or "small".
+ *        "orig", "thumbnail" or the name of one of the resized resolutions
+ *        of the imgStore ("thumb", "small", ...).
+ * @param header The header of the imgStore.
+ * @return The corresponding value or -1 if error.
+ */
+int resolution_atoi(const char* resolution, const struct imgst_header* header);
+
+/**
+ * @brief Tells whether a resolution code exists in an imgStore.
+ *
+ * @param header The header of the imgStore.
+ * @param resolution The resolution code.
+ * @return 1 if the resolution is RES_ORIG or one of the resized resolutions, 0 otherwise.
+ */
+int is_valid_resolution(const struct imgst_header* header, int resolution);
+
+/**
+ * @brief Gives the name of a resolution.
+ *
+ * @param header The header of the imgStore.
+ * @param resolution The resolution code.
+ * @return "orig" for RES_ORIG, the name of the resized resolution otherwise, NULL if invalid.
+ */
+const char* resolution_name(const struct imgst_header* header, int resolution);
+
+/**
+ * @brief Transforms encoder string to its int value.
+ *
+ * @param encoder The encoder string. Shall be "jpeg", "jpg", "webp" or "avif".
  * @return The corresponding value or -1 if error.
  */
-int resolution_atoi(const char* resolution);
+int encoder_atoi(const char* encoder);
+
+/**
+ * @brief Transforms chroma subsampling string to its int value.
+ *
+ * @param subsample The subsampling string. Shall be "auto", "on" or "off".
+ * @return The corresponding value or -1 if error.
+ */
+int subsample_atoi(const char* subsample);
+
+/**
+ * @brief Gives the MIME type of the images produced by an encoder.
+ *
+ * @param encoder The encoder code.
+ * @return The MIME type (e.g. "image/webp"), NULL if the encoder is invalid.
+ */
+const char* encoder_mime_type(int encoder);
+
+/**
+ * @brief Gives the file extension of the images produced by an encoder.
+ *
+ * @param encoder The encoder code.
+ * @return The extension including the dot (e.g. ".webp"), NULL if the encoder is invalid.
+ */
+const char* encoder_extension(int encoder);
+
+/**
+ * @brief Gives the encoder of the bytes stored for an image in a given resolution.
+ *
+ * Resized resolutions aliased to the original hold the original bytes, so they are JPEG.
+ *
+ * @param imgst_file The main in-memory data structure
+ * @param index The index of the image.
+ * @param resolution The resolution code.
+ * @return The encoder code, -1 if arguments are invalid.
+ */
+int stored_encoder(const struct imgst_file* imgst_file, size_t index, int resolution);
 
 /**
  * @brief Reads the content of an image from a imgStore.
@@ -192,6 +361,35 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
  */
 int do_insert(const char* buffer, size_t size, const char* img_id, struct imgst_file* imgst_file);
 
+/**
+ * @brief Insert image in the imgStore file, when its SHA-256 is already known
+ * (e.g. hashed while it was received), which saves a pass over the image
+ *
+ * @param buffer Pointer to the raw image content
+ * @param size Image size
+ * @param SHA SHA-256 of the image content
+ * @param img_id Image ID
+ * @param imgst_file imgStore file
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_hashed(const char* buffer, size_t size, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                     const char* img_id, struct imgst_file* imgst_file);
+
+/**
+ * @brief Insert image copied from another imgStore file (e.g. by do_gbcollect()):
+ * the image was accepted when it was first inserted, so the limits on inserted
+ * images are not applied again
+ *
+ * @param buffer Pointer to the raw image content
+ * @param size Image size
+ * @param SHA SHA-256 of the image content
+ * @param img_id Image ID
+ * @param imgst_file imgStore file
+ * @return Some error code. 0 if no error.
+ */
+int do_insert_copy(const char* buffer, size_t size, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                   const char* img_id, struct imgst_file* imgst_file);
+
 /**Do some clean-up for imgStore file handling.
  * @param imgst_path The path to the imgStore file
  * @param imgst_tmp_bkp_path The path to the a (to be created) temporary imgStore backup file
@@ -213,10 +411,11 @@ int find_img_id(size_t* const index, const struct imgst_file* imgst_file, const
  * @brief  Creates the name of a picture according to conventions.
  * @param img_id: the name of the picture
  * @param resolution_code : the resolution we want the name to refer to
+ * @param imgst_file : the imgStore holding the picture, giving the extension of the resolution
  * @param name : the created name. Must be freed after use.
  * @return some error code. 0 if no error.
  */
-int create_name(const char* img_id, int resolution_code, char** name);
+int create_name(const char* img_id, int resolution_code, const struct imgst_file* imgst_file, char** name);
 
 /**
  * @brief Writes the metadata of an image on disk
@@ -236,7 +435,8 @@ int update_disk_metadata(struct imgst_file* imgst_file, size_t index);
 int update_disk_header(struct imgst_file* imgst_file);
 
 /**
- * @brief Writes an image at the end of a file and outputs its position in the file
+ * @brief Writes an image at the end of a file and outputs its position in the file.
+ * Like the other writers, flushes the file so that read_disk_image() sees the bytes.
  *
  * @param imgst_file destination file
  * @param buffer pointer on the image
@@ -247,9 +447,10 @@ int update_disk_header(struct imgst_file* imgst_file);
 int write_disk_image(struct imgst_file* imgst_file, void* buffer, size_t size, long* next_position);
 
 /**
- * @brief Reads an image from a file
+ * @brief Reads an image from a file. Uses pread() and leaves the file position
+ * untouched, so that concurrent readers can share the same file.
  *
- * @param imgst_file file
+ * @param file file
  * @param buffer output: image
  * @param size size of the image
  * @param offset position of the image in the file
@@ -63,6 +63,58 @@ typedef struct {
     uint32_t args[MAX_ARGS];
     int error;
 } optional_args ;
+
+#define NBR_ENC_ARGS 4
+/********************************************************************//**
+ * Parses the arguments of an encoding option:
+ * <jpeg|webp|avif> <QUALITY> <auto|on|off> <strip|keep>
+ ********************************************************************** */
+static int parse_encoding(char* argv[], struct res_encoding* encoding)
+{
+    const int encoder = encoder_atoi(argv[0]);
+    M_REQUIRE(encoder != -1, ERR_INVALID_ARGUMENT, "unrecognised encoder", NULL);
+    const uint32_t quality = atouint32(argv[1]);
+    M_REQUIRE(quality != 0 && quality <= MAX_QUALITY, ERR_INVALID_ARGUMENT, "invalid quality", NULL);
+    const int subsample = subsample_atoi(argv[2]);
+    M_REQUIRE(subsample != -1, ERR_INVALID_ARGUMENT, "unrecognised subsampling", NULL);
+    M_REQUIRE(!strcmp(argv[3], "strip") || !strcmp(argv[3], "keep"), ERR_INVALID_ARGUMENT, "metadata should be 'strip' or 'keep'", NULL);
+
+    encoding->encoder = (uint8_t) encoder;
+    encoding->quality = (uint8_t) quality;
+    encoding->subsample = (uint8_t) subsample;
+    encoding->strip = !strcmp(argv[3], "strip");
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Returns the index of a resolution name among the first nb names, -1 if absent.
+ ********************************************************************** */
+static int find_res_name(char names[][MAX_RES_NAME + 1], size_t nb, const char* name)
+{
+    for (size_t i = 0; i < nb; i++) {
+        if (!strcmp(names[i], name)) return (int) i;
+    }
+    return -1;
+}
+
+/********************************************************************//**
+ * Checks that a new resolution name is made of [a-z0-9_-] and does not
+ * collide with the names reserved for the original resolution.
+ ********************************************************************** */
+static int check_res_name(const char* name)
+{
+    const size_t length = strlen(name);
+    M_REQUIRE(length > 0 && length <= MAX_RES_NAME, ERR_RESOLUTIONS, "invalid resolution name length", NULL);
+    for (size_t i = 0; i < length; i++) {
+        const char c = name[i];
+        M_REQUIRE((c >= 'a' && c <= 'z') || (c >= '0' && c <= '9') || c == '_' || c == '-',
+                  ERR_RESOLUTIONS, "invalid character in resolution name", NULL);
+    }
+    M_REQUIRE(strcmp(name, "orig") && strcmp(name, "original") && strcmp(name, "thumbnail"),
+              ERR_RESOLUTIONS, "reserved resolution name", NULL);
+    return ERR_NONE;
+}
+
 /********************************************************************//**
  * Prepares and calls do_create command.
 ********************************************************************** */
@@ -74,21 +126,67 @@ do_create_cmd (int args, char* argv[])
 
     // Default values
     uint32_t max_files   =  10;
-    uint16_t thumb_res_x =  64;
-    uint16_t thumb_res_y =  64;
-    uint16_t small_res_x = 256;
-    uint16_t small_res_y = 256;
+    uint16_t nb_resized  = NB_DEFAULT_RESIZED;
+    uint16_t res_resized[2*(MAX_NB_RES - 1)] = {64, 64, 256, 256};
+    char res_names[MAX_NB_RES - 1][MAX_RES_NAME + 1] = {"thumb", "small"};
+    struct res_encoding encodings[MAX_NB_RES - 1];
+    for (size_t j = 0; j < MAX_NB_RES - 1; j++) {
+        encodings[j] = (struct res_encoding) {
+            ENC_JPEG, DEFAULT_QUALITY, SUBSAMPLE_AUTO, 0
+        };
+    }
+    const char* const enc_options[NB_DEFAULT_RESIZED] = {"-thumb_enc", "-small_enc"};
 
     //parsing the optionnal arguments:
     if(args >= 3) {
 
         optional_args args_tab[NBR_OPT_ARGS] = {{"-max_files", 1, MAX_MAX_FILES, {max_files}, ERR_MAX_FILES},
-            {"-thumb_res", 2, MAX_THUMB_RES, {(uint32_t)thumb_res_x, (uint32_t)thumb_res_y}, ERR_RESOLUTIONS},
-            {"-small_res", 2, MAX_SMALL_RES, {(uint32_t)small_res_x, (uint32_t)small_res_y}, ERR_RESOLUTIONS}
+            {"-thumb_res", 2, MAX_THUMB_RES, {(uint32_t)res_resized[RES_THUMB*2], (uint32_t)res_resized[RES_THUMB*2 + 1]}, ERR_RESOLUTIONS},
+            {"-small_res", 2, MAX_SMALL_RES, {(uint32_t)res_resized[RES_SMALL*2], (uint32_t)res_resized[RES_SMALL*2 + 1]}, ERR_RESOLUTIONS}
         };
         size_t i = 2;
         while (i < (size_t)args) {
             int valid = 0;
+            if(!strcmp(argv[i], "-res")) {
+                // -res <NAME> <X_RES> <Y_RES>
+                if(! ((size_t)args - i > 3)) {
+                    return ERR_NOT_ENOUGH_ARGUMENTS;
+                }
+                M_EXIT_IF_ERR(check_res_name(argv[i + 1]));
+                M_REQUIRE(find_res_name(res_names, nb_resized, argv[i + 1]) == -1, ERR_RESOLUTIONS, "duplicate resolution name", NULL);
+                M_REQUIRE(nb_resized < MAX_NB_RES - 1, ERR_RESOLUTIONS, "too many resolutions", NULL);
+                for(size_t k = 0; k < 2; k++) {
+                    uint32_t temp = atouint32(argv[i + 2 + k]);
+                    if(temp == 0 || temp > MAX_RESIZED_RES) {
+                        return ERR_RESOLUTIONS;
+                    }
+                    res_resized[nb_resized*2 + k] = (uint16_t) temp;
+                }
+                strncpy(res_names[nb_resized], argv[i + 1], MAX_RES_NAME);
+                ++nb_resized;
+                i += 4;
+                valid = 1;
+            } else if(!strcmp(argv[i], "-res_enc")) {
+                // -res_enc <NAME> <ENCODING...>, NAME being already declared
+                if(! ((size_t)args - i > NBR_ENC_ARGS + 1)) {
+                    return ERR_NOT_ENOUGH_ARGUMENTS;
+                }
+                const int res = find_res_name(res_names, nb_resized, argv[i + 1]);
+                M_REQUIRE(res != -1, ERR_RESOLUTIONS, "unknown resolution name", NULL);
+                M_EXIT_IF_ERR(parse_encoding(&argv[i + 2], &encodings[res]));
+                i += NBR_ENC_ARGS + 2;
+                valid = 1;
+            }
+            for(size_t j = 0; j < NB_DEFAULT_RESIZED && !valid; j++) {
+                if(!strcmp(argv[i], enc_options[j])) {
+                    if(! ((size_t)args - i > NBR_ENC_ARGS)) {
+                        return ERR_NOT_ENOUGH_ARGUMENTS;
+                    }
+                    M_EXIT_IF_ERR(parse_encoding(&argv[i + 1], &encodings[j]));
+                    i += NBR_ENC_ARGS + 1;
+                    valid = 1;
+                }
+            }
             for(size_t j = 0; j < NBR_OPT_ARGS && !valid; j++) {
                 if(!strcmp(argv[i], args_tab[j].name)) {
                     if(! ((size_t)args - i > args_tab[j].nbr_of_args)) {
@@ -112,16 +210,20 @@ do_create_cmd (int args, char* argv[])
 
         //we retrierve what has been parsed (indexes are safe since they have been defined in the same scope):
         max_files = args_tab[0].args[0];
-        thumb_res_x = (uint16_t) args_tab[1].args[0];
-        thumb_res_y = (uint16_t) args_tab[1].args[1];
-        small_res_x = (uint16_t) args_tab[2].args[0];
-        small_res_y = (uint16_t) args_tab[2].args[1];
+        res_resized[RES_THUMB*2]     = (uint16_t) args_tab[1].args[0];
+        res_resized[RES_THUMB*2 + 1] = (uint16_t) args_tab[1].args[1];
+        res_resized[RES_SMALL*2]     = (uint16_t) args_tab[2].args[0];
+        res_resized[RES_SMALL*2 + 1] = (uint16_t) args_tab[2].args[1];
 
     }
 
     puts("Create");
-    // initialize dbfile
-    struct imgst_file dbfile = {.header={.max_files=max_files, .res_resized={thumb_res_x, thumb_res_y, small_res_x, small_res_y}}};
+    // initialize dbfile; the resolution arrays are read-only once in the header,
+    // so they are filled in the same way do_open() reads them from disk
+    struct imgst_file dbfile = {.header={.max_files=max_files, .nb_resized=nb_resized}};
+    memcpy((void*) dbfile.header.res_resized, res_resized, sizeof(res_resized));
+    memcpy((void*) dbfile.header.res_names, res_names, sizeof(res_names));
+    memcpy((void*) dbfile.header.res_encoding, encodings, sizeof(encodings));
     // creates file and prints header
     int error_status = do_create(fileName, &dbfile);
     if (error_status == ERR_NONE) {
@@ -151,7 +253,17 @@ int help (int args _unused, char* argv[] _unused)
     puts("\t\t\t-small_res <X_RES> <Y_RES>: resolution for small images.");
     puts("\t\t\t\tdefault value is 256x256");
     puts("\t\t\t\tmaximum value is 512x512");
-    puts("\tread   <imgstore_filename> <imgID> [original|orig|thumbnail|thumb|small]:");
+    puts("\t\t\t-thumb_enc <jpeg|webp|avif> <QUALITY> <auto|on|off> <strip|keep>: encoding for thumbnail images.");
+    puts("\t\t\t\tencoder, quality (1 to 100), chroma subsampling and metadata stripping.");
+    puts("\t\t\t\tdefault value is jpeg 75 auto keep");
+    puts("\t\t\t-small_enc <jpeg|webp|avif> <QUALITY> <auto|on|off> <strip|keep>: encoding for small images.");
+    puts("\t\t\t\tdefault value is jpeg 75 auto keep");
+    puts("\t\t\t-res <NAME> <X_RES> <Y_RES>: adds a resized resolution called NAME.");
+    puts("\t\t\t\tat most 7 resized resolutions, thumb and small included");
+    puts("\t\t\t\tmaximum value is 4096x4096");
+    puts("\t\t\t-res_enc <NAME> <jpeg|webp|avif> <QUALITY> <auto|on|off> <strip|keep>: encoding for resolution NAME.");
+    puts("\t\t\t\tdefault value is jpeg 75 auto keep");
+    puts("\tread   <imgstore_filename> <imgID> [original|orig|thumbnail|<resolution name>]:");
     puts("\t\tread an image from the imgStore and save it to a file.");
     puts("\t\tdefault resolution is \"original\".");
     puts("\tinsert <imgstore_filename> <imgID> <filename>: insert a new image in the imgStore.");
@@ -263,16 +375,17 @@ int do_read_cmd(int args, char* argv[])
     M_EXIT_IF_TOO_LONG(fileName, MAX_IMGST_NAME);
     M_CHECK_IMG_ID(img_id);
 
+    struct imgst_file imgst_file;
+    M_EXIT_IF_ERR(do_open(fileName, "rb+", &imgst_file));
+
+    // resolution names are stored in the header
     int resolution_code = RES_ORIG;
     if(args > 3) {
         const char* resolution = argv[3];
-        resolution_code = resolution_atoi(resolution);
-        M_REQUIRE(resolution_code != -1, ERR_RESOLUTIONS, "unrecognised resolution", NULL);
+        resolution_code = resolution_atoi(resolution, &imgst_file.header);
+        M_CHECK_WITH_CODE(resolution_code == -1, do_close(&imgst_file), ERR_RESOLUTIONS);
     }
 
-    struct imgst_file imgst_file;
-    M_EXIT_IF_ERR(do_open(fileName, "rb+", &imgst_file));
-
     char* image_buffer = NULL;
     uint32_t image_size = 0;
     M_EXIT_IF_ERR_DO_SOMETHING(
@@ -281,7 +394,7 @@ int do_read_cmd(int args, char* argv[])
 
     char* image_name = NULL;
     M_EXIT_IF_ERR_DO_SOMETHING(
-    create_name(img_id, resolution_code, &image_name), {
+    create_name(img_id, resolution_code, &imgst_file, &image_name), {
         do_close(&imgst_file);
         free(image_buffer);
         image_buffer = NULL;
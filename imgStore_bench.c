@@ -0,0 +1,806 @@
+/**
+ * @file imgStore_bench.c
+ * @brief Load generator for imgStore_server: replays a mix of list, read,
+ * insert and delete requests over concurrent connections, and reports the
+ * throughput and the latency percentiles as text and JSON.
+ *
+ * Each connection has one request in flight: the next one is sent when the
+ * reply arrives (a closed loop), on the same connection unless -no_keepalive.
+ * Read keys follow a Zipf distribution over "-keys N" ids, PREFIX0 being the
+ * most popular; inserts upload "-image FILE" under fresh ids, and deletes
+ * remove these, oldest first.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <inttypes.h> // for PRIu64
+#include <math.h>
+#include "mongoose.h"
+#include "imgStore.h" // for MAX_IMG_ID
+#include "metrics.h" // for metrics_now()
+#include "error.h"
+#include "util.h"
+
+#define MAX_CONNECTIONS 1024
+#define MAX_KEYS (1 << 24)
+#define MAX_WEIGHT 1000
+#define MAX_MIX 8 // resolutions of the read mix
+#define MAX_RES_QUERY 32
+#define MAX_NUMBER_DIGITS 10
+#define UPLOAD_CHUNK (1024 * 1024) // as index.html uploads
+#define INSERTED_RING 4096 // ids inserted and not deleted yet, the older ones are left in the store
+#define MAX_CONNECT_FAILURES 32 // in a row, before giving up on the server
+
+/**
+ * @brief Kinds of operations
+ */
+enum op {OP_LIST, OP_READ, OP_INSERT, OP_DELETE, NB_OPS};
+static const char* const OP_NAMES[NB_OPS] = {"list", "read", "insert", "delete"};
+
+/**
+ * @brief Benchmark configuration, set from the command line
+ */
+static struct {
+    const char* url; // address of the server
+    size_t connections; // concurrent connections
+    uint64_t requests; // operations to measure, 0 to run for duration instead
+    unsigned duration; // seconds to measure
+    unsigned mix[NB_OPS]; // weight of each kind of operation
+    char res_queries[MAX_MIX][MAX_RES_QUERY]; // resolutions read, e.g. "res=thumb" or "w=320"
+    unsigned res_weights[MAX_MIX];
+    size_t nb_resolutions;
+    size_t keys; // number of ids read
+    double zipf; // exponent of the popularity of the ids, 0 for uniform
+    const char* prefix; // ids are PREFIX0, PREFIX1...
+    const char* image; // image uploaded by the inserts
+    int populate; // insert the ids read before measuring
+    int keep_alive; // reuse the connections
+    unsigned timeout; // seconds before a request is counted as failed
+    uint64_t seed;
+    const char* json; // where to write the JSON report, NULL for none
+} s_options = {
+    .url = "http://localhost:8000",
+    .connections = 16,
+    .duration = 10,
+    .mix = {1, 99, 0, 0}, // inserts need -image
+    .res_queries = {"res=thumb", "res=small", "res=orig"},
+    .res_weights = {6, 3, 1},
+    .nb_resolutions = 3,
+    .keys = 100,
+    .zipf = 1.0,
+    .prefix = "bench",
+    .keep_alive = 1,
+    .timeout = 10,
+    .seed = 1
+};
+
+/**
+ * @brief State of a connection of the benchmark
+ */
+enum client_state {DISCONNECTED, CONNECTING, IDLE, BUSY};
+
+/**
+ * @brief A connection of the benchmark and its request in flight
+ */
+struct client {
+    struct mg_connection* nc; // NULL when DISCONNECTED
+    enum client_state state;
+    uint64_t since; // when the state began, in nanoseconds
+    enum op op;
+    int measured; // the operation counts in the results, not in the population
+    char img_id[MAX_IMG_ID + 1];
+    size_t uploaded; // bytes of the image sent, for inserts
+    int upload_ended; // the request ending the upload was sent
+    uint64_t received; // bytes of the replies of the operation
+};
+
+/**
+ * @brief Results of a kind of operation
+ */
+struct op_stats {
+    uint64_t* latencies; // of the successful operations, in nanoseconds
+    size_t count;
+    size_t capacity;
+    uint64_t errors; // failed operations: errors, timeouts and closed connections
+    uint64_t refused; // 503 replies, also counted in errors
+    uint64_t bytes; // bytes received
+};
+
+/**
+ * @brief Phases of a run
+ */
+enum phase {PHASE_POPULATE, PHASE_MEASURE, PHASE_DRAIN};
+
+static int s_signo;
+static void signal_handler(int signo)
+{
+    s_signo = signo;
+}
+
+static struct client s_clients[MAX_CONNECTIONS];
+static struct op_stats s_stats[NB_OPS];
+static enum phase s_phase = PHASE_MEASURE;
+static uint64_t s_started; // operations started in the measure
+static uint64_t s_measure_start; // in nanoseconds
+static size_t s_populated; // ids inserted, or refused, by the population
+static uint64_t s_populate_errors;
+static size_t s_connect_failures; // in a row
+static uint64_t s_random;
+static double* s_zipf_cdf; // cumulated popularity of the ids
+static char* s_image;
+static size_t s_image_size;
+static uint64_t s_inserts; // inserts started, to name them
+// ids inserted by the benchmark, for the deletes, from s_inserted_head on
+static char s_inserted[INSERTED_RING][MAX_IMG_ID + 1];
+static size_t s_inserted_head;
+static size_t s_nb_inserted;
+
+/**
+ * @brief Draws a pseudo-random number (xorshift64*), reproducible from -seed
+ */
+static uint64_t next_random(void)
+{
+    s_random ^= s_random >> 12;
+    s_random ^= s_random << 25;
+    s_random ^= s_random >> 27;
+    return s_random * 0x2545F4914F6CDD1Dull;
+}
+
+/**
+ * @brief Draws a number in [0, 1)
+ */
+static double next_uniform(void)
+{
+    return (double) (next_random() >> 11) * (1.0 / 9007199254740992.0);
+}
+
+/**
+ * @brief Draws an index from weights
+ *
+ * @param weights the weights, at least one positive
+ * @param nb number of weights
+ */
+static size_t pick_weighted(const unsigned* weights, size_t nb)
+{
+    unsigned total = 0;
+    for (size_t i = 0; i < nb; i++) total += weights[i];
+    unsigned draw = (unsigned) (next_random() % total);
+    for (size_t i = 0; i < nb; i++) {
+        if (draw < weights[i]) return i;
+        draw -= weights[i];
+    }
+    return nb - 1;
+}
+
+/**
+ * @brief Computes the cumulated Zipf popularity of the ids: id k is drawn with
+ * a probability proportional to 1 / (k + 1)^zipf
+ *
+ * @return int Some error code. 0 if no error.
+ */
+static int init_zipf(void)
+{
+    s_zipf_cdf = calloc(s_options.keys, sizeof(double));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(s_zipf_cdf, ERR_OUT_OF_MEMORY);
+    double total = 0;
+    for (size_t k = 0; k < s_options.keys; k++) {
+        total += pow((double) (k + 1), -s_options.zipf);
+        s_zipf_cdf[k] = total;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Draws the rank of an id from the Zipf popularity
+ */
+static size_t next_key(void)
+{
+    const double draw = next_uniform() * s_zipf_cdf[s_options.keys - 1];
+    size_t low = 0, high = s_options.keys - 1;
+    while (low < high) {
+        const size_t middle = low + (high - low) / 2;
+        if (s_zipf_cdf[middle] < draw) low = middle + 1;
+        else high = middle;
+    }
+    return low;
+}
+
+/**
+ * @brief Records the result of an operation
+ *
+ * @param op kind of operation
+ * @param status HTTP status of its last reply, 0 if it got none
+ * @param latency duration of the operation, in nanoseconds
+ * @param bytes bytes received
+ */
+static void record(enum op op, int status, uint64_t latency, uint64_t bytes)
+{
+    struct op_stats* stats = &s_stats[op];
+    stats->bytes += bytes;
+    if (status == 0 || status >= 400) {
+        ++stats->errors;
+        if (status == 503) ++stats->refused;
+        return;
+    }
+    if (stats->count == stats->capacity) {
+        const size_t capacity = stats->capacity > 0 ? 2 * stats->capacity : 1024;
+        uint64_t* latencies = realloc(stats->latencies, capacity * sizeof(uint64_t));
+        if (latencies == NULL) return;
+        stats->latencies = latencies;
+        stats->capacity = capacity;
+    }
+    stats->latencies[stats->count++] = latency;
+}
+
+/**
+ * @brief Sends the next request of the operation of a client: the whole request
+ * but for inserts, which send the image chunk after chunk and then end the upload
+ */
+static void send_request(struct client* client)
+{
+    struct mg_connection* nc = client->nc;
+    const struct mg_str host = mg_url_host(s_options.url);
+    switch (client->op) {
+    case OP_LIST:
+        mg_printf(nc, "GET /imgStore/list HTTP/1.1\r\nHost: %.*s\r\n\r\n", (int) host.len, host.ptr);
+        break;
+    case OP_READ: {
+        const size_t res = pick_weighted(s_options.res_weights, s_options.nb_resolutions);
+        mg_printf(nc, "GET /imgStore/read?%s&img_id=%s HTTP/1.1\r\nHost: %.*s\r\n\r\n",
+                  s_options.res_queries[res], client->img_id, (int) host.len, host.ptr);
+        break;
+    }
+    case OP_INSERT: {
+        size_t length = s_image_size - client->uploaded;
+        if (length > UPLOAD_CHUNK) length = UPLOAD_CHUNK;
+        // the request without a body ends the upload
+        mg_printf(nc, "POST /imgStore/insert?offset=%zu&name=%s HTTP/1.1\r\nHost: %.*s\r\n"
+                  "Content-Length: %zu\r\n\r\n", length > 0 ? client->uploaded : s_image_size,
+                  client->img_id, (int) host.len, host.ptr, length);
+        if (length > 0) mg_send(nc, s_image + client->uploaded, length);
+        client->uploaded += length;
+        client->upload_ended = length == 0;
+        break;
+    }
+    case OP_DELETE:
+        mg_printf(nc, "GET /imgStore/delete?img_id=%s HTTP/1.1\r\nHost: %.*s\r\n\r\n",
+                  client->img_id, (int) host.len, host.ptr);
+        break;
+    default:
+        break;
+    }
+}
+
+/**
+ * @brief Chooses the next operation of a client and sends its first request
+ *
+ * @return int 1 if an operation was started, 0 if there is none left
+ */
+static int start_operation(struct client* client)
+{
+    if (s_phase == PHASE_POPULATE) {
+        if (s_populated >= s_options.keys) return 0;
+        client->op = OP_INSERT;
+        client->measured = 0;
+        snprintf(client->img_id, sizeof(client->img_id), "%s%zu", s_options.prefix, s_populated++);
+    } else if (s_phase == PHASE_MEASURE && (s_options.requests == 0 || s_started < s_options.requests)) {
+        const size_t op = pick_weighted(s_options.mix, NB_OPS);
+        client->op = (enum op) op;
+        client->measured = 1;
+        if (client->op == OP_DELETE && s_nb_inserted == 0) {
+            // nothing of ours to delete yet
+            client->op = OP_READ;
+        }
+        if (client->op == OP_READ) {
+            snprintf(client->img_id, sizeof(client->img_id), "%s%zu", s_options.prefix, next_key());
+        } else if (client->op == OP_INSERT) {
+            snprintf(client->img_id, sizeof(client->img_id), "%si%ld_%" PRIu64, s_options.prefix,
+                     (long) getpid(), s_inserts++);
+        } else if (client->op == OP_DELETE) {
+            strcpy(client->img_id, s_inserted[s_inserted_head]);
+            s_inserted_head = (s_inserted_head + 1) % INSERTED_RING;
+            --s_nb_inserted;
+        }
+        ++s_started;
+    } else {
+        return 0;
+    }
+    client->uploaded = 0;
+    client->upload_ended = 0;
+    client->received = 0;
+    client->state = BUSY;
+    client->since = metrics_now();
+    send_request(client);
+    return 1;
+}
+
+/**
+ * @brief Ends the operation of a client
+ *
+ * @param status HTTP status of its last reply, 0 if it failed without one
+ */
+static void end_operation(struct client* client, int status)
+{
+    const uint64_t latency = metrics_now() - client->since;
+    if (!client->measured) {
+        if (status == 0 || status >= 400) ++s_populate_errors;
+    } else {
+        record(client->op, status, latency, client->received);
+        if (client->op == OP_INSERT && status > 0 && status < 400) {
+            // the ring keeps the newest ids
+            if (s_nb_inserted == INSERTED_RING) {
+                s_inserted_head = (s_inserted_head + 1) % INSERTED_RING;
+                --s_nb_inserted;
+            }
+            strcpy(s_inserted[(s_inserted_head + s_nb_inserted) % INSERTED_RING], client->img_id);
+            ++s_nb_inserted;
+        }
+    }
+    client->state = IDLE;
+    client->since = metrics_now();
+    if (!s_options.keep_alive) client->nc->is_closing = 1;
+}
+
+/**
+ * @brief Event handler of the connections of the benchmark
+ */
+static void bench_event_handler(struct mg_connection *nc, int ev, void *ev_data, void *fn_data)
+{
+    struct client* client = (struct client*) fn_data;
+    switch (ev) {
+    case MG_EV_CONNECT:
+        s_connect_failures = 0;
+        client->state = IDLE;
+        client->since = metrics_now();
+        break;
+    case MG_EV_HTTP_MSG: {
+        if (client->state != BUSY) break;
+        const struct mg_http_message* hm = (const struct mg_http_message*) ev_data;
+        // in a reply, the status code is parsed as the uri
+        char code[4] = "";
+        if (hm->uri.len == 3) memcpy(code, hm->uri.ptr, 3);
+        const int status = (int) atouint16(code);
+        client->received += hm->message.len;
+        if (client->op == OP_INSERT && status == 200 && !client->upload_ended) {
+            // a chunk was accepted: send the next one, or the end of the upload
+            send_request(client);
+            break;
+        }
+        end_operation(client, status);
+        break;
+    }
+    case MG_EV_ERROR:
+        if (client->state == CONNECTING) ++s_connect_failures;
+        break;
+    case MG_EV_CLOSE:
+        if (client->state == BUSY) end_operation(client, 0);
+        client->state = DISCONNECTED;
+        client->nc = NULL;
+        break;
+    default:
+        break;
+    }
+    (void) nc;
+}
+
+/**
+ * @brief Opens the connection of a client
+ */
+static void connect_client(struct mg_mgr* mgr, struct client* client)
+{
+    client->state = CONNECTING;
+    client->since = metrics_now();
+    client->nc = mg_http_connect(mgr, s_options.url, bench_event_handler, client);
+    if (client->nc == NULL) {
+        client->state = DISCONNECTED;
+        ++s_connect_failures;
+    }
+}
+
+/**
+ * @brief Opens, times out and feeds the connections, and moves between the phases
+ *
+ * @return int 1 while the run goes on, 0 when it is over
+ */
+static int drive_clients(struct mg_mgr* mgr)
+{
+    const uint64_t now = metrics_now();
+    if (s_phase == PHASE_MEASURE
+        && (s_signo != 0
+            || (s_options.requests > 0 ? s_started >= s_options.requests
+                : now - s_measure_start >= (uint64_t) s_options.duration * 1000000000u))) {
+        s_phase = PHASE_DRAIN;
+    }
+    if (s_phase == PHASE_POPULATE && s_signo != 0) s_phase = PHASE_DRAIN;
+
+    int busy = 0;
+    for (size_t i = 0; i < s_options.connections; i++) {
+        struct client* client = &s_clients[i];
+        if (client->state == DISCONNECTED) {
+            if (s_phase != PHASE_DRAIN) connect_client(mgr, client);
+        } else if (client->state == IDLE) {
+            start_operation(client);
+        } else if (now - client->since >= (uint64_t) s_options.timeout * 1000000000u) {
+            // counted as failed when the connection closes
+            client->nc->is_closing = 1;
+        }
+        if (client->state == BUSY || (client->state == CONNECTING && s_phase != PHASE_DRAIN)) busy = 1;
+    }
+
+    if (s_phase == PHASE_POPULATE && s_populated >= s_options.keys && !busy) {
+        s_phase = PHASE_MEASURE;
+        s_measure_start = metrics_now();
+        return 1;
+    }
+    return s_phase != PHASE_DRAIN || busy;
+}
+
+/**
+ * @brief Compares two latencies, for qsort
+ */
+static int compare_latencies(const void* a, const void* b)
+{
+    const uint64_t x = *(const uint64_t*) a, y = *(const uint64_t*) b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * @brief Latency percentiles of a set of operations, in milliseconds
+ */
+struct summary {
+    uint64_t count;
+    uint64_t errors;
+    uint64_t refused;
+    uint64_t bytes;
+    double mean, p50, p90, p99, p999, max;
+};
+
+static const double PERCENTILES[] = {0.50, 0.90, 0.99, 0.999};
+
+/**
+ * @brief Summarizes latencies, which it sorts
+ *
+ * @param latencies the latencies, in nanoseconds
+ * @param count number of latencies
+ * @param summary output: count and latency fields
+ */
+static void summarize(uint64_t* latencies, size_t count, struct summary* summary)
+{
+    summary->count = count;
+    if (count == 0) return;
+    qsort(latencies, count, sizeof(uint64_t), compare_latencies);
+    double total = 0;
+    for (size_t i = 0; i < count; i++) total += (double) latencies[i];
+    summary->mean = total / (double) count * 1e-6;
+    double* fields[] = {&summary->p50, &summary->p90, &summary->p99, &summary->p999};
+    for (size_t p = 0; p < sizeof(PERCENTILES) / sizeof(PERCENTILES[0]); p++) {
+        const double nearest = ceil(PERCENTILES[p] * (double) count);
+        size_t rank = (size_t) nearest;
+        if (rank == 0) rank = 1;
+        *fields[p] = (double) latencies[rank - 1] * 1e-6;
+    }
+    summary->max = (double) latencies[count - 1] * 1e-6;
+}
+
+/**
+ * @brief Writes a summary as a line of the text report
+ */
+static void print_summary_text(FILE* out, const char* name, const struct summary* summary, double seconds)
+{
+    fprintf(out, "%-7s %9" PRIu64 " %7" PRIu64 " %6" PRIu64 " %10.1f %8.3f %8.3f %8.3f %8.3f %8.3f %8.3f\n",
+            name, summary->count, summary->errors, summary->refused,
+            seconds > 0 ? (double) summary->count / seconds : 0.0,
+            summary->mean, summary->p50, summary->p90, summary->p99, summary->p999, summary->max);
+}
+
+/**
+ * @brief Writes a summary as a JSON object
+ */
+static void print_summary_json(FILE* out, const struct summary* summary, double seconds)
+{
+    fprintf(out, "{\"count\":%" PRIu64 ",\"errors\":%" PRIu64 ",\"refused\":%" PRIu64 ",\"bytes\":%" PRIu64
+            ",\"throughput\":%.3f,\"latency_ms\":{\"mean\":%.6f,\"p50\":%.6f,\"p90\":%.6f,\"p99\":%.6f"
+            ",\"p999\":%.6f,\"max\":%.6f}}", summary->count, summary->errors, summary->refused, summary->bytes,
+            seconds > 0 ? (double) summary->count / seconds : 0.0,
+            summary->mean, summary->p50, summary->p90, summary->p99, summary->p999, summary->max);
+}
+
+/**
+ * @brief Writes the results, as text to stdout and as JSON to -json
+ *
+ * @param seconds duration of the measure
+ * @return int Some error code. 0 if no error.
+ */
+static int report(double seconds)
+{
+    struct summary summaries[NB_OPS + 1];
+    memset(summaries, 0, sizeof(summaries));
+    struct summary* all = &summaries[NB_OPS];
+    size_t total = 0;
+    for (size_t op = 0; op < NB_OPS; op++) total += s_stats[op].count;
+    uint64_t* latencies = calloc(total > 0 ? total : 1, sizeof(uint64_t));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(latencies, ERR_OUT_OF_MEMORY);
+    size_t filled = 0;
+    for (size_t op = 0; op < NB_OPS; op++) {
+        if (s_stats[op].count > 0) {
+            memcpy(latencies + filled, s_stats[op].latencies, s_stats[op].count * sizeof(uint64_t));
+        }
+        filled += s_stats[op].count;
+        summarize(s_stats[op].latencies, s_stats[op].count, &summaries[op]);
+        summaries[op].errors = s_stats[op].errors;
+        summaries[op].refused = s_stats[op].refused;
+        summaries[op].bytes = s_stats[op].bytes;
+        all->errors += s_stats[op].errors;
+        all->refused += s_stats[op].refused;
+        all->bytes += s_stats[op].bytes;
+    }
+    summarize(latencies, total, all);
+    free(latencies);
+
+    printf("%zu connections%s, %.3f s, %.1f MB received\n", s_options.connections,
+           s_options.keep_alive ? " (keep-alive)" : "", seconds, (double) all->bytes / (1024.0 * 1024.0));
+    if (s_options.populate) {
+        printf("populated %zu ids, %" PRIu64 " refused\n", s_populated, s_populate_errors);
+    }
+    printf("%-7s %9s %7s %6s %10s %8s %8s %8s %8s %8s %8s\n", "op", "count", "errors", "503", "ops/s",
+           "mean ms", "p50", "p90", "p99", "p99.9", "max");
+    for (size_t op = 0; op < NB_OPS; op++) {
+        if (s_options.mix[op] > 0) print_summary_text(stdout, OP_NAMES[op], &summaries[op], seconds);
+    }
+    print_summary_text(stdout, "all", all, seconds);
+
+    if (s_options.json == NULL) return ERR_NONE;
+    FILE* out = strcmp(s_options.json, "-") ? fopen(s_options.json, "w") : stdout;
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(out, ERR_IO);
+    fprintf(out, "{\"url\":\"%s\",\"connections\":%zu,\"keep_alive\":%s,\"keys\":%zu,\"zipf\":%g"
+            ",\"seconds\":%.6f,\"ops\":{", s_options.url, s_options.connections,
+            s_options.keep_alive ? "true" : "false", s_options.keys, s_options.zipf, seconds);
+    for (size_t op = 0; op < NB_OPS; op++) {
+        fprintf(out, "%s\"%s\":", op > 0 ? "," : "", OP_NAMES[op]);
+        print_summary_json(out, &summaries[op], seconds);
+    }
+    fprintf(out, "},\"all\":");
+    print_summary_json(out, all, seconds);
+    fprintf(out, "}\n");
+    if (out != stdout) fclose(out);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Parses a weight of a NAME=WEIGHT list
+ *
+ * @param number the weight, not terminated
+ * @param length its length
+ * @param weight output: the weight
+ * @return int Some error code. 0 if no error.
+ */
+static int parse_weight(const char* number, size_t length, unsigned* weight)
+{
+    char digits[MAX_NUMBER_DIGITS + 1] = "";
+    M_REQUIRE(length > 0 && length <= MAX_NUMBER_DIGITS, ERR_INVALID_ARGUMENT, "invalid weight", NULL);
+    strncpy(digits, number, length);
+    *weight = atouint32(digits);
+    M_REQUIRE(*weight <= MAX_WEIGHT && (*weight > 0 || !strcmp(digits, "0")), ERR_INVALID_ARGUMENT,
+              "invalid weight", NULL);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Parses the mix of operations into s_options.mix
+ *
+ * @param list the mix, e.g. "list=1,read=90,insert=5,delete=4"; the operations not named get 0
+ * @return int Some error code. 0 if no error.
+ */
+static int parse_mix(const char* list)
+{
+    memset(s_options.mix, 0, sizeof(s_options.mix));
+    unsigned total = 0;
+    for (const char* start = list; *start != '\0';) {
+        const size_t length = strcspn(start, ",");
+        const char* equal = memchr(start, '=', length);
+        M_REQUIRE(equal != NULL, ERR_INVALID_ARGUMENT, "expected OP=WEIGHT", NULL);
+        size_t op = 0;
+        while (op < NB_OPS && (strlen(OP_NAMES[op]) != (size_t) (equal - start)
+                               || strncmp(start, OP_NAMES[op], (size_t) (equal - start)))) {
+            ++op;
+        }
+        M_REQUIRE(op < NB_OPS, ERR_INVALID_ARGUMENT, "unknown operation", NULL);
+        M_EXIT_IF_ERR(parse_weight(equal + 1, length - (size_t) (equal + 1 - start), &s_options.mix[op]));
+        total += s_options.mix[op];
+        start += length;
+        if (*start == ',') ++start;
+    }
+    M_REQUIRE(total > 0, ERR_INVALID_ARGUMENT, "empty mix", NULL);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Parses the mix of resolutions of the reads into s_options.resolutions
+ *
+ * @param list the mix, e.g. "thumb=6,small=3,orig=1"; "wN" reads the variant of width N
+ * @return int Some error code. 0 if no error.
+ */
+static int parse_resolutions(const char* list)
+{
+    size_t nb = 0;
+    unsigned total = 0;
+    for (const char* start = list; *start != '\0';) {
+        const size_t length = strcspn(start, ",");
+        const char* equal = memchr(start, '=', length);
+        M_REQUIRE(equal != NULL && equal > start && equal - start <= MAX_RES_NAME, ERR_INVALID_ARGUMENT,
+                  "expected RES=WEIGHT", NULL);
+        M_REQUIRE(nb < MAX_MIX, ERR_INVALID_ARGUMENT, "too many resolutions", NULL);
+        char* query = s_options.res_queries[nb];
+        const int name_length = (int) (equal - start);
+        if (start[0] == 'w' && name_length > 1 && strspn(start + 1, "0123456789") == (size_t) name_length - 1) {
+            snprintf(query, MAX_RES_QUERY, "w=%.*s", name_length - 1, start + 1);
+        } else {
+            snprintf(query, MAX_RES_QUERY, "res=%.*s", name_length, start);
+        }
+        M_EXIT_IF_ERR(parse_weight(equal + 1, length - (size_t) (equal + 1 - start), &s_options.res_weights[nb]));
+        total += s_options.res_weights[nb++];
+        start += length;
+        if (*start == ',') ++start;
+    }
+    M_REQUIRE(total > 0, ERR_INVALID_ARGUMENT, "empty mix", NULL);
+    s_options.nb_resolutions = nb;
+    return ERR_NONE;
+}
+
+/**
+ * @brief Parses the command line options into s_options
+ *
+ * @param argc number of options
+ * @param argv the options
+ * @return int Some error code. 0 if no error.
+ */
+static int parse_options(int argc, char* argv[])
+{
+    for (int i = 0; i < argc;) {
+        if (!strcmp(argv[i], "-url") && i + 1 < argc) {
+            s_options.url = argv[i + 1];
+            i += 2;
+        } else if (!strcmp(argv[i], "-connections") && i + 1 < argc) {
+            const uint32_t connections = atouint32(argv[i + 1]);
+            M_REQUIRE(connections > 0 && connections <= MAX_CONNECTIONS, ERR_INVALID_ARGUMENT,
+                      "invalid number of connections", NULL);
+            s_options.connections = connections;
+            i += 2;
+        } else if (!strcmp(argv[i], "-requests") && i + 1 < argc) {
+            s_options.requests = atouint32(argv[i + 1]);
+            M_REQUIRE(s_options.requests > 0, ERR_INVALID_ARGUMENT, "invalid number of requests", NULL);
+            i += 2;
+        } else if (!strcmp(argv[i], "-duration") && i + 1 < argc) {
+            s_options.duration = atouint32(argv[i + 1]);
+            M_REQUIRE(s_options.duration > 0, ERR_INVALID_ARGUMENT, "invalid duration", NULL);
+            i += 2;
+        } else if (!strcmp(argv[i], "-mix") && i + 1 < argc) {
+            M_EXIT_IF_ERR(parse_mix(argv[i + 1]));
+            i += 2;
+        } else if (!strcmp(argv[i], "-res") && i + 1 < argc) {
+            M_EXIT_IF_ERR(parse_resolutions(argv[i + 1]));
+            i += 2;
+        } else if (!strcmp(argv[i], "-keys") && i + 1 < argc) {
+            const uint32_t keys = atouint32(argv[i + 1]);
+            M_REQUIRE(keys > 0 && keys <= MAX_KEYS, ERR_INVALID_ARGUMENT, "invalid number of keys", NULL);
+            s_options.keys = keys;
+            i += 2;
+        } else if (!strcmp(argv[i], "-zipf") && i + 1 < argc) {
+            char* end = NULL;
+            s_options.zipf = strtod(argv[i + 1], &end);
+            M_REQUIRE(end != argv[i + 1] && *end == '\0' && s_options.zipf >= 0 && s_options.zipf <= 10,
+                      ERR_INVALID_ARGUMENT, "invalid Zipf exponent", NULL);
+            i += 2;
+        } else if (!strcmp(argv[i], "-prefix") && i + 1 < argc) {
+            M_REQUIRE(strlen(argv[i + 1]) <= MAX_IMG_ID / 2, ERR_INVALID_ARGUMENT, "prefix too long", NULL);
+            s_options.prefix = argv[i + 1];
+            i += 2;
+        } else if (!strcmp(argv[i], "-image") && i + 1 < argc) {
+            s_options.image = argv[i + 1];
+            i += 2;
+        } else if (!strcmp(argv[i], "-populate")) {
+            s_options.populate = 1;
+            ++i;
+        } else if (!strcmp(argv[i], "-no_keepalive")) {
+            s_options.keep_alive = 0;
+            ++i;
+        } else if (!strcmp(argv[i], "-timeout") && i + 1 < argc) {
+            s_options.timeout = atouint32(argv[i + 1]);
+            M_REQUIRE(s_options.timeout > 0, ERR_INVALID_ARGUMENT, "invalid timeout", NULL);
+            i += 2;
+        } else if (!strcmp(argv[i], "-seed") && i + 1 < argc) {
+            s_options.seed = atouint32(argv[i + 1]);
+            i += 2;
+        } else if (!strcmp(argv[i], "-json") && i + 1 < argc) {
+            s_options.json = argv[i + 1];
+            i += 2;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
+    }
+    M_REQUIRE(s_options.image != NULL || (s_options.mix[OP_INSERT] == 0 && !s_options.populate),
+              ERR_INVALID_ARGUMENT, "inserts need -image", NULL);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Reads the image the inserts upload
+ *
+ * @return int Some error code. 0 if no error.
+ */
+static int load_image(void)
+{
+    FILE* file = fopen(s_options.image, "rb");
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(file, ERR_IO);
+    int err = ERR_NONE;
+    long size = 0;
+    if (fseek(file, 0, SEEK_END) != 0 || (size = ftell(file)) <= 0 || fseek(file, 0, SEEK_SET) != 0) {
+        err = ERR_IO;
+    } else if ((s_image = malloc((size_t) size)) == NULL) {
+        err = ERR_OUT_OF_MEMORY;
+    } else if (fread(s_image, 1, (size_t) size, file) != (size_t) size) {
+        err = ERR_IO;
+    } else {
+        s_image_size = (size_t) size;
+    }
+    fclose(file);
+    return err;
+}
+
+/**
+ * @brief Frees the memory of the benchmark
+ */
+static void free_bench(void)
+{
+    for (size_t op = 0; op < NB_OPS; op++) free(s_stats[op].latencies);
+    free(s_zipf_cdf);
+    free(s_image);
+}
+
+// ======================================================================
+int main(int argc, char *argv[])
+{
+    int err = parse_options(argc - 1, argv + 1);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "%s\n", ERR_MESSAGES[err]);
+        fprintf(stderr, "usage: %s [-url URL] [-connections N] [-duration S | -requests N]"
+                " [-mix list=W,read=W,insert=W,delete=W] [-res thumb=W,small=W,orig=W,w320=W...]"
+                " [-keys N] [-zipf S] [-prefix P] [-image FILE] [-populate] [-no_keepalive]"
+                " [-timeout S] [-seed N] [-json FILE|-]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    s_random = s_options.seed * 0x9E3779B97F4A7C15ull + 1;
+    if ((err = init_zipf()) != ERR_NONE || (s_options.image != NULL && (err = load_image()) != ERR_NONE)) {
+        fprintf(stderr, "%s\n", ERR_MESSAGES[err]);
+        free_bench();
+        return EXIT_FAILURE;
+    }
+
+    signal(SIGINT, signal_handler);
+    signal(SIGTERM, signal_handler);
+    // a refused connection must not kill the benchmark
+    signal(SIGPIPE, SIG_IGN);
+    struct mg_mgr mgr;
+    mg_mgr_init(&mgr);
+    s_phase = s_options.populate ? PHASE_POPULATE : PHASE_MEASURE;
+    s_measure_start = metrics_now();
+    while (drive_clients(&mgr)) {
+        if (s_connect_failures >= MAX_CONNECT_FAILURES) {
+            fprintf(stderr, "cannot connect to %s\n", s_options.url);
+            mg_mgr_free(&mgr);
+            free_bench();
+            return EXIT_FAILURE;
+        }
+        mg_mgr_poll(&mgr, 1);
+    }
+    const double seconds = (double) (metrics_now() - s_measure_start) * 1e-9;
+    mg_mgr_free(&mgr);
+
+    err = report(seconds);
+    if (err != ERR_NONE) fprintf(stderr, "%s\n", ERR_MESSAGES[err]);
+    free_bench();
+    return err == ERR_NONE ? EXIT_SUCCESS : EXIT_FAILURE;
+}
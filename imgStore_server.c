@@ -5,13 +5,28 @@
  * @copyright Copyright (c) 2021
  *
  */
+#define _XOPEN_SOURCE 700 // for pthread_rwlock_t and sockets
 #include <stdio.h>
 #include <stdlib.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <unistd.h>
+#include <inttypes.h> // for PRIu64
+#include <string.h>
+#include <time.h>
 #include "mongoose.h"
 #include "imgStore.h"
+#include "image_content.h"
+#include "derivative_cache.h"
+#include "memory_cache.h"
+#include "metrics.h"
+#include "trace.h"
 #include "error.h"
 #include "util.h"
 #include <vips/vips.h> // for VIPS_INIT and vips shutdown
+#include <openssl/evp.h> // for hashing uploads as they arrive
+#include <zlib.h> // for gzip list replies
 
 
 /*
@@ -27,212 +42,2615 @@
 // http server
 static const char *s_root_dir = ".";
 static const char *s_listening_address = "http://localhost:8000";
-// Handle interrupts, like Ctrl-C
+// Handle interrupts, like Ctrl-C, and SIGHUP, which reloads the store files
 static int s_signo;
+static int s_reload;
 static void signal_handler(int signo)
 {
-    s_signo = signo;
+    if (signo == SIGHUP) s_reload = 1;
+    else s_signo = signo;
 }
 
 /**
  * variables needed for handling
  */
-// struct imgst_file
-static struct imgst_file imgst_file;
+#define MAX_SHARDS 64
+/**
+ * @brief One of the store files served, see rank_shards() for the routing of images
+ */
+struct shard {
+    const char* filename;
+    struct imgst_file imgst_file;
+    // handlers only reading the shard take the reader lock, the others the writer lock
+    pthread_rwlock_t lock;
+    unsigned generation; // number of reloads of the file, see reload_shard()
+    // under s_retire_lock: handles of each parity of generation, see acquire_handle()
+    size_t handles[2];
+    FILE* retired; // file replaced by the last reload, closed once its handles are released
+};
+static struct shard s_shards[MAX_SHARDS];
+static size_t s_nb_shards;
+static pthread_mutex_t s_retire_lock = PTHREAD_MUTEX_INITIALIZER;
+/**
+ * @brief The file of a shard as a request saw it: the file stays open, even if
+ * a reload swaps in another one, until the handle is released
+ */
+struct handle {
+    struct shard* shard;
+    FILE* file;
+    unsigned generation;
+};
+// inserts check all the shards for the img_id before writing to one
+static pthread_mutex_t s_insert_lock = PTHREAD_MUTEX_INITIALIZER;
+// resolutions, the same in all the shards
+#define RESOLUTIONS (&s_shards[0].imgst_file.header)
+// on-disk cache of the images resized on the fly (read with w=)
+static struct derivative_cache s_variant_cache;
+// the index of the variant cache is not thread-safe
+static pthread_mutex_t s_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+// in-memory cache of the hot images of the store
+static struct memory_cache s_memory_cache;
+static pthread_mutex_t s_memory_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define MAX_BUCKETS 16
+#define MAX_THREADS 256
+#define MB (1024 * 1024)
+// classes of the requests handed to the workers, from the first served to the last
+enum priority {PRIO_READ, PRIO_RESIZE, PRIO_WRITE, NB_PRIORITIES};
+/**
+ * @brief Server configuration, set from the command line
+ */
+static struct {
+    uint16_t buckets[MAX_BUCKETS]; // widths the w= parameter snaps to, in increasing order
+    size_t nb_buckets;
+    const char* cache_dir; // directory of the on-disk variant cache
+    uint64_t cache_size; // bound on the variant cache, in bytes
+    uint64_t memory_cache_size; // bound on the in-memory cache, in bytes, 0 to disable it
+    struct res_encoding variant_encoding; // encoding of the variants
+    uint64_t max_pixels; // largest original accepted for insertion and resizing
+    uint64_t max_resize_memory; // memory budget of one resize, in bytes
+    size_t max_upload; // largest image accepted by an upload, in bytes
+    size_t max_upload_total; // memory all the uploads in progress can hold, in bytes
+    size_t max_resizes; // resizes running at the same time
+    size_t max_conn_buffer; // bytes waiting to be sent on a connection above which its requests are refused
+    size_t nb_threads; // worker threads handling the store, 0 to handle everything in the event loop
+    unsigned weights[NB_PRIORITIES]; // jobs of each class the workers take in a round, see next_priority()
+    int read_only; // the store is opened "rb": inserts and deletes are refused, the writer's changes are refreshed
+    int reuse_port; // listen with SO_REUSEPORT, to share the port with other servers of the same store
+    uint64_t trace_slow; // requests that take longer are traced to stderr, in nanoseconds, 0 for none
+    unsigned trace_sample; // one request in trace_sample is traced to trace_file, 0 for none
+    const char* trace_file; // where the sampled requests are traced
+} s_options = {
+    .buckets = {160, 320, 640, 1280, 1920},
+    .nb_buckets = 5,
+    .cache_dir = "/tmp/imgStore_cache",
+    .cache_size = 256 * MB,
+    .memory_cache_size = 64 * MB,
+    .variant_encoding = {ENC_JPEG, DEFAULT_QUALITY, SUBSAMPLE_AUTO, 1},
+    .max_pixels = DEFAULT_MAX_PIXELS,
+    .max_resize_memory = DEFAULT_RESIZE_MEMORY,
+    .max_upload = 32 * MB,
+    .max_upload_total = 256 * MB,
+    .max_resizes = 8,
+    .max_conn_buffer = 16 * MB,
+    .weights = {8, 2, 1}
+};
+
+// metrics: the counters, then the histograms of the stages and of each entry of handler_mappings
+enum {COUNTER_BYTES_IN, COUNTER_BYTES_OUT, COUNTER_ERRORS, COUNTER_LAZY_RESIZES, COUNTER_REJECTED, NB_COUNTERS};
+enum {STAGE_LOOKUP, STAGE_DISK_READ, STAGE_RESIZE, NB_STAGES};
+static const char* const STAGE_NAMES[NB_STAGES] = {"lookup", "disk_read", "resize"};
+
+/********************************************************************//**
+* A handler is a function that we use to handle an http call
+*********************************************************************** */
+typedef void(*handler)(struct mg_connection *nc, struct mg_http_message *hm);
+
+/********************************************************************//**
+ * A handler_mapping is used to map a handler to its name as it will
+ * be called in the uri.
+ ********************************************************************** */
+typedef struct {
+    const char* uri;
+    const handler cmd;
+    const char* type;
+} handler_mapping;
+
+#define RETRY_AFTER "1" // seconds after which a request refused with ERR_BUSY can be sent again
+/**
+ * @brief Error message routine. ERR_BUSY, for requests over an admission
+ * limit, is answered with 503 and Retry-After rather than 500, and
+ * ERR_BATCH_TOO_LARGE with 413.
+ *
+ * @param nc struct mg_correction
+ * @param error to print
+ */
+static void mg_error_msg(struct mg_connection* nc, int error)
+{
+    if (error == ERR_BUSY) {
+        metrics_count(COUNTER_REJECTED, 1);
+        mg_http_reply(nc, 503, "Retry-After: " RETRY_AFTER "\r\n",
+                      "Error: %s", ERR_MESSAGES[error]);
+        return;
+    }
+    metrics_count(COUNTER_ERRORS, 1);
+    mg_http_reply(nc, error == ERR_BATCH_TOO_LARGE ? 413 : 500, "",
+                  "Error: %s", ERR_MESSAGES[error]);
+}
+
+// resizes in progress, bounded by s_options.max_resizes
+static size_t s_resizes;
+static pthread_mutex_t s_resize_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Takes one of the max_resizes slots, without waiting. Reads that need
+ * no resize never take one, so that they are served whatever the resize load.
+ *
+ * @return int ERR_BUSY if all the slots are taken. 0 if no error.
+ */
+static int start_resize(void)
+{
+    int err = ERR_NONE;
+    pthread_mutex_lock(&s_resize_lock);
+    if (s_resizes < s_options.max_resizes) ++s_resizes;
+    else err = ERR_BUSY;
+    pthread_mutex_unlock(&s_resize_lock);
+    return err;
+}
+
+/**
+ * @brief Gives back a slot taken by start_resize()
+ */
+static void end_resize(void)
+{
+    pthread_mutex_lock(&s_resize_lock);
+    --s_resizes;
+    pthread_mutex_unlock(&s_resize_lock);
+}
+
+/**
+ * @brief Sends an image as the body of a 200 reply
+ *
+ * @param nc struct mg_connection connection to reply to
+ * @param buffer the image
+ * @param size size of the image
+ * @param mime_type Content-Type of the image
+ * @param headers caching headers, see caching_headers()
+ */
+static void reply_image(struct mg_connection *nc, const void* buffer, size_t size, const char* mime_type,
+                        const char* headers)
+{
+    mg_printf(
+    nc,
+    "HTTP/1.1 200 OK\r\n"
+    "%s"
+    "Content-Length: %zu\r\n"
+    "Content-Type: %s\r\n\r\n",
+    headers,
+    size,
+    mime_type
+    );
+    const uint64_t sent = trace_clock();
+    mg_send(nc, buffer, size);
+    trace_span("send", sent, trace_clock());
+}
+
+#define MAX_WIDTH_DIGITS 5
+#define MAX_CACHING_HEADERS 256
+#define IMMUTABLE_MAX_AGE 31536000 // one year, in seconds
+/**
+ * @brief Builds the ETag and Cache-Control headers of an image. The ETag is the
+ * SHA of the original and the variant, which determine the bytes. As img_id can
+ * be reinserted with another content, its URLs must be revalidated, unless they
+ * carry the SHA ("v" parameter), in which case they never change.
+ *
+ * @param hm the request
+ * @param SHA SHA of the original image
+ * @param variant resolution name or width bucket of the image
+ * @param headers output: the headers, each ending with CRLF
+ */
+static void caching_headers(struct mg_http_message *hm, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                            const char* variant, char headers[MAX_CACHING_HEADERS])
+{
+    char sha_string[2*SHA256_DIGEST_LENGTH + 1] = "";
+    char version[2*SHA256_DIGEST_LENGTH + 1] = "";
+    sha_to_string(SHA, sha_string);
+    const int pinned = mg_http_get_var(&hm->query, "v", version, sizeof(version)) > 0
+                       && !strcmp(version, sha_string);
+    if (pinned) {
+        snprintf(headers, MAX_CACHING_HEADERS, "ETag: \"%s_%s\"\r\n"
+                 "Cache-Control: public, max-age=%d, immutable\r\n", sha_string, variant, IMMUTABLE_MAX_AGE);
+    } else {
+        snprintf(headers, MAX_CACHING_HEADERS, "ETag: \"%s_%s\"\r\n"
+                 "Cache-Control: public, no-cache\r\n", sha_string, variant);
+    }
+}
+
+/**
+ * @brief Extracts the quoted entity tag from caching headers
+ *
+ * @param headers caching headers, see caching_headers()
+ * @param etag output: the entity tag, with its quotes
+ */
+static void header_etag(const char* headers, char etag[MAX_CACHING_HEADERS])
+{
+    // the ETag is the first header line
+    const char* start = strchr(headers, '"');
+    const char* end = start == NULL ? NULL : strchr(start + 1, '"');
+    etag[0] = '\0';
+    if (end != NULL) {
+        memcpy(etag, start, (size_t) (end - start + 1));
+        etag[end - start + 1] = '\0';
+    }
+}
+
+/**
+ * @brief Tells whether an If-None-Match list holds an entity tag (weak
+ * comparison, as required for If-None-Match)
+ *
+ * @param list value of the If-None-Match header
+ * @param etag the quoted entity tag
+ * @return int 1 if it matches
+ */
+static int etag_listed(const struct mg_str* list, const char* etag)
+{
+    const size_t etag_len = strlen(etag);
+    size_t i = 0;
+    while (i < list->len) {
+        while (i < list->len && (list->ptr[i] == ' ' || list->ptr[i] == ',')) ++i;
+        if (i + 2 <= list->len && !strncmp(list->ptr + i, "W/", 2)) i += 2;
+        size_t end = i;
+        while (end < list->len && list->ptr[end] != ',') ++end;
+        size_t len = end - i;
+        while (len > 0 && list->ptr[i + len - 1] == ' ') --len;
+        if ((len == 1 && list->ptr[i] == '*') || (len == etag_len && !strncmp(list->ptr + i, etag, len))) {
+            return 1;
+        }
+        i = end;
+    }
+    return 0;
+}
+
+/**
+ * @brief Replies 304 if the client already holds the image
+ *
+ * @param nc struct mg_connection connection to reply to
+ * @param hm the request
+ * @param headers caching headers of the image, see caching_headers()
+ * @return int 1 if the 304 was sent
+ */
+static int reply_if_not_modified(struct mg_connection *nc, struct mg_http_message *hm, const char* headers)
+{
+    const struct mg_str* if_none_match = mg_http_get_header(hm, "If-None-Match");
+    if (if_none_match == NULL) return 0;
+    char etag[MAX_CACHING_HEADERS] = "";
+    header_etag(headers, etag);
+    if (!etag_listed(if_none_match, etag)) return 0;
+    mg_printf(nc, "HTTP/1.1 304 Not Modified\r\n%s\r\n", headers);
+    return 1;
+}
+
+#define MAX_OFFSET 20 // 2^64
+#define DEFAULT_LIST_LIMIT 100
+#define MAX_LIST_LIMIT 1000
+#define LIST_CACHE_SIZE 16
+#define MIN_GZIP_SIZE 256 // smaller lists are not worth compressing
+/**
+ * @brief A serialized list reply, with its gzip copy
+ */
+struct list_entry {
+    int used;
+    size_t cursor;
+    size_t limit; // 0 for the whole list
+    char* json;
+    size_t json_len;
+    unsigned char* gzip; // NULL if not worth it
+    size_t gzip_len;
+};
+/**
+ * @brief The list replies of the current version of the store. The list only
+ * changes with imgst_version, so the replies are dropped when it changes. With
+ * several shards, the version is the sum of theirs, which grows with each of them.
+ * A reload may set imgst_version back, so the number of reloads comes first.
+ */
+static struct {
+    uint64_t version;
+    struct list_entry entries[LIST_CACHE_SIZE];
+    size_t next_victim; // entries are replaced in turn
+} s_list_cache;
+static pthread_mutex_t s_list_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Frees a cached list reply
+ */
+static void free_list_entry(struct list_entry* entry)
+{
+    free(entry->json);
+    free(entry->gzip);
+    memset(entry, 0, sizeof(struct list_entry));
+}
+
+/**
+ * @brief Frees the cached list replies
+ */
+static void free_list_cache(void)
+{
+    for (size_t i = 0; i < LIST_CACHE_SIZE; i++) {
+        free_list_entry(&s_list_cache.entries[i]);
+    }
+}
+
+/**
+ * @brief Compresses a list reply with gzip
+ *
+ * @param entry the entry whose json is compressed; its gzip copy is left NULL
+ * if compression fails or does not pay
+ */
+static void gzip_list_entry(struct list_entry* entry)
+{
+    if (entry->json_len < MIN_GZIP_SIZE) return;
+    z_stream stream;
+    memset(&stream, 0, sizeof(stream));
+    // 16 + window bits: gzip header and trailer
+    if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 16 + MAX_WBITS, 8, Z_DEFAULT_STRATEGY) != Z_OK) return;
+    // gzip header and trailer on top of the deflate bound
+    const size_t bound = deflateBound(&stream, (uLong) entry->json_len) + 18;
+    unsigned char* gzip = malloc(bound);
+    if (gzip != NULL) {
+        stream.next_in = (Bytef*) entry->json;
+        stream.avail_in = (uInt) entry->json_len;
+        stream.next_out = gzip;
+        stream.avail_out = (uInt) bound;
+        if (deflate(&stream, Z_FINISH) == Z_STREAM_END && stream.total_out < entry->json_len) {
+            entry->gzip = gzip;
+            entry->gzip_len = stream.total_out;
+        } else {
+            free(gzip);
+        }
+    }
+    deflateEnd(&stream);
+}
+
+/**
+ * @brief Serializes a list reply, the whole list or a page
+ *
+ * @param entry output: its cursor and limit are set, json is filled
+ * @return int Some error code. 0 if no error.
+ */
+static int build_list_entry(struct list_entry* entry)
+{
+    const struct imgst_file* stores[MAX_SHARDS];
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        stores[i] = &s_shards[i].imgst_file;
+    }
+    if (entry->limit == 0) {
+        entry->json = do_list_json(stores, s_nb_shards);
+        if (entry->json == NULL) return ERR_OUT_OF_MEMORY;
+        entry->json_len = strlen(entry->json);
+        return ERR_NONE;
+    }
+    // the page is bounded, ids that need escaping only make it shorter
+    const size_t buffer_size = LIST_PAGE_MIN_SIZE + entry->limit * (MAX_IMG_ID + 3);
+    entry->json = malloc(buffer_size);
+    if (entry->json == NULL) return ERR_OUT_OF_MEMORY;
+    size_t next = 0;
+    return do_list_page(stores, s_nb_shards, entry->cursor, entry->limit, entry->json, buffer_size,
+                        &entry->json_len, &next);
+}
+
+/**
+ * @brief Takes the reader locks of all the shards, in order
+ */
+static void lock_shards(void)
+{
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        pthread_rwlock_rdlock(&s_shards[i].lock);
+    }
+}
+
+/**
+ * @brief Releases the locks taken by lock_shards()
+ */
+static void unlock_shards(void)
+{
+    for (size_t i = s_nb_shards; i > 0; i--) {
+        pthread_rwlock_unlock(&s_shards[i - 1].lock);
+    }
+}
+
+/**
+ * @brief Sends a list reply, compressed if the client accepts it
+ */
+static void reply_list_entry(struct mg_connection *nc, struct mg_http_message *hm, const struct list_entry* entry,
+                             const char* headers)
+{
+    const struct mg_str* accept_encoding = mg_http_get_header(hm, "Accept-Encoding");
+    const int gzip = entry->gzip != NULL && accept_encoding != NULL
+                     && mg_strstr(*accept_encoding, mg_str("gzip")) != NULL;
+    mg_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "%s"
+              "%s"
+              "Content-Type: application/json\r\n"
+              "Content-Length: %zu\r\n\r\n",
+              headers, gzip ? "Content-Encoding: gzip\r\n" : "", gzip ? entry->gzip_len : entry->json_len);
+    mg_send(nc, gzip ? (const void*) entry->gzip : (const void*) entry->json, gzip ? entry->gzip_len : entry->json_len);
+}
+
+/**
+ * @brief Handles a list call. With a cursor or a limit (/imgStore/list?cursor=C&limit=N),
+ * the list is paginated, see do_list_page(); otherwise it is listed whole. The
+ * images of all the shards are listed, shard after shard.
+ * Replies are cached for the current imgst_version, which is also their ETag
+ * (with the number of reloads in its high bits).
+ *
+ * @param nc struct mg_connection connection that received a list call event
+ * @param hm the request
+ */
+static void handle_list_call(struct mg_connection *nc, struct mg_http_message *hm)
+{
+    char cursor[MAX_OFFSET + 1] = "";
+    char limit[MAX_OFFSET + 1] = "";
+    const int cursor_l = mg_http_get_var(&hm->query, "cursor", cursor, MAX_OFFSET);
+    const int limit_l = mg_http_get_var(&hm->query, "limit", limit, MAX_OFFSET);
+    size_t page_cursor = 0;
+    size_t page_limit = 0;
+    if (cursor_l > 0 || limit_l > 0) {
+        page_cursor = cursor_l > 0 ? atouint32(cursor) : 0;
+        page_limit = limit_l > 0 ? atouint32(limit) : DEFAULT_LIST_LIMIT;
+        if (page_limit == 0 || page_limit > MAX_LIST_LIMIT) {
+            mg_error_msg(nc, ERR_INVALID_ARGUMENT);
+            return;
+        }
+    }
+
+    lock_shards();
+    uint32_t reloads = 0;
+    uint32_t versions = 0;
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        reloads += s_shards[i].generation;
+        versions += s_shards[i].imgst_file.header.imgst_version;
+    }
+    const uint64_t version = (uint64_t) reloads << 32 | versions;
+    char headers[MAX_CACHING_HEADERS] = "";
+    // weak, as the gzip and identity replies share it
+    snprintf(headers, sizeof(headers), "ETag: W/\"%" PRIu64 "\"\r\n"
+             "Cache-Control: no-cache\r\n"
+             "Vary: Accept-Encoding\r\n", version);
+    if (reply_if_not_modified(nc, hm, headers)) {
+        unlock_shards();
+        return;
+    }
+
+    pthread_mutex_lock(&s_list_lock);
+    if (s_list_cache.version != version) {
+        free_list_cache();
+        s_list_cache.version = version;
+    }
+    for (size_t i = 0; i < LIST_CACHE_SIZE; i++) {
+        const struct list_entry* entry = &s_list_cache.entries[i];
+        if (entry->used && entry->cursor == page_cursor && entry->limit == page_limit) {
+            reply_list_entry(nc, hm, entry, headers);
+            pthread_mutex_unlock(&s_list_lock);
+            unlock_shards();
+            return;
+        }
+    }
+
+    struct list_entry* entry = &s_list_cache.entries[s_list_cache.next_victim];
+    s_list_cache.next_victim = (s_list_cache.next_victim + 1) % LIST_CACHE_SIZE;
+    free_list_entry(entry);
+    entry->cursor = page_cursor;
+    entry->limit = page_limit;
+    const int err = build_list_entry(entry);
+    if (err != ERR_NONE) {
+        free_list_entry(entry);
+        mg_error_msg(nc, err);
+    } else {
+        gzip_list_entry(entry);
+        entry->used = 1;
+        reply_list_entry(nc, hm, entry, headers);
+    }
+    pthread_mutex_unlock(&s_list_lock);
+    unlock_shards();
+}
+
+/**
+ * @brief Snaps a requested width to the smallest configured bucket that is
+ * at least as wide, or to the widest bucket.
+ */
+static uint16_t snap_to_bucket(uint32_t width)
+{
+    for (size_t i = 0; i < s_options.nb_buckets; i++) {
+        if (s_options.buckets[i] >= width) return s_options.buckets[i];
+    }
+    return s_options.buckets[s_options.nb_buckets - 1];
+}
+
+/**
+ * @brief Mixes the bits of a 64-bit value (the finalizer of splitmix64)
+ */
+static uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ull;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebull;
+    return x ^ (x >> 31);
+}
+
+/**
+ * @brief Ranks the shards for an image by rendezvous hashing: each shard
+ * scores the img_id, the best score first. An image is inserted into the first
+ * shard of its ranking with room left, so that it is found in the first one
+ * unless that one was full. Adding a shard at the end of the command line only
+ * moves the first choice of about one image in the number of shards, and the
+ * images already stored are still found further down their ranking.
+ *
+ * @param img_id id of the image
+ * @param ranking output: the s_nb_shards shard numbers, in order
+ */
+static void rank_shards(const char* img_id, size_t ranking[MAX_SHARDS])
+{
+    // FNV-1a of the id, then one score per shard
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (const char* c = img_id; *c != '\0'; c++) {
+        hash = (hash ^ (unsigned char) *c) * 0x100000001b3ull;
+    }
+    uint64_t scores[MAX_SHARDS];
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        const uint64_t score = mix64(hash ^ mix64(i + 1));
+        // insertion sort, there are few shards
+        size_t j = i;
+        for (; j > 0 && scores[j - 1] < score; j--) {
+            scores[j] = scores[j - 1];
+            ranking[j] = ranking[j - 1];
+        }
+        scores[j] = score;
+        ranking[j] = i;
+    }
+}
+
+/**
+ * @brief Finds an image in the metadata of a shard, timed as the lookup stage.
+ * The caller holds the lock of the shard.
+ *
+ * @param shard the shard
+ * @param index output: index of the image in the metadata
+ * @param img_id id of the image
+ * @return int Some error code. 0 if no error.
+ */
+static int lookup_in(const struct shard* shard, size_t* index, const char* img_id)
+{
+    const uint64_t start = metrics_now();
+    const int err = find_img_id(index, &shard->imgst_file, img_id);
+    const uint64_t end = metrics_now();
+    metrics_observe(STAGE_LOOKUP, end - start);
+    trace_span("lookup", start, end);
+    return err;
+}
+
+/**
+ * @brief Finds an image in the shards, in the order of its ranking, and takes
+ * the reader lock of the shard that holds it. An image that is not stored is
+ * looked for in every shard.
+ *
+ * @param shard output: the shard holding the image, whose reader lock the caller releases
+ * @param index output: index of the image in its metadata
+ * @param img_id id of the image
+ * @return int Some error code, and no lock is held. 0 if no error.
+ */
+static int lookup(struct shard** shard, size_t* index, const char* img_id)
+{
+    size_t ranking[MAX_SHARDS];
+    rank_shards(img_id, ranking);
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        struct shard* candidate = &s_shards[ranking[i]];
+        pthread_rwlock_rdlock(&candidate->lock);
+        if (lookup_in(candidate, index, img_id) == ERR_NONE) {
+            *shard = candidate;
+            return ERR_NONE;
+        }
+        pthread_rwlock_unlock(&candidate->lock);
+    }
+    return ERR_FILE_NOT_FOUND;
+}
+
+/**
+ * @brief Key of an image of a shard in the memory cache, unique over the shards
+ */
+static uint32_t cache_slot(const struct shard* shard, size_t index)
+{
+    return (uint32_t) ((size_t) (shard - s_shards) * MAX_MAX_FILES + index);
+}
+
+/**
+ * @brief Tells whether a store has the resolutions of the first shard
+ */
+static int same_resolutions(const struct imgst_header* header)
+{
+    return header->nb_resized == RESOLUTIONS->nb_resized
+           && !memcmp(header->res_resized, RESOLUTIONS->res_resized, sizeof(header->res_resized))
+           && !memcmp(header->res_names, RESOLUTIONS->res_names, sizeof(header->res_names))
+           && !memcmp(header->res_encoding, RESOLUTIONS->res_encoding, sizeof(header->res_encoding));
+}
+
+/**
+ * @brief Takes a handle on the current file of a shard, for reads made once
+ * the lock of the shard is released. The caller holds the lock.
+ *
+ * @param shard the shard
+ * @param handle output: the handle, to be released with release_handle()
+ */
+static void acquire_handle(struct shard* shard, struct handle* handle)
+{
+    handle->shard = shard;
+    handle->file = shard->imgst_file.file;
+    handle->generation = shard->generation;
+    pthread_mutex_lock(&s_retire_lock);
+    ++shard->handles[handle->generation % 2];
+    pthread_mutex_unlock(&s_retire_lock);
+}
+
+/**
+ * @brief Releases a handle, and closes the file it was on if a reload replaced
+ * it and this was its last handle
+ */
+static void release_handle(const struct handle* handle)
+{
+    struct shard* shard = handle->shard;
+    pthread_mutex_lock(&s_retire_lock);
+    --shard->handles[handle->generation % 2];
+    // the retired file is of the previous generation
+    if (shard->retired != NULL && handle->generation != shard->generation && shard->handles[handle->generation % 2] == 0) {
+        fclose(shard->retired);
+        shard->retired = NULL;
+    }
+    pthread_mutex_unlock(&s_retire_lock);
+}
+
+/**
+ * @brief Tells whether the memory cache holds the images of the file of a
+ * handle. The caller holds s_memory_lock, under which reloads swap the files.
+ */
+static int handle_is_current(const struct handle* handle)
+{
+    return handle->generation == handle->shard->generation;
+}
+
+/**
+ * @brief Finds where an image is stored, under the reader lock. Resolutions
+ * that are not materialized yet are resized under the writer lock instead,
+ * except on a read-only server, which outputs offset 0 for them.
+ *
+ * @param img_id id of the image
+ * @param SHA expected SHA of the image, NULL for any
+ * @param resolution resolution code
+ * @param handle output: handle on the file holding the image, to be released
+ * with release_handle() if no error
+ * @param slot output: index of the image in the metadata of the shard
+ * @param offset output: position of the image in the file
+ * @param size output: size of the image
+ * @param encoder output: encoder of the stored bytes
+ * @return int ERR_FILE_NOT_FOUND if the image is not found or its SHA is not the
+ * expected one, some other error code, 0 if no error.
+ */
+static int locate_stored(const char* img_id, const unsigned char SHA[SHA256_DIGEST_LENGTH], int resolution,
+                         struct handle* handle, size_t* slot, uint64_t* offset, uint32_t* size, int* encoder)
+{
+    if (!is_valid_resolution(RESOLUTIONS, resolution)) return ERR_RESOLUTIONS;
+    size_t index = 0;
+    struct shard* found = NULL;
+    int err = lookup(&found, &index, img_id);
+    if (err != ERR_NONE) return err;
+    const struct imgst_file* imgst_file = &found->imgst_file;
+    if (imgst_file->metadata[index].offset[resolution] == 0 && !s_options.read_only) {
+        // lazily_resize writes to the store
+        pthread_rwlock_unlock(&found->lock);
+        err = start_resize();
+        if (err != ERR_NONE) return err;
+        pthread_rwlock_wrlock(&found->lock);
+        err = lookup_in(found, &index, img_id);
+        if (err == ERR_NONE) {
+            const uint64_t start = metrics_now();
+            err = lazily_resize(resolution, &found->imgst_file, index);
+            const uint64_t end = metrics_now();
+            metrics_observe(STAGE_RESIZE, end - start);
+            trace_span("lazily_resize", start, end);
+            metrics_count(COUNTER_LAZY_RESIZES, 1);
+        }
+        end_resize();
+    }
+    // replaced since the caller read its SHA
+    if (err == ERR_NONE && SHA != NULL && memcmp(imgst_file->metadata[index].SHA, SHA, SHA256_DIGEST_LENGTH)) {
+        err = ERR_FILE_NOT_FOUND;
+    }
+    if (err == ERR_NONE) {
+        acquire_handle(found, handle);
+        *slot = index;
+        *offset = imgst_file->metadata[index].offset[resolution];
+        *size = imgst_file->metadata[index].size[resolution];
+        // aliased resolutions hold the bytes of the original
+        *encoder = stored_encoder(imgst_file, index, resolution);
+    }
+    pthread_rwlock_unlock(&found->lock);
+    return err;
+}
+
+#define MAX_RANGES 16
+#define BYTERANGES_BOUNDARY "imgStore-byteranges-7d3f0a9c"
+/**
+ * @brief A satisfiable byte range, bounds included
+ */
+struct byte_range {
+    uint64_t first;
+    uint64_t last;
+};
+
+/**
+ * @brief Parses a decimal number of a Range header
+ *
+ * @param str the header
+ * @param i position in str, moved after the number
+ * @param value output: the number
+ * @return int 1 if there was a number, 0 otherwise
+ */
+static int parse_range_number(const struct mg_str* str, size_t* i, uint64_t* value)
+{
+    const size_t start = *i;
+    *value = 0;
+    while (*i < str->len && str->ptr[*i] >= '0' && str->ptr[*i] <= '9') {
+        const uint64_t digit = (uint64_t) (str->ptr[*i] - '0');
+        if (*value > (UINT64_MAX - digit) / 10) return 0;
+        *value = *value * 10 + digit;
+        ++*i;
+    }
+    return *i > start;
+}
+
+/**
+ * @brief Parses a Range header ("bytes=0-99,200-,-50") against the size of an image
+ *
+ * @param header value of the Range header
+ * @param size size of the image
+ * @param ranges output: the satisfiable ranges, in request order
+ * @return int number of satisfiable ranges, or -1 if the header must be ignored
+ * (syntax error, other unit, too many ranges)
+ */
+static int parse_ranges(const struct mg_str* header, uint64_t size, struct byte_range ranges[MAX_RANGES])
+{
+    static const char unit[] = "bytes=";
+    if (header->len < sizeof(unit) - 1 || strncmp(header->ptr, unit, sizeof(unit) - 1)) return -1;
+    size_t i = sizeof(unit) - 1;
+    int nb_ranges = 0;
+    int nb_specs = 0;
+    while (i < header->len) {
+        while (i < header->len && (header->ptr[i] == ' ' || header->ptr[i] == ',')) ++i;
+        if (i == header->len) break;
+        if (++nb_specs > MAX_RANGES) return -1;
+
+        uint64_t first = 0, last = 0;
+        const int has_first = parse_range_number(header, &i, &first);
+        if (i == header->len || header->ptr[i] != '-') return -1;
+        ++i;
+        const int has_last = parse_range_number(header, &i, &last);
+        while (i < header->len && header->ptr[i] == ' ') ++i;
+        if (i < header->len && header->ptr[i] != ',') return -1;
+
+        if (has_first) {
+            if (has_last && last < first) return -1;
+            // ranges starting after the end are unsatisfiable, the others are clamped
+            if (first >= size) continue;
+            if (!has_last || last >= size) last = size - 1;
+        } else {
+            // suffix range: the last bytes
+            if (!has_last) return -1;
+            if (last == 0 || size == 0) continue;
+            first = last >= size ? 0 : size - last;
+            last = size - 1;
+        }
+        ranges[nb_ranges].first = first;
+        ranges[nb_ranges].last = last;
+        ++nb_ranges;
+    }
+    return nb_specs == 0 ? -1 : nb_ranges;
+}
+
+/**
+ * @brief Tells whether the Range header of a request applies: If-Range, when
+ * present, must hold the current entity tag (dates are never trusted)
+ *
+ * @param hm the request
+ * @param headers caching headers of the image, see caching_headers()
+ * @return int 1 if the ranges must be served
+ */
+static int range_applies(struct mg_http_message *hm, const char* headers)
+{
+    const struct mg_str* if_range = mg_http_get_header(hm, "If-Range");
+    if (if_range == NULL) return 1;
+    char etag[MAX_CACHING_HEADERS] = "";
+    header_etag(headers, etag);
+    return if_range->len == strlen(etag) && !strncmp(if_range->ptr, etag, if_range->len);
+}
+
+/**
+ * @brief Sends ranges of an image of the store as a 206 reply, a
+ * multipart/byteranges one if there are several
+ *
+ * @param nc struct mg_connection connection to reply to
+ * @param handle the file holding the image
+ * @param offset position of the image in the file
+ * @param size size of the image
+ * @param mime_type Content-Type of the image
+ * @param headers caching headers, see caching_headers()
+ * @param ranges the satisfiable ranges
+ * @param nb_ranges number of ranges, at least 1
+ */
+static void reply_stored_ranges(struct mg_connection *nc, const struct handle* handle, uint64_t offset, uint32_t size,
+                                const char* mime_type, const char* headers, const struct byte_range* ranges,
+                                int nb_ranges)
+{
+    const int fd = fileno(handle->file);
+    if (nb_ranges == 1) {
+        mg_printf(nc,
+                  "HTTP/1.1 206 Partial Content\r\n"
+                  "%s"
+                  "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu32 "\r\n"
+                  "Content-Length: %" PRIu64 "\r\n"
+                  "Content-Type: %s\r\n\r\n",
+                  headers, ranges[0].first, ranges[0].last, size,
+                  ranges[0].last - ranges[0].first + 1, mime_type);
+        if (!mg_send_file_range(nc, fd, offset + ranges[0].first, (size_t) (ranges[0].last - ranges[0].first + 1))) {
+            nc->is_closing = 1;
+        }
+        return;
+    }
+
+    // the length of the whole multipart body is needed first
+    static const char part_format[] = "\r\n--" BYTERANGES_BOUNDARY "\r\n"
+                                      "Content-Type: %s\r\n"
+                                      "Content-Range: bytes %" PRIu64 "-%" PRIu64 "/%" PRIu32 "\r\n\r\n";
+    static const char end[] = "\r\n--" BYTERANGES_BOUNDARY "--\r\n";
+    uint64_t length = sizeof(end) - 1;
+    for (int i = 0; i < nb_ranges; i++) {
+        length += (uint64_t) snprintf(NULL, 0, part_format, mime_type, ranges[i].first, ranges[i].last, size)
+                  + ranges[i].last - ranges[i].first + 1;
+    }
+    mg_printf(nc,
+              "HTTP/1.1 206 Partial Content\r\n"
+              "%s"
+              "Content-Length: %" PRIu64 "\r\n"
+              "Content-Type: multipart/byteranges; boundary=" BYTERANGES_BOUNDARY "\r\n\r\n",
+              headers, length);
+    for (int i = 0; i < nb_ranges; i++) {
+        mg_printf(nc, part_format, mime_type, ranges[i].first, ranges[i].last, size);
+        if (!mg_send_file_range(nc, fd, offset + ranges[i].first, (size_t) (ranges[i].last - ranges[i].first + 1))) {
+            nc->is_closing = 1;
+            return;
+        }
+    }
+    mg_send(nc, end, sizeof(end) - 1);
+}
+
+/**
+ * @brief Sends the bytes of an image of the store. Images small enough for the
+ * memory cache are sent from it, and read into it on a miss; the others go
+ * straight from the store file to the socket.
+ *
+ * @param nc struct mg_connection connection to send to
+ * @param handle the file holding the image
+ * @param slot index of the image in the metadata of the shard
+ * @param resolution resolution code
+ * @param offset position of the image in the file
+ * @param size size of the image
+ */
+static void send_stored_body(struct mg_connection *nc, const struct handle* handle, size_t slot, int resolution,
+                             uint64_t offset, uint32_t size)
+{
+    const uint32_t key = cache_slot(handle->shard, slot);
+    if (mcache_admits(&s_memory_cache, size)) {
+        pthread_mutex_lock(&s_memory_lock);
+        const struct mcache_entry* entry = handle_is_current(handle)
+                                           ? mcache_get(&s_memory_cache, key, resolution, offset) : NULL;
+        if (entry != NULL) {
+            // the entry may be evicted as soon as the lock is released
+            const uint64_t sent = trace_clock();
+            mg_send(nc, entry->data, size);
+            trace_span("send", sent, trace_clock());
+            pthread_mutex_unlock(&s_memory_lock);
+            return;
+        }
+        pthread_mutex_unlock(&s_memory_lock);
+
+        void* image = malloc(size);
+        if (image != NULL) {
+            const uint64_t start = metrics_now();
+            const int err = read_disk_image(handle->file, &image, size, (long) offset);
+            const uint64_t end = metrics_now();
+            metrics_observe(STAGE_DISK_READ, end - start);
+            trace_span("read_disk_image", start, end);
+            if (err == ERR_NONE) {
+                const uint64_t sent = trace_clock();
+                mg_send(nc, image, size);
+                trace_span("send", sent, trace_clock());
+                pthread_mutex_lock(&s_memory_lock);
+                if (handle_is_current(handle)) {
+                    mcache_put(&s_memory_cache, key, resolution, offset, image, size);
+                } else {
+                    free(image);
+                }
+                pthread_mutex_unlock(&s_memory_lock);
+                return;
+            }
+        }
+        free(image);
+    }
+    const uint64_t sent = trace_clock();
+    if (!mg_send_file_range(nc, fileno(handle->file), offset, size)) {
+        // the headers are already out
+        nc->is_closing = 1;
+    }
+    trace_span("send", sent, trace_clock());
+}
+
+/**
+ * @brief Sends an image of the store, or the ranges of it that are requested
+ *
+ * @param nc struct mg_connection connection to reply to
+ * @param hm the request
+ * @param handle the file holding the image
+ * @param slot index of the image in the metadata of the shard
+ * @param resolution resolution code
+ * @param offset position of the image in the file
+ * @param size size of the image
+ * @param mime_type Content-Type of the image
+ * @param headers caching headers, see caching_headers()
+ */
+static void reply_stored(struct mg_connection *nc, struct mg_http_message *hm, const struct handle* handle,
+                         size_t slot, int resolution, uint64_t offset, uint32_t size, const char* mime_type,
+                         const char* headers)
+{
+    const struct mg_str* range = mg_http_get_header(hm, "Range");
+    if (range != NULL && range_applies(hm, headers)) {
+        struct byte_range ranges[MAX_RANGES];
+        const int nb_ranges = parse_ranges(range, size, ranges);
+        if (nb_ranges == 0) {
+            mg_printf(nc,
+                      "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                      "%s"
+                      "Content-Range: bytes */%" PRIu32 "\r\n"
+                      "Content-Length: 0\r\n\r\n",
+                      headers, size);
+            return;
+        }
+        if (nb_ranges > 0) {
+            reply_stored_ranges(nc, handle, offset, size, mime_type, headers, ranges, nb_ranges);
+            return;
+        }
+    }
+
+    mg_printf(
+    nc,
+    "HTTP/1.1 200 OK\r\n"
+    "%s"
+    "Accept-Ranges: bytes\r\n"
+    "Content-Length: %zu\r\n"
+    "Content-Type: %s\r\n\r\n",
+    headers,
+    (size_t) size,
+    mime_type
+    );
+    send_stored_body(nc, handle, slot, resolution, offset, size);
+}
+
+/**
+ * @brief Replies with a resolution that the writer did not materialize yet: a
+ * read-only server resizes it in memory instead. The result is kept in the
+ * memory cache under offset 0, until a refresh changes the metadata of the slot.
+ *
+ * @param nc struct mg_connection connection to reply to
+ * @param img_id id of the image
+ * @param handle the file holding the image
+ * @param slot index of the image in the metadata of the shard
+ * @param resolution resolution code
+ * @param headers caching headers, see caching_headers()
+ */
+static void reply_resized(struct mg_connection *nc, const char* img_id, const struct handle* handle, size_t slot,
+                          int resolution, const char* headers)
+{
+    struct shard* shard = handle->shard;
+    pthread_mutex_lock(&s_memory_lock);
+    const struct mcache_entry* entry = handle_is_current(handle)
+                                       ? mcache_get(&s_memory_cache, cache_slot(shard, slot), resolution, 0) : NULL;
+    if (entry != NULL) {
+        // the encoding of a resolution never changes
+        reply_image(nc, entry->data, entry->size,
+                    encoder_mime_type(RESOLUTIONS->res_encoding[resolution].encoder), headers);
+        pthread_mutex_unlock(&s_memory_lock);
+        return;
+    }
+    pthread_mutex_unlock(&s_memory_lock);
+
+    int err = start_resize();
+    if (err != ERR_NONE) {
+        mg_error_msg(nc, err);
+        return;
+    }
+    void* resized = NULL;
+    size_t resized_size = 0;
+    size_t index = 0;
+    const struct imgst_header* header = RESOLUTIONS;
+    const struct res_encoding encoding = header->res_encoding[resolution];
+    pthread_rwlock_rdlock(&shard->lock);
+    err = lookup_in(shard, &index, img_id);
+    if (err == ERR_NONE) {
+        const uint64_t start = metrics_now();
+        err = resize_to_buffer(&shard->imgst_file, index, header->res_resized[2 * resolution],
+                               header->res_resized[2 * resolution + 1], &encoding, &resized, &resized_size);
+        const uint64_t end = metrics_now();
+        metrics_observe(STAGE_RESIZE, end - start);
+        trace_span("resize", start, end);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    end_resize();
+    if (err != ERR_NONE) {
+        mg_error_msg(nc, err);
+        return;
+    }
+    reply_image(nc, resized, resized_size, encoder_mime_type(encoding.encoder), headers);
+    if (index == slot && mcache_admits(&s_memory_cache, resized_size)) {
+        char* copy = malloc(resized_size);
+        if (copy != NULL) {
+            memcpy(copy, resized, resized_size);
+            pthread_mutex_lock(&s_memory_lock);
+            if (handle_is_current(handle)) {
+                mcache_put(&s_memory_cache, cache_slot(shard, slot), resolution, 0, copy, resized_size);
+            } else {
+                free(copy);
+            }
+            pthread_mutex_unlock(&s_memory_lock);
+        }
+    }
+    g_free(resized);
+    resized = NULL;
+}
+
+/**
+ * @brief Replies with an image of the store, unless it is not found
+ *
+ * @param nc struct mg_connection connection to reply to
+ * @param hm the request, for its Range header
+ * @param img_id id of the image
+ * @param SHA SHA of the image the headers were made for
+ * @param resolution resolution code
+ * @param headers caching headers, see caching_headers()
+ * @return int ERR_FILE_NOT_FOUND if the image is not found or was replaced,
+ * some other error code, 0 if the image was sent. Nothing is sent on an error.
+ */
+static int send_stored(struct mg_connection *nc, struct mg_http_message *hm, const char* img_id,
+                       const unsigned char SHA[SHA256_DIGEST_LENGTH], int resolution, const char* headers)
+{
+    struct handle handle;
+    size_t slot = 0;
+    uint64_t offset = 0;
+    uint32_t size = 0;
+    int encoder = ENC_JPEG;
+    const int err = locate_stored(img_id, SHA, resolution, &handle, &slot, &offset, &size, &encoder);
+    if (err != ERR_NONE) return err;
+    if (offset == 0) {
+        reply_resized(nc, img_id, &handle, slot, resolution, headers);
+    } else {
+        reply_stored(nc, hm, &handle, slot, resolution, offset, size, encoder_mime_type(encoder), headers);
+    }
+    release_handle(&handle);
+    return ERR_NONE;
+}
+
+#define MAX_READ_ATTEMPTS 2 // an image replaced while it is read is looked up again, once
+/**
+ * @brief Reads an image of the store at a resolution, or answers 304 without
+ * touching the disk if the client already holds it. The caching headers and
+ * the bytes come from the same image, even if it is replaced meanwhile.
+ *
+ * @param nc struct mg_connection connection that received the read call
+ * @param hm the request
+ * @param img_id id of the image
+ * @param resolution resolution code
+ */
+static void handle_stored_read(struct mg_connection *nc, struct mg_http_message *hm, const char* img_id, int resolution)
+{
+    int err = ERR_NONE;
+    for (int attempt = 0; attempt < MAX_READ_ATTEMPTS; attempt++) {
+        unsigned char SHA[SHA256_DIGEST_LENGTH];
+        struct shard* shard = NULL;
+        size_t index = 0;
+        err = lookup(&shard, &index, img_id);
+        if (err != ERR_NONE) break;
+        memcpy(SHA, shard->imgst_file.metadata[index].SHA, SHA256_DIGEST_LENGTH);
+        pthread_rwlock_unlock(&shard->lock);
+
+        char headers[MAX_CACHING_HEADERS] = "";
+        caching_headers(hm, SHA, resolution_name(RESOLUTIONS, resolution), headers);
+        if (reply_if_not_modified(nc, hm, headers)) return;
+        err = send_stored(nc, hm, img_id, SHA, resolution, headers);
+        if (err != ERR_FILE_NOT_FOUND) break;
+    }
+    if (err != ERR_NONE) mg_error_msg(nc, err);
+}
+
+/**
+ * @brief Reads an image resized on the fly to a width bucket, through the variant cache
+ *
+ * @param nc struct mg_connection connection that received the read call
+ * @param hm the request
+ * @param img_id id of the image
+ * @param width requested width
+ */
+static void handle_variant_read(struct mg_connection *nc, struct mg_http_message *hm, const char* img_id, uint32_t width)
+{
+    struct shard* shard = NULL;
+    size_t index = 0;
+    int err = lookup(&shard, &index, img_id);
+    if (err != ERR_NONE) {
+        mg_error_msg(nc, err);
+        return;
+    }
+    // the metadata may move once the lock is released
+    const struct img_metadata metadata = shard->imgst_file.metadata[index];
+    pthread_rwlock_unlock(&shard->lock);
+    const uint16_t bucket = snap_to_bucket(width);
+    const int encoder = s_options.variant_encoding.encoder;
+
+    char variant[MAX_WIDTH_DIGITS + MAX_EXT_NAME + 2] = "";
+    snprintf(variant, sizeof(variant), "w%u%s", (unsigned) bucket, encoder_extension(encoder));
+    char headers[MAX_CACHING_HEADERS] = "";
+    caching_headers(hm, metadata.SHA, variant, headers);
+    if (reply_if_not_modified(nc, hm, headers)) return;
+
+    // never upscale: a bucket at least as wide as the original gets the original
+    if (bucket >= metadata.res_orig[0]) {
+        err = send_stored(nc, hm, img_id, metadata.SHA, RES_ORIG, headers);
+        if (err != ERR_NONE) mg_error_msg(nc, err);
+        return;
+    }
+
+    char* cached = NULL;
+    size_t cached_size = 0;
+    pthread_mutex_lock(&s_cache_lock);
+    uint64_t start = metrics_now();
+    err = dcache_get(&s_variant_cache, metadata.SHA, bucket, &s_options.variant_encoding, &cached, &cached_size);
+    uint64_t end = metrics_now();
+    metrics_observe(STAGE_DISK_READ, end - start);
+    trace_span("variant_cache", start, end);
+    pthread_mutex_unlock(&s_cache_lock);
+    if (err == ERR_NONE) {
+        reply_image(nc, cached, cached_size, encoder_mime_type(encoder), headers);
+        free(cached);
+        cached = NULL;
+        return;
+    }
+
+    // miss: same pipeline as the stored resolutions, bounded by the width only
+    err = start_resize();
+    if (err != ERR_NONE) {
+        mg_error_msg(nc, err);
+        return;
+    }
+    void* resized = NULL;
+    size_t resized_size = 0;
+    pthread_rwlock_rdlock(&shard->lock);
+    err = lookup_in(shard, &index, img_id);
+    // replaced since the first lookup: its pixels must not be cached under the old SHA
+    if (err == ERR_NONE && memcmp(shard->imgst_file.metadata[index].SHA, metadata.SHA, SHA256_DIGEST_LENGTH)) {
+        err = ERR_FILE_NOT_FOUND;
+    }
+    if (err == ERR_NONE) {
+        start = metrics_now();
+        err = resize_to_buffer(&shard->imgst_file, index, bucket, (int) metadata.res_orig[1],
+                               &s_options.variant_encoding, &resized, &resized_size);
+        end = metrics_now();
+        metrics_observe(STAGE_RESIZE, end - start);
+        trace_span("resize", start, end);
+    }
+    pthread_rwlock_unlock(&shard->lock);
+    end_resize();
+    if (err != ERR_NONE) {
+        mg_error_msg(nc, err);
+        return;
+    }
+    pthread_mutex_lock(&s_cache_lock);
+    err = dcache_put(&s_variant_cache, metadata.SHA, bucket, &s_options.variant_encoding, resized, resized_size);
+    pthread_mutex_unlock(&s_cache_lock);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "variant cache: %s\n", ERR_MESSAGES[err]);
+    }
+    reply_image(nc, resized, resized_size, encoder_mime_type(encoder), headers);
+    g_free(resized);
+    resized = NULL;
+}
+
+/**
+ * @brief Handles a read call
+ *
+ * @param nc struct mg_connection connection that received a list call event
+ */
+static void handle_read_call(struct mg_connection *nc, struct mg_http_message *hm)
+{
+    // initialize name and img_id
+    char res_name[MAX_RES_NAME + 1] = "";
+    char img_id[MAX_IMG_ID + 1] = "";
+    char width[MAX_WIDTH_DIGITS + 1] = "";
+
+    // get arguments
+    int res_l = mg_http_get_var(&hm->query, "res", res_name, sizeof(res_name));
+    int img_id_l = mg_http_get_var(&hm->query, "img_id", img_id, MAX_IMG_ID);
+    int width_l = mg_http_get_var(&hm->query, "w", width, sizeof(width));
+
+    // check validity of arguments
+    if (width_l > 0 && img_id_l > 0) {
+        const uint32_t requested = atouint32(width);
+        if (requested == 0) {
+            mg_error_msg(nc, ERR_RESOLUTIONS);
+        } else {
+            handle_variant_read(nc, hm, img_id, requested);
+        }
+    } else if (res_l > 0 && img_id_l > 0) {
+        // read
+        int resolution_code = resolution_atoi(res_name, RESOLUTIONS);
+        if (resolution_code == -1) {
+            mg_error_msg(nc, ERR_RESOLUTIONS);
+            return;
+        }
+        handle_stored_read(nc, hm, img_id, resolution_code);
+    } else {
+        mg_error_msg(nc, ERR_INVALID_ARGUMENT);
+    }
+}
+
+
+#define MAX_BATCH 128
+// bound on the images of one batch reply: a connection has a single pending
+// sendfile range, so all the other parts are copied into its send buffer
+#define MAX_BATCH_BYTES (16u << 20)
+#define BATCH_BOUNDARY "imgStore-batch-5e81c2b4"
+/**
+ * @brief An image of a batch read
+ */
+struct batch_item {
+    struct mg_str raw_id; // img_id as sent in the query, still URL-encoded
+    char img_id[MAX_IMG_ID + 1];
+    struct handle handle; // its shard is NULL if the image was not found
+    size_t slot;
+    uint64_t offset; // 0 if the image was not found, or not materialized on a read-only server
+    uint32_t size;
+    int encoder;
+};
+
+/**
+ * @brief Orders batch items by shard, then by their position in the shard
+ */
+static int compare_batch_offsets(const void* first, const void* second)
+{
+    const struct batch_item* a = first;
+    const struct batch_item* b = second;
+    // the images not found, left out, have no shard
+    const size_t shard_a = a->handle.shard != NULL ? (size_t) (a->handle.shard - s_shards) : 0;
+    const size_t shard_b = b->handle.shard != NULL ? (size_t) (b->handle.shard - s_shards) : 0;
+    if (shard_a != shard_b) return (shard_a > shard_b) - (shard_a < shard_b);
+    return (a->offset > b->offset) - (a->offset < b->offset);
+}
+
+/**
+ * @brief Collects the img_id parameters of a query (img_id=A&img_id=B...)
+ *
+ * @param query the query
+ * @param items output: at least MAX_BATCH items
+ * @return int number of img_ids, -1 if one is invalid or there are more than MAX_BATCH
+ */
+static int parse_batch_ids(const struct mg_str* query, struct batch_item* items)
+{
+    static const char key[] = "img_id=";
+    int nb_items = 0;
+    const char* p = query->ptr;
+    const char* const end = query->ptr + query->len;
+    while (p < end) {
+        const char* next = memchr(p, '&', (size_t) (end - p));
+        if (next == NULL) next = end;
+        const size_t len = (size_t) (next - p);
+        if (len > sizeof(key) - 1 && !strncmp(p, key, sizeof(key) - 1)) {
+            if (nb_items == MAX_BATCH) return -1;
+            struct batch_item* item = &items[nb_items];
+            item->raw_id = mg_str_n(p + sizeof(key) - 1, len - (sizeof(key) - 1));
+            if (mg_url_decode(item->raw_id.ptr, item->raw_id.len, item->img_id, sizeof(item->img_id), 1) <= 0) {
+                return -1;
+            }
+            ++nb_items;
+        }
+        p = next + 1;
+    }
+    return nb_items;
+}
+
+/**
+ * @brief Handles a batch read call (GET /imgStore/read_batch?res=R&img_id=A&img_id=B...):
+ * replies with all the images as one multipart/mixed body. Parts name their image
+ * in Content-Location and come in store order, shard by shard, so that reading
+ * them is near-sequential. Images that are not found are left out, as are the
+ * resolutions a read-only server has not materialized; any other error, such as
+ * ERR_BUSY over the resize limit, fails the whole batch. Batches of more than
+ * MAX_BATCH_BYTES of images are refused with 413.
+ *
+ * @param nc struct mg_connection connection that received a batch read call
+ * @param hm the request
+ */
+static void handle_read_batch_call(struct mg_connection *nc, struct mg_http_message *hm)
+{
+    char res_name[MAX_RES_NAME + 1] = "";
+    if (mg_http_get_var(&hm->query, "res", res_name, sizeof(res_name)) <= 0) {
+        mg_error_msg(nc, ERR_INVALID_ARGUMENT);
+        return;
+    }
+    const int resolution = resolution_atoi(res_name, RESOLUTIONS);
+    if (resolution == -1) {
+        mg_error_msg(nc, ERR_RESOLUTIONS);
+        return;
+    }
+    struct batch_item* items = calloc(MAX_BATCH, sizeof(struct batch_item));
+    if (items == NULL) {
+        mg_error_msg(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+    const int nb_items = parse_batch_ids(&hm->query, items);
+    if (nb_items <= 0) {
+        free(items);
+        mg_error_msg(nc, ERR_INVALID_ARGUMENT);
+        return;
+    }
+
+    int err = ERR_NONE;
+    for (int i = 0; i < nb_items && err == ERR_NONE; i++) {
+        err = locate_stored(items[i].img_id, NULL, resolution, &items[i].handle, &items[i].slot, &items[i].offset,
+                            &items[i].size, &items[i].encoder);
+        if (err != ERR_NONE) {
+            items[i].handle.shard = NULL;
+            items[i].offset = 0;
+        }
+        // only the images not found are left out, any other error fails the batch
+        if (err == ERR_FILE_NOT_FOUND) err = ERR_NONE;
+    }
+    qsort(items, (size_t) nb_items, sizeof(struct batch_item), compare_batch_offsets);
+
+    // the length of the whole multipart body is needed first
+    static const char part_format[] = "\r\n--" BATCH_BOUNDARY "\r\n"
+                                      "Content-Type: %s\r\n"
+                                      "Content-Location: /imgStore/read?res=%s&img_id=%.*s\r\n"
+                                      "Content-Length: %" PRIu32 "\r\n\r\n";
+    static const char end[] = "\r\n--" BATCH_BOUNDARY "--\r\n";
+    uint64_t length = sizeof(end) - 1;
+    uint64_t image_bytes = 0;
+    for (int i = 0; i < nb_items; i++) {
+        if (items[i].offset == 0) continue;
+        length += (uint64_t) snprintf(NULL, 0, part_format, encoder_mime_type(items[i].encoder), res_name,
+                                      (int) items[i].raw_id.len, items[i].raw_id.ptr, items[i].size)
+                  + items[i].size;
+        image_bytes += items[i].size;
+    }
+    if (err == ERR_NONE && image_bytes > MAX_BATCH_BYTES) err = ERR_BATCH_TOO_LARGE;
+    if (err != ERR_NONE) {
+        mg_error_msg(nc, err);
+    } else {
+        mg_printf(nc,
+                  "HTTP/1.1 200 OK\r\n"
+                  "Cache-Control: no-cache\r\n"
+                  "Content-Length: %" PRIu64 "\r\n"
+                  "Content-Type: multipart/mixed; boundary=" BATCH_BOUNDARY "\r\n\r\n",
+                  length);
+        for (int i = 0; i < nb_items; i++) {
+            if (items[i].offset == 0) continue;
+            mg_printf(nc, part_format, encoder_mime_type(items[i].encoder), res_name,
+                      (int) items[i].raw_id.len, items[i].raw_id.ptr, items[i].size);
+            send_stored_body(nc, &items[i].handle, items[i].slot, resolution, items[i].offset, items[i].size);
+        }
+        mg_send(nc, end, sizeof(end) - 1);
+    }
+    for (int i = 0; i < nb_items; i++) {
+        if (items[i].handle.shard != NULL) release_handle(&items[i].handle);
+    }
+    free(items);
+}
+
+
+static void handle_delete_call(struct mg_connection *nc, struct mg_http_message *hm)
+{
+    if (s_options.read_only) {
+        mg_error_msg(nc, ERR_READ_ONLY);
+        return;
+    }
+    // initialize img_id
+    char img_id[MAX_IMG_ID + 1] = "";
+    // get img_id
+    int img_id_l = mg_http_get_var(&hm->query, "img_id", img_id, MAX_IMG_ID);
+    // check arguments
+    if(img_id_l > 0) {
+        // delete
+        struct shard* shard = NULL;
+        size_t index = 0;
+        int err_delete = lookup(&shard, &index, img_id);
+        if (err_delete == ERR_NONE) {
+            pthread_rwlock_unlock(&shard->lock);
+            pthread_rwlock_wrlock(&shard->lock);
+            err_delete = lookup_in(shard, &index, img_id);
+            if (err_delete == ERR_NONE) err_delete = do_delete(img_id, &shard->imgst_file);
+            pthread_rwlock_unlock(&shard->lock);
+        }
+        if (err_delete == ERR_NONE) {
+            pthread_mutex_lock(&s_memory_lock);
+            mcache_invalidate_slot(&s_memory_cache, cache_slot(shard, index));
+            pthread_mutex_unlock(&s_memory_lock);
+        }
+        if(err_delete != ERR_NONE) {
+            mg_error_msg(nc, err_delete);
+        } else {
+            mg_printf(nc,
+                      "HTTP/1.1 302 Found\r\n"
+                      "Location: %s/index.html\r\n\r\n",
+                      s_listening_address);
+            nc->is_draining = 1;
+        }
+    } else {
+        mg_error_msg(nc, ERR_INVALID_IMGID);
+    }
+}
+
+
+#define MAX_FILENAME 200 // longer names are cut, and then rejected as too long for an img_id
+#define MAX_UPLOADS 16
+#define UPLOAD_TIMEOUT 60 // seconds without a chunk after which an upload can be dropped
+/**
+ * @brief An upload in progress. index.html sends the image in chunks (POST
+ * /imgStore/insert?offset=...&name=..., the chunk as body), then an empty POST
+ * with the total size as offset, which inserts the image. The chunks are
+ * gathered in memory, up to max_upload bytes, and hashed as they arrive.
+ */
+struct upload {
+    char name[MAX_IMG_ID + 1]; // img_id, empty if the slot is free
+    char* data;
+    EVP_MD_CTX* sha; // SHA-256 of the bytes received so far
+    size_t len; // bytes received so far
+    size_t capacity; // allocated size of data
+    time_t last_chunk; // when the last chunk was received
+};
+static struct upload s_uploads[MAX_UPLOADS];
+static pthread_mutex_t s_upload_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * @brief Frees an upload and its slot
+ */
+static void drop_upload(struct upload* upload)
+{
+    free(upload->data);
+    EVP_MD_CTX_free(upload->sha);
+    memset(upload, 0, sizeof(struct upload));
+}
+
+/**
+ * @brief Finds the upload of an image, or a free slot to start it, under the upload lock.
+ * Uploads idle for more than UPLOAD_TIMEOUT seconds are dropped on the way.
+ *
+ * @param name img_id of the upload
+ * @param create whether to return a free slot if there is no upload of name
+ * @return struct upload* the upload, NULL if not found or no slot is free
+ */
+static struct upload* find_upload(const char* name, int create)
+{
+    const time_t now = time(NULL);
+    struct upload* free_slot = NULL;
+    for (size_t i = 0; i < MAX_UPLOADS; i++) {
+        struct upload* upload = &s_uploads[i];
+        if (upload->name[0] != '\0' && !strcmp(upload->name, name)) return upload;
+        if (upload->name[0] != '\0' && now - upload->last_chunk > UPLOAD_TIMEOUT) drop_upload(upload);
+        if (upload->name[0] == '\0' && free_slot == NULL) free_slot = upload;
+    }
+    if (!create || free_slot == NULL) return NULL;
+    strcpy(free_slot->name, name);
+    return free_slot;
+}
+
+/**
+ * @brief Memory held by the uploads in progress. The caller holds s_upload_lock.
+ */
+static size_t uploads_capacity(void)
+{
+    size_t total = 0;
+    for (size_t i = 0; i < MAX_UPLOADS; i++) {
+        total += s_uploads[i].capacity;
+    }
+    return total;
+}
+
+/**
+ * @brief Appends a chunk to an upload. A chunk at offset 0 (re)starts the
+ * upload, the others must follow the bytes already received.
+ *
+ * @param name img_id of the upload
+ * @param offset position of the chunk in the image
+ * @param chunk the chunk
+ * @param len size of the chunk
+ * @return int ERR_BUSY if all the sessions are taken or the uploads would hold
+ * more than max_upload_total, some other error code, 0 if no error.
+ */
+static int upload_chunk(const char* name, size_t offset, const char* chunk, size_t len)
+{
+    int err = ERR_NONE;
+    pthread_mutex_lock(&s_upload_lock);
+    struct upload* upload = find_upload(name, offset == 0);
+    if (upload == NULL) {
+        // all the sessions are taken: one may end soon
+        err = offset == 0 ? ERR_BUSY : ERR_INVALID_ARGUMENT;
+    } else if (offset != upload->len && offset != 0) {
+        drop_upload(upload);
+        err = ERR_INVALID_ARGUMENT;
+    } else if (offset + len > s_options.max_upload) {
+        drop_upload(upload);
+        err = ERR_IMAGE_TOO_LARGE;
+    } else {
+        if (offset + len > upload->capacity) {
+            // grow geometrically, the total size is only known at the end
+            size_t capacity = upload->capacity > 0 ? 2 * upload->capacity : len;
+            if (capacity < offset + len) capacity = offset + len;
+            if (capacity > s_options.max_upload) capacity = s_options.max_upload;
+            if (uploads_capacity() - upload->capacity + capacity > s_options.max_upload_total) {
+                // the session is kept, the client sends the chunk again after Retry-After
+                pthread_mutex_unlock(&s_upload_lock);
+                return ERR_BUSY;
+            }
+            char* data = realloc(upload->data, capacity);
+            if (data == NULL) {
+                drop_upload(upload);
+                pthread_mutex_unlock(&s_upload_lock);
+                return ERR_OUT_OF_MEMORY;
+            }
+            upload->data = data;
+            upload->capacity = capacity;
+        }
+        if (upload->sha == NULL) upload->sha = EVP_MD_CTX_new();
+        if (upload->sha == NULL
+            || (offset == 0 && !EVP_DigestInit_ex(upload->sha, EVP_sha256(), NULL))
+            || !EVP_DigestUpdate(upload->sha, chunk, len)) {
+            drop_upload(upload);
+            pthread_mutex_unlock(&s_upload_lock);
+            return ERR_OUT_OF_MEMORY;
+        }
+        memcpy(upload->data + offset, chunk, len);
+        upload->len = offset + len;
+        upload->last_chunk = time(NULL);
+    }
+    pthread_mutex_unlock(&s_upload_lock);
+    return err;
+}
+
+/**
+ * @brief Ends an upload and hands its bytes and their SHA-256 over
+ *
+ * @param name img_id of the upload
+ * @param size total size announced by the client
+ * @param data output: the image, to be freed by the caller
+ * @param SHA output: SHA-256 of the image
+ * @return int Some error code. 0 if no error.
+ */
+static int take_upload(const char* name, size_t size, char** data, unsigned char SHA[SHA256_DIGEST_LENGTH])
+{
+    int err = ERR_NONE;
+    pthread_mutex_lock(&s_upload_lock);
+    struct upload* upload = find_upload(name, 0);
+    if (upload == NULL || upload->len != size || size == 0) {
+        err = ERR_INVALID_ARGUMENT;
+    } else if (!EVP_DigestFinal_ex(upload->sha, SHA, NULL)) {
+        err = ERR_IO;
+    } else {
+        *data = upload->data;
+        upload->data = NULL;
+    }
+    if (upload != NULL) drop_upload(upload);
+    pthread_mutex_unlock(&s_upload_lock);
+    return err;
+}
+
+/**
+ * @brief Frees the uploads left unfinished
+ */
+static void free_uploads(void)
+{
+    for (size_t i = 0; i < MAX_UPLOADS; i++) {
+        drop_upload(&s_uploads[i]);
+    }
+}
+
+/**
+ * @brief Chooses the shard of a new image: the first of its ranking with room
+ * left, see rank_shards(). The caller holds s_insert_lock.
+ *
+ * @param img_id id of the new image
+ * @param shard output: the shard
+ * @return int ERR_DUPLICATE_ID if a shard already holds the image,
+ * ERR_FULL_IMGSTORE if all are full, 0 if no error.
+ */
+static int insertion_shard(const char* img_id, struct shard** shard)
+{
+    size_t ranking[MAX_SHARDS];
+    rank_shards(img_id, ranking);
+    *shard = NULL;
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        struct shard* candidate = &s_shards[ranking[i]];
+        size_t index = 0;
+        pthread_rwlock_rdlock(&candidate->lock);
+        const int found = lookup_in(candidate, &index, img_id) == ERR_NONE;
+        const int room = candidate->imgst_file.header.num_files < candidate->imgst_file.header.max_files;
+        pthread_rwlock_unlock(&candidate->lock);
+        if (found) return ERR_DUPLICATE_ID;
+        if (room && *shard == NULL) *shard = candidate;
+    }
+    return *shard != NULL ? ERR_NONE : ERR_FULL_IMGSTORE;
+}
+
+static void handle_insert_call(struct mg_connection *nc, struct mg_http_message *hm)
+{
+    if (s_options.read_only) {
+        mg_error_msg(nc, ERR_READ_ONLY);
+        return;
+    }
+    // initialize arguments
+    char offset[MAX_OFFSET + 1] = "", name[MAX_FILENAME] = "";
+
+    // get arguments
+    int offset_l = mg_http_get_var(&hm->query, "offset", offset, MAX_OFFSET);
+    int name_l = mg_http_get_var(&hm->query, "name", name, MAX_FILENAME);
+
+    // check arguments
+    if (offset_l <= 0 || name_l <= 0) {
+        mg_error_msg(nc, ERR_INVALID_ARGUMENT);
+        return;
+    }
+    if (name_l > MAX_IMG_ID) {
+        mg_error_msg(nc, ERR_INVALID_IMGID);
+        return;
+    }
+
+    // if there is still data to insert, add it to the upload
+    if (hm->body.len > 0) {
+        const uint64_t start = trace_clock();
+        const int err = upload_chunk(name, atouint32(offset), hm->body.ptr, hm->body.len);
+        trace_span("upload_chunk", start, trace_clock());
+        if (err != ERR_NONE) {
+            mg_error_msg(nc, err);
+        } else {
+            mg_http_reply(nc, 200, "", "");
+        }
+        return;
+    }
+
+    // else call do_insert
+    const uint32_t image_size = atouint32(offset);
+    char* buffer = NULL;
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint64_t start = trace_clock();
+    int err = take_upload(name, image_size, &buffer, SHA);
+    trace_span("sha", start, trace_clock());
+    if (err == ERR_NONE) {
+        struct shard* shard = NULL;
+        start = trace_clock();
+        pthread_mutex_lock(&s_insert_lock);
+        err = insertion_shard(name, &shard);
+        if (err == ERR_NONE) {
+            pthread_rwlock_wrlock(&shard->lock);
+            // waiting for the locks and routing, the lookups have spans of their own
+            trace_span("shard", start, trace_clock());
+            err = do_insert_hashed(buffer, image_size, SHA, name, &shard->imgst_file);
+            pthread_rwlock_unlock(&shard->lock);
+        }
+        pthread_mutex_unlock(&s_insert_lock);
+        free(buffer);
+    }
+    if (err != ERR_NONE) {
+        mg_error_msg(nc, err);
+    } else {
+        mg_printf(nc,
+                  "HTTP/1.1 302 Found\r\n"
+                  "Location: %s/index.html\r\n\r\n",
+                  s_listening_address);
+        nc->is_draining = 1;
+    }
+}
+
+
+/**
+ * @brief Handles a stats call: replies with the counters of the memory cache
+ *
+ * @param nc struct mg_connection connection that received a stats call event
+ */
+static void handle_stats_call(struct mg_connection *nc, struct mg_http_message *hm _unused)
+{
+    pthread_mutex_lock(&s_memory_lock);
+    const struct mcache_stats stats = s_memory_cache.stats;
+    const size_t entries = s_memory_cache.nb_entries;
+    const uint64_t protected_bytes = s_memory_cache.segments[MCACHE_PROTECTED].bytes;
+    const uint64_t bytes = s_memory_cache.segments[MCACHE_PROBATION].bytes + protected_bytes;
+    pthread_mutex_unlock(&s_memory_lock);
+    mg_http_reply(nc, 200, "Content-Type: application/json\r\nCache-Control: no-store\r\n",
+                  "{\"memory_cache\":{\"max_bytes\":%" PRIu64 ",\"bytes\":%" PRIu64
+                  ",\"protected_bytes\":%" PRIu64 ",\"entries\":%zu,\"hits\":%" PRIu64
+                  ",\"misses\":%" PRIu64 ",\"insertions\":%" PRIu64 ",\"evictions\":%" PRIu64
+                  ",\"invalidations\":%" PRIu64 "}}\n",
+                  s_memory_cache.max_bytes, bytes, protected_bytes, entries, stats.hits,
+                  stats.misses, stats.insertions, stats.evictions, stats.invalidations);
+}
+
+
+static void handle_metrics_call(struct mg_connection *nc, struct mg_http_message *hm);
+
+#define NBR_OF_HANDLERS 7
+static const handler_mapping handler_mappings[NBR_OF_HANDLERS] = {
+    {"/imgStore/list", handle_list_call, "GET"},
+    {"/imgStore/read", handle_read_call, "GET"},
+    {"/imgStore/read_batch", handle_read_batch_call, "GET"},
+    {"/imgStore/delete", handle_delete_call, "GET"},
+    {"/imgStore/insert", handle_insert_call, "POST"},
+    {"/imgStore/stats", handle_stats_call, "GET"},
+    {"/metrics", handle_metrics_call, "GET"}
+};
+_Static_assert(NB_STAGES + NBR_OF_HANDLERS <= METRICS_MAX_HISTOGRAMS, "too many histograms");
+
+/**
+ * @brief Calls a handler, records its duration in the histogram of its entry of
+ * handler_mappings and traces it
+ *
+ * @param cmd the handler
+ * @param nc struct mg_connection connection that received the request
+ * @param hm the request
+ */
+static void call_handler(handler cmd, struct mg_connection *nc, struct mg_http_message *hm)
+{
+    size_t mapping = NBR_OF_HANDLERS;
+    for (size_t i = 0; i < NBR_OF_HANDLERS; i++) {
+        if (handler_mappings[i].cmd == cmd) mapping = i;
+    }
+    trace_begin(mapping < NBR_OF_HANDLERS ? handler_mappings[mapping].uri : "", hm->query.ptr, hm->query.len);
+    const uint64_t start = metrics_now();
+    cmd(nc, hm);
+    if (mapping < NBR_OF_HANDLERS) metrics_observe(NB_STAGES + mapping, metrics_now() - start);
+    trace_end();
+}
+
+/**
+ * @brief Writes a counter or a gauge in the Prometheus text format
+ */
+static void print_metric(FILE* out, const char* name, const char* type, const char* help, uint64_t value)
+{
+    fprintf(out, "# HELP %s %s\n# TYPE %s %s\n%s %" PRIu64 "\n", name, help, name, type, name, value);
+}
+
+#define MAX_LABELS 64
+/**
+ * @brief Handles a metrics call: replies with the counters, latency histograms,
+ * cache statistics and store occupancy in the Prometheus text format
+ *
+ * @param nc struct mg_connection connection that received a metrics call event
+ */
+static void handle_metrics_call(struct mg_connection *nc, struct mg_http_message *hm _unused)
+{
+    char* text = NULL;
+    size_t length = 0;
+    FILE* out = open_memstream(&text, &length);
+    if (out == NULL) {
+        mg_error_msg(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+
+    struct metrics_histogram histogram;
+    char labels[MAX_LABELS] = "";
+    fprintf(out, "# HELP imgstore_request_duration_seconds Time spent in the handler of a request.\n"
+            "# TYPE imgstore_request_duration_seconds histogram\n");
+    for (size_t i = 0; i < NBR_OF_HANDLERS; i++) {
+        snprintf(labels, sizeof(labels), "handler=\"%s\"", strrchr(handler_mappings[i].uri, '/') + 1);
+        metrics_histogram(NB_STAGES + i, &histogram);
+        metrics_print_histogram(out, "imgstore_request_duration_seconds", labels, &histogram);
+    }
+    fprintf(out, "# HELP imgstore_stage_duration_seconds Time spent looking images up, reading them"
+            " from disk and resizing them.\n"
+            "# TYPE imgstore_stage_duration_seconds histogram\n");
+    for (size_t i = 0; i < NB_STAGES; i++) {
+        snprintf(labels, sizeof(labels), "stage=\"%s\"", STAGE_NAMES[i]);
+        metrics_histogram(i, &histogram);
+        metrics_print_histogram(out, "imgstore_stage_duration_seconds", labels, &histogram);
+    }
+
+    print_metric(out, "imgstore_received_bytes_total", "counter", "Bytes received from the clients.",
+                 metrics_counter(COUNTER_BYTES_IN));
+    print_metric(out, "imgstore_sent_bytes_total", "counter", "Bytes sent to the clients.",
+                 metrics_counter(COUNTER_BYTES_OUT));
+    print_metric(out, "imgstore_errors_total", "counter", "Requests answered with an error.",
+                 metrics_counter(COUNTER_ERRORS));
+    print_metric(out, "imgstore_lazy_resizes_total", "counter", "Resolutions materialized in the store on a read.",
+                 metrics_counter(COUNTER_LAZY_RESIZES));
+    print_metric(out, "imgstore_rejected_total", "counter", "Requests refused with 503 over an admission limit.",
+                 metrics_counter(COUNTER_REJECTED));
+    pthread_mutex_lock(&s_resize_lock);
+    const size_t resizes = s_resizes;
+    pthread_mutex_unlock(&s_resize_lock);
+    print_metric(out, "imgstore_resizes_in_progress", "gauge", "Resizes running.", resizes);
+
+    fprintf(out, "# HELP imgstore_images Images in each shard of the store.\n# TYPE imgstore_images gauge\n");
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        pthread_rwlock_rdlock(&s_shards[i].lock);
+        const uint32_t num_files = s_shards[i].imgst_file.header.num_files;
+        pthread_rwlock_unlock(&s_shards[i].lock);
+        fprintf(out, "imgstore_images{shard=\"%zu\"} %" PRIu32 "\n", i, num_files);
+    }
+    fprintf(out, "# HELP imgstore_max_images Capacity of each shard, in images.\n# TYPE imgstore_max_images gauge\n");
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        fprintf(out, "imgstore_max_images{shard=\"%zu\"} %" PRIu32 "\n", i, s_shards[i].imgst_file.header.max_files);
+    }
+    fprintf(out, "# HELP imgstore_version Version of each shard.\n# TYPE imgstore_version gauge\n");
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        pthread_rwlock_rdlock(&s_shards[i].lock);
+        const uint32_t version = s_shards[i].imgst_file.header.imgst_version;
+        pthread_rwlock_unlock(&s_shards[i].lock);
+        fprintf(out, "imgstore_version{shard=\"%zu\"} %" PRIu32 "\n", i, version);
+    }
+
+    pthread_mutex_lock(&s_memory_lock);
+    const struct mcache_stats stats = s_memory_cache.stats;
+    const uint64_t memory_bytes = s_memory_cache.segments[MCACHE_PROBATION].bytes
+                                  + s_memory_cache.segments[MCACHE_PROTECTED].bytes;
+    pthread_mutex_unlock(&s_memory_lock);
+    print_metric(out, "imgstore_memory_cache_bytes", "gauge", "Size of the images in the memory cache.",
+                 memory_bytes);
+    print_metric(out, "imgstore_memory_cache_max_bytes", "gauge", "Bound on the memory cache.",
+                 s_memory_cache.max_bytes);
+    print_metric(out, "imgstore_memory_cache_hits_total", "counter", "Reads served by the memory cache.",
+                 stats.hits);
+    print_metric(out, "imgstore_memory_cache_misses_total", "counter", "Reads the memory cache could not serve.",
+                 stats.misses);
+    print_metric(out, "imgstore_memory_cache_evictions_total", "counter",
+                 "Images dropped from the memory cache to make room.", stats.evictions);
+
+    pthread_mutex_lock(&s_cache_lock);
+    const uint64_t variant_bytes = s_variant_cache.bytes;
+    pthread_mutex_unlock(&s_cache_lock);
+    print_metric(out, "imgstore_variant_cache_bytes", "gauge", "Size of the variants in the on-disk cache.",
+                 variant_bytes);
+
+    if (fclose(out) != 0) {
+        free(text);
+        mg_error_msg(nc, ERR_OUT_OF_MEMORY);
+        return;
+    }
+    mg_printf(nc,
+              "HTTP/1.1 200 OK\r\n"
+              "Content-Type: text/plain; version=0.0.4\r\n"
+              "Cache-Control: no-store\r\n"
+              "Content-Length: %zu\r\n\r\n",
+              length);
+    mg_send(nc, text, length);
+    free(text);
+}
+// ======================================================================
+/**
+ * @brief A request handed to the workers. The handler writes its reply into a
+ * detached connection, whose send buffer the event loop copies to the real
+ * connection once the replies of the earlier requests have been sent.
+ */
+struct job {
+    struct conn_state* state; // state of the connection that received the request
+    unsigned long seq; // position of the request on its connection
+    handler cmd; // NULL for a static file, served by the event loop when its turn comes
+    enum priority priority; // queue of the job
+    char* request; // copy of the request, parsed again by the worker
+    size_t request_len;
+    // only send, range_fd, range_after, range_offset, range_len, is_draining and is_closing are used
+    struct mg_connection reply;
+    struct job* next;
+};
+
+/**
+ * @brief Per-connection state (fn_data of the accepted connections), so that
+ * pipelined requests are answered in order.
+ */
+struct conn_state {
+    struct mg_connection* nc; // NULL once the connection is closed
+    size_t running; // jobs given to the workers and not delivered yet, the state is kept for them
+    unsigned long next_seq; // sequence number of the next request
+    unsigned long next_reply; // sequence number of the next reply to send
+    struct job* parked; // finished jobs waiting for earlier replies, by sequence number
+    int refused; // a refusal closing the connection is queued, later requests are dropped
+};
+
+/**
+ * @brief Worker threads and their queues
+ */
+static struct {
+    pthread_t threads[MAX_THREADS];
+    size_t nb_threads; // threads actually started
+    pthread_mutex_t lock; // protects the queues and stop
+    pthread_cond_t ready; // signaled when a job is queued or can be taken, or on stop
+    struct job* todo_head[NB_PRIORITIES]; // jobs to run, one queue per class, in arrival order
+    struct job* todo_tail[NB_PRIORITIES];
+    unsigned credits[NB_PRIORITIES]; // jobs each class can still take in the current round
+    size_t background; // resizes and writes running
+    struct job* done; // finished jobs, in any order
+    int stop;
+    int wakeup_fd; // datagrams sent to it wake the event loop up
+} s_workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .ready = PTHREAD_COND_INITIALIZER,
+    .wakeup_fd = -1
+};
+
+/**
+ * @brief Frees a job and its reply
+ */
+static void free_job(struct job* job)
+{
+    if (job == NULL) return;
+    if (job->reply.range_len > 0) close(job->reply.range_fd);
+    mg_iobuf_free(&job->reply.send);
+    free(job->request);
+    free(job);
+}
+
+/**
+ * @brief Takes back a job given to the workers: frees the state of its
+ * connection if it is closed and was only kept for this job
+ *
+ * @return struct conn_state* the state, NULL if the connection is closed
+ */
+static struct conn_state* return_job(struct job* job)
+{
+    struct conn_state* state = job->state;
+    --state->running;
+    if (state->nc != NULL) return state;
+    if (state->running == 0) free(state);
+    return NULL;
+}
+
+/**
+ * @brief Copies a request into a new job
+ *
+ * @return struct job* the job, NULL if out of memory
+ */
+static struct job* new_job(struct mg_connection *nc, struct mg_http_message *hm, handler cmd, unsigned long seq)
+{
+    struct job* job = calloc(1, sizeof(struct job));
+    if (job == NULL) return NULL;
+    job->request = malloc(hm->message.len);
+    if (job->request == NULL) {
+        free(job);
+        return NULL;
+    }
+    memcpy(job->request, hm->message.ptr, hm->message.len);
+    job->request_len = hm->message.len;
+    job->state = nc->fn_data;
+    job->seq = seq;
+    job->cmd = cmd;
+    return job;
+}
+
+/**
+ * @brief Picks the queue of the next job, by weighted round robin: in a round,
+ * each class takes up to its weight of jobs, reads first, then resizes, then
+ * writes, so that a queued job waits for at most the weights of the other
+ * classes. Resizes and writes never take the last worker, which stays for the
+ * reads. The caller holds the lock.
+ *
+ * @return int the class, -1 if no job can be taken
+ */
+static int next_priority(void)
+{
+    for (int round = 0; round < 2; round++) {
+        for (int priority = 0; priority < NB_PRIORITIES; priority++) {
+            if (s_workers.todo_head[priority] != NULL && s_workers.credits[priority] > 0
+                && (priority == PRIO_READ || s_workers.nb_threads == 1
+                    || s_workers.background + 1 < s_workers.nb_threads)) {
+                return priority;
+            }
+        }
+        // the round is over
+        memcpy(s_workers.credits, s_options.weights, sizeof(s_workers.credits));
+    }
+    return -1;
+}
+
+/**
+ * @brief Waits for the next job to run
+ *
+ * @return struct job* the job, NULL when the workers are stopped
+ */
+static struct job* next_job(void)
+{
+    pthread_mutex_lock(&s_workers.lock);
+    int priority = -1;
+    while (!s_workers.stop && (priority = next_priority()) == -1) {
+        pthread_cond_wait(&s_workers.ready, &s_workers.lock);
+    }
+    struct job* job = NULL;
+    if (!s_workers.stop) {
+        job = s_workers.todo_head[priority];
+        s_workers.todo_head[priority] = job->next;
+        if (s_workers.todo_head[priority] == NULL) s_workers.todo_tail[priority] = NULL;
+        job->next = NULL;
+        --s_workers.credits[priority];
+        if (priority != PRIO_READ) ++s_workers.background;
+    }
+    pthread_mutex_unlock(&s_workers.lock);
+    return job;
+}
+
+/**
+ * @brief Hands a finished job back to the event loop and wakes it up
+ */
+static void finish_job(struct job* job)
+{
+    pthread_mutex_lock(&s_workers.lock);
+    if (job->priority != PRIO_READ) {
+        // a resize or write waiting for a worker may take this one
+        --s_workers.background;
+        pthread_cond_signal(&s_workers.ready);
+    }
+    job->next = s_workers.done;
+    s_workers.done = job;
+    pthread_mutex_unlock(&s_workers.lock);
+    const char byte = 0;
+    if (send(s_workers.wakeup_fd, &byte, 1, 0) != 1) {
+        // the event loop still picks the job up at its next poll
+        perror("wakeup");
+    }
+}
+
+/**
+ * @brief Body of the worker threads
+ */
+static void* worker_main(void* arg _unused)
+{
+    metrics_join_thread();
+    struct job* job = NULL;
+    while ((job = next_job()) != NULL) {
+        struct mg_http_message hm;
+        mg_http_parse(job->request, job->request_len, &hm);
+        call_handler(job->cmd, &job->reply, &hm);
+        finish_job(job);
+    }
+    // frees the per-thread buffers of vips
+    vips_thread_shutdown();
+    return NULL;
+}
 
-/********************************************************************//**
-* A handler is a function that we use to handle an http call
-*********************************************************************** */
-typedef void(*handler)(struct mg_connection *nc, struct mg_http_message *hm);
+/**
+ * @brief Queues a job for the workers
+ */
+static void dispatch_job(struct job* job)
+{
+    pthread_mutex_lock(&s_workers.lock);
+    if (s_workers.todo_tail[job->priority] != NULL) s_workers.todo_tail[job->priority]->next = job;
+    else s_workers.todo_head[job->priority] = job;
+    s_workers.todo_tail[job->priority] = job;
+    pthread_cond_signal(&s_workers.ready);
+    pthread_mutex_unlock(&s_workers.lock);
+}
 
-/********************************************************************//**
- * A handler_mapping is used to map a handler to its name as it will
- * be called in the uri.
- ********************************************************************** */
-typedef struct {
-    const char* uri;
-    const handler cmd;
-    const char* type;
-} handler_mapping;
+/**
+ * @brief Parks a finished job on its connection, keeping sequence order
+ */
+static void park_job(struct conn_state* state, struct job* job)
+{
+    struct job** link = &state->parked;
+    while (*link != NULL && (*link)->seq < job->seq) {
+        link = &(*link)->next;
+    }
+    job->next = *link;
+    *link = job;
+}
+
+/**
+ * @brief Sends the parked replies of a connection that are next in order
+ */
+static void flush_replies(struct mg_connection *nc)
+{
+    struct conn_state* state = nc->fn_data;
+    while (state->parked != NULL && state->parked->seq == state->next_reply) {
+        struct job* job = state->parked;
+        state->parked = job->next;
+        if (job->cmd == NULL) {
+            struct mg_http_message hm;
+            struct mg_http_serve_opts opts = {.root_dir = s_root_dir};
+            mg_http_parse(job->request, job->request_len, &hm);
+            mg_http_serve_dir(nc, &hm, &opts);
+        } else if (job->reply.range_len > 0) {
+            // the file range goes between the bytes queued before and after it
+            const struct mg_connection* reply = &job->reply;
+            mg_send(nc, reply->send.buf, reply->range_after);
+            if (!mg_send_file_range(nc, reply->range_fd, reply->range_offset, reply->range_len)) {
+                nc->is_closing = 1;
+            }
+            mg_send(nc, reply->send.buf + reply->range_after, reply->send.len - reply->range_after);
+        } else {
+            mg_send(nc, job->reply.send.buf, job->reply.send.len);
+        }
+        if (job->cmd != NULL) {
+            if (job->reply.is_draining) nc->is_draining = 1;
+            if (job->reply.is_closing) nc->is_closing = 1;
+        }
+        ++state->next_reply;
+        free_job(job);
+    }
+}
+
+/**
+ * @brief Moves the jobs finished by the workers to their connections.
+ * Called by the event loop after each poll.
+ */
+static void deliver_replies(void)
+{
+    pthread_mutex_lock(&s_workers.lock);
+    struct job* job = s_workers.done;
+    s_workers.done = NULL;
+    pthread_mutex_unlock(&s_workers.lock);
+
+    while (job != NULL) {
+        struct job* next = job->next;
+        struct conn_state* state = return_job(job);
+        if (state == NULL) {
+            // closed in the meantime
+            free_job(job);
+        } else {
+            park_job(state, job);
+            flush_replies(state->nc);
+        }
+        job = next;
+    }
+}
+
+/**
+ * @brief Discards the datagrams waking the event loop up
+ */
+static void wakeup_handler(struct mg_connection *nc, int ev, void *ev_data _unused, void *fn_data _unused)
+{
+    if (ev == MG_EV_READ) nc->recv.len = 0;
+}
 
 /**
- * @brief Error message routine
+ * @brief Starts the worker threads and the wakeup channel of the event loop
  *
- * @param nc struct mg_correction
- * @param error to print
+ * @param mgr the event manager
+ * @param nb_threads number of workers
+ * @return int Some error code. 0 if no error.
  */
-static void mg_error_msg(struct mg_connection* nc, int error)
+static int start_workers(struct mg_mgr *mgr, size_t nb_threads)
 {
-    mg_http_reply(nc, 500, "",
-                  "Error: %s", ERR_MESSAGES[error]);
+    // a UDP listener on an ephemeral port, that the workers send to
+    struct mg_connection *wakeup = mg_listen(mgr, "udp://127.0.0.1:0", wakeup_handler, NULL);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(wakeup, ERR_IO);
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    M_IO_CHECK(getsockname((int) (long) wakeup->fd, (struct sockaddr*) &address, &length), 0);
+    s_workers.wakeup_fd = socket(AF_INET, SOCK_DGRAM, 0);
+    M_REQUIRE(s_workers.wakeup_fd >= 0, ERR_IO, ERR_MESSAGES[ERR_IO], NULL);
+    M_IO_CHECK(connect(s_workers.wakeup_fd, (struct sockaddr*) &address, length), 0);
+
+    for (size_t i = 0; i < nb_threads; i++) {
+        M_REQUIRE(pthread_create(&s_workers.threads[i], NULL, worker_main, NULL) == 0,
+                  ERR_OUT_OF_MEMORY, "cannot start worker %zu", i);
+        s_workers.nb_threads = i + 1;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Stops and joins the worker threads, dropping the pending jobs
+ */
+static void stop_workers(void)
+{
+    pthread_mutex_lock(&s_workers.lock);
+    s_workers.stop = 1;
+    pthread_cond_broadcast(&s_workers.ready);
+    pthread_mutex_unlock(&s_workers.lock);
+    for (size_t i = 0; i < s_workers.nb_threads; i++) {
+        pthread_join(s_workers.threads[i], NULL);
+    }
+    s_workers.nb_threads = 0;
+    struct job* lists[] = {s_workers.todo_head[PRIO_READ], s_workers.todo_head[PRIO_RESIZE],
+                           s_workers.todo_head[PRIO_WRITE], s_workers.done
+                          };
+    for (size_t i = 0; i < sizeof(lists) / sizeof(lists[0]); i++) {
+        while (lists[i] != NULL) {
+            struct job* next = lists[i]->next;
+            return_job(lists[i]);
+            free_job(lists[i]);
+            lists[i] = next;
+        }
+    }
+    memset(s_workers.todo_head, 0, sizeof(s_workers.todo_head));
+    memset(s_workers.todo_tail, 0, sizeof(s_workers.todo_tail));
+    s_workers.done = NULL;
+    if (s_workers.wakeup_fd >= 0) close(s_workers.wakeup_fd);
+    s_workers.wakeup_fd = -1;
+}
+
+#define MAX_PENDING_REPLIES 64 // requests of a connection in the workers above which its requests are refused
+/**
+ * @brief Tells whether a connection holds too much to take another request:
+ * too many requests still in the workers, or too many bytes not sent yet
+ * because the client reads slowly
+ */
+static int conn_overloaded(const struct mg_connection *nc)
+{
+    const struct conn_state* state = nc->fn_data;
+    if (state != NULL && state->next_seq - state->next_reply >= MAX_PENDING_REPLIES) return 1;
+    return nc->send.len > s_options.max_conn_buffer;
+}
+
+/**
+ * @brief Tells whether the requests of a connection are dropped because it is closing
+ */
+static int conn_refused(const struct mg_connection *nc)
+{
+    const struct conn_state* state = nc->fn_data;
+    return state != NULL ? state->refused : nc->is_draining;
 }
 
 /**
- * @brief Handles a list call
+ * @brief Refuses a request of an overloaded connection, which is closed once
+ * the replies already queued are sent
  *
- * @param nc struct mg_connection connection that received a list call event
+ * @param nc struct mg_connection connection that received the request
+ */
+static void handle_overloaded(struct mg_connection *nc, struct mg_http_message *hm _unused)
+{
+    mg_error_msg(nc, ERR_BUSY);
+    nc->is_draining = 1;
+}
+
+/**
+ * @brief Looks an image up without waiting for a lock
+ *
+ * @param img_id the image
+ * @param resolution resolution whose offset is wanted
+ * @param SHA output: the SHA of the image
+ * @param original_width output: its original width
+ * @param offset output: the offset of the resolution, 0 if it is not materialized
+ * @return int 1 if found, 0 if not, -1 if a shard is busy
  */
-static void handle_list_call(struct mg_connection *nc, struct mg_http_message *hm _unused)
+static int peek_image(const char* img_id, int resolution, unsigned char SHA[SHA256_DIGEST_LENGTH],
+                      uint32_t* original_width, uint64_t* offset)
 {
-    char* imgstore_json = do_list(&imgst_file, JSON);
-    mg_http_reply(nc, 200,
-                  "Content-Type: application/json\r\n", imgstore_json, NULL);
-    free(imgstore_json);
+    size_t ranking[MAX_SHARDS];
+    rank_shards(img_id, ranking);
+    int found = 0;
+    for (size_t i = 0; i < s_nb_shards && !found; i++) {
+        const struct imgst_file* imgst_file = &s_shards[ranking[i]].imgst_file;
+        if (pthread_rwlock_tryrdlock(&s_shards[ranking[i]].lock) != 0) return -1;
+        size_t index = 0;
+        found = find_img_id(&index, imgst_file, img_id) == ERR_NONE;
+        if (found) {
+            memcpy(SHA, imgst_file->metadata[index].SHA, SHA256_DIGEST_LENGTH);
+            *original_width = imgst_file->metadata[index].res_orig[0];
+            *offset = imgst_file->metadata[index].offset[resolution];
+        }
+        pthread_rwlock_unlock(&s_shards[ranking[i]].lock);
+    }
+    return found;
 }
 
+/**
+ * @brief Tells the class of a batch read: a resize if one of its images has
+ * the resolution not materialized
+ */
+static enum priority classify_batch(struct mg_http_message *hm)
+{
+    char res_name[MAX_RES_NAME + 1] = "";
+    if (mg_http_get_var(&hm->query, "res", res_name, sizeof(res_name)) <= 0) return PRIO_READ;
+    const int resolution = resolution_atoi(res_name, RESOLUTIONS);
+    if (resolution == -1 || resolution == RES_ORIG) return PRIO_READ;
+    struct batch_item* items = calloc(MAX_BATCH, sizeof(struct batch_item));
+    if (items == NULL) return PRIO_READ;
+
+    enum priority priority = PRIO_READ;
+    const int nb_items = parse_batch_ids(&hm->query, items);
+    for (int i = 0; i < nb_items && priority == PRIO_READ; i++) {
+        unsigned char SHA[SHA256_DIGEST_LENGTH];
+        uint32_t original_width = 0;
+        uint64_t offset = 0;
+        const int found = peek_image(items[i].img_id, resolution, SHA, &original_width, &offset);
+        if (found == -1) break;
+        if (found && offset == 0) priority = PRIO_RESIZE;
+    }
+    free(items);
+    return priority;
+}
 
-#define MAX_RES_NAME 6 // double check
 /**
- * @brief Handles a read call
+ * @brief Tells the class of a store request from the work it needs: a read of
+ * a resolution that is not materialized, or of a variant that is not cached,
+ * is a resize, as is a batch read with one such resolution. Runs in the event
+ * loop, so it never waits for a lock: when the store or the variant cache is
+ * busy, a read is taken as cheap.
  *
- * @param nc struct mg_connection connection that received a list call event
+ * @param cmd handler of the request
+ * @param hm the request
+ * @return enum priority the class
  */
-static void handle_read_call(struct mg_connection *nc, struct mg_http_message *hm)
+static enum priority classify_job(handler cmd, struct mg_http_message *hm)
 {
-    // initialize name and img_id
+    if (cmd == handle_insert_call || cmd == handle_delete_call) return PRIO_WRITE;
+    if (cmd == handle_read_batch_call) return classify_batch(hm);
+    if (cmd != handle_read_call) return PRIO_READ;
+
     char res_name[MAX_RES_NAME + 1] = "";
     char img_id[MAX_IMG_ID + 1] = "";
+    char width[MAX_WIDTH_DIGITS + 1] = "";
+    if (mg_http_get_var(&hm->query, "img_id", img_id, sizeof(img_id)) <= 0) return PRIO_READ;
+    const uint32_t requested = mg_http_get_var(&hm->query, "w", width, sizeof(width)) > 0 ? atouint32(width) : 0;
+    int resolution = RES_ORIG;
+    if (requested == 0) {
+        if (mg_http_get_var(&hm->query, "res", res_name, sizeof(res_name)) <= 0) return PRIO_READ;
+        resolution = resolution_atoi(res_name, RESOLUTIONS);
+        if (resolution == -1) return PRIO_READ;
+    }
 
-    // get arguments
-    int res_l = mg_http_get_var(&hm->query, "res", res_name, MAX_RES_NAME);
-    int img_id_l = mg_http_get_var(&hm->query, "img_id", img_id, MAX_IMG_ID);
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    uint32_t original_width = 0;
+    uint64_t offset = 0;
+    if (peek_image(img_id, resolution, SHA, &original_width, &offset) != 1) return PRIO_READ;
+    if (requested == 0) return offset == 0 ? PRIO_RESIZE : PRIO_READ;
 
-    // check validity of arguments
-    if (res_l > 0 && img_id_l > 0) {
-        // read
-        int resolution_code = resolution_atoi(res_name);
-        if (resolution_code == -1) {
-            mg_error_msg(nc, ERR_RESOLUTIONS);
-        }
-        char* image_buffer = NULL;
-        uint32_t image_size = 0;
-        int err_read = do_read(img_id, resolution_code, &image_buffer, &image_size, &imgst_file);
-        if (err_read != ERR_NONE) {
-            mg_error_msg(nc, err_read);
-        } else {
-            mg_printf(
-            nc,
-            "HTTP/1.1 200 OK\r\n"
-            "Content-Length: %d\r\n"
-            "Content-Type: image/jpeg\r\n\r\n",
-            image_size
-            );
-            mg_send(nc, image_buffer, image_size);
-            free(image_buffer);
-            image_buffer = NULL;
+    const uint16_t bucket = snap_to_bucket(requested);
+    if (bucket >= original_width) return PRIO_READ;
+    if (pthread_mutex_trylock(&s_cache_lock) != 0) return PRIO_READ;
+    const int cached = dcache_contains(&s_variant_cache, SHA, bucket, &s_options.variant_encoding);
+    pthread_mutex_unlock(&s_cache_lock);
+    return cached ? PRIO_READ : PRIO_RESIZE;
+}
+
+/**
+ * @brief Handles an HTTP request with worker threads: store requests are
+ * queued, static files are served at once unless earlier replies are pending.
+ */
+static void handle_threaded(struct mg_connection *nc, struct mg_http_message *hm, handler cmd)
+{
+    struct conn_state* state = nc->fn_data;
+    if (cmd == handle_overloaded) {
+        // refused at once, the workers are not involved
+        struct job* job = new_job(nc, hm, cmd, state->next_seq);
+        if (job == NULL) {
+            nc->is_closing = 1;
+            return;
         }
+        ++state->next_seq;
+        state->refused = 1;
+        cmd(&job->reply, hm);
+        park_job(state, job);
+        flush_replies(nc);
+        return;
+    }
+    if (cmd == NULL && state->next_reply == state->next_seq) {
+        struct mg_http_serve_opts opts = {.root_dir = s_root_dir};
+        mg_http_serve_dir(nc, hm, &opts);
+        ++state->next_seq;
+        ++state->next_reply;
+        return;
+    }
+    struct job* job = new_job(nc, hm, cmd, state->next_seq);
+    if (job == NULL) {
+        mg_error_msg(nc, ERR_OUT_OF_MEMORY);
+        nc->is_draining = 1;
+        return;
+    }
+    ++state->next_seq;
+    if (cmd == NULL) {
+        park_job(state, job);
     } else {
-        mg_error_msg(nc, ERR_INVALID_ARGUMENT);
+        job->priority = classify_job(cmd, hm);
+        ++state->running;
+        dispatch_job(job);
     }
 }
 
+/**
+ * @brief Frees the parked jobs of a closed connection, and its state unless
+ * jobs of the workers still refer to it
+ */
+static void free_conn_state(struct conn_state* state)
+{
+    if (state == NULL) return;
+    while (state->parked != NULL) {
+        struct job* next = state->parked->next;
+        free_job(state->parked);
+        state->parked = next;
+    }
+    state->nc = NULL;
+    if (state->running == 0) free(state);
+}
 
-static void handle_delete_call(struct mg_connection *nc, struct mg_http_message *hm)
+/**
+ * @brief Picks up the changes of the writer of a shard: when the version on
+ * disk differs, reads the metadata again and drops the cached images of the
+ * slots that changed.
+ */
+static void refresh_shard(struct shard* shard)
 {
-    // initialize img_id
-    char img_id[MAX_IMG_ID + 1] = "";
-    // get img_id
-    int img_id_l = mg_http_get_var(&hm->query, "img_id", img_id, MAX_IMG_ID);
-    // check arguments
-    if(img_id_l > 0) {
-        // delete
-        int err_delete = do_delete(img_id, &imgst_file);
-        if(err_delete != ERR_NONE) {
-            mg_error_msg(nc, err_delete);
-        } else {
-            mg_printf(nc,
-                      "HTTP/1.1 302 Found\r\n"
-                      "Location: %s/index.html\r\n\r\n",
-                      s_listening_address);
-            nc->is_draining = 1;
+    struct imgst_file* imgst_file = &shard->imgst_file;
+    uint32_t version = 0;
+    if (read_disk_version(imgst_file, &version) != ERR_NONE || version == imgst_file->header.imgst_version) {
+        return;
+    }
+    struct img_metadata* previous = NULL;
+    pthread_rwlock_wrlock(&shard->lock);
+    const int err = do_refresh(imgst_file, &previous);
+    pthread_rwlock_unlock(&shard->lock);
+    if (err != ERR_NONE) {
+        fprintf(stderr, "refresh: %s\n", ERR_MESSAGES[err]);
+        return;
+    }
+    if (previous == NULL) return; // a write was in progress, retried at the next check
+
+    pthread_mutex_lock(&s_memory_lock);
+    for (uint32_t i = 0; i < imgst_file->header.max_files; i++) {
+        if (memcmp(&previous[i], &imgst_file->metadata[i], sizeof(struct img_metadata))) {
+            mcache_invalidate_slot(&s_memory_cache, cache_slot(shard, i));
         }
-    } else {
-        mg_error_msg(nc, ERR_INVALID_IMGID);
     }
+    pthread_mutex_unlock(&s_memory_lock);
+    free(previous);
 }
 
+#define REFRESH_INTERVAL 100 // milliseconds between two checks of the version of a read-only store
+/**
+ * @brief On a read-only server, picks up the changes of the writers of the
+ * shards. Called by the event loop, the only thread that modifies the metadata
+ * of a read-only server, before handling a request; the versions are checked
+ * at most every REFRESH_INTERVAL.
+ */
+static void refresh_store(void)
+{
+    static unsigned long last_check = 0;
+    if (!s_options.read_only) return;
+    const unsigned long now = mg_millis();
+    if (now - last_check < REFRESH_INTERVAL) return;
+    last_check = now;
 
-#define MAX_OFFSET 20 // 2^64
-#define MAX_FILENAME 200 // maximal length retained in mg_http_upload (needed to have the same file name)
-#define DIRECTORY "/tmp"
-#define DIRECTORY_SIZE 4
-static void handle_insert_call(struct mg_connection *nc, struct mg_http_message *hm)
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        refresh_shard(&s_shards[i]);
+    }
+}
+
+/**
+ * @brief An image of a reloaded file, to find it by img_id
+ */
+struct reloaded_image {
+    const char* img_id;
+    size_t index;
+};
+
+/**
+ * @brief Orders reloaded images by img_id
+ */
+static int compare_reloaded_images(const void* first, const void* second)
 {
-    // if there is still data to insert, upload
-    if (hm->body.len > 0) {
-        mg_http_upload(nc, hm, DIRECTORY);
-        // else call do_insert
+    return strcmp(((const struct reloaded_image*) first)->img_id, ((const struct reloaded_image*) second)->img_id);
+}
+
+/**
+ * @brief What rekey_cached() needs to move the cached images of a reloaded shard
+ */
+struct reload {
+    const struct shard* shard; // the shard, already on its new file
+    const struct img_metadata* previous; // metadata of the file it replaced
+    const struct reloaded_image* images; // the images of the new file, by img_id
+    size_t nb_images;
+};
+
+/**
+ * @brief Moves a cached image of a reloaded shard to its slot and offset in the
+ * new file, see mcache_rekey(). The images of the other shards are kept as they
+ * are; the images that are gone or whose content changed are dropped.
+ */
+static int rekey_cached(void* arg, uint32_t* slot, int resolution, uint64_t* offset)
+{
+    const struct reload* reload = arg;
+    const uint32_t first = cache_slot(reload->shard, 0);
+    if (*slot < first || *slot - first >= MAX_MAX_FILES) return 1;
+
+    const struct img_metadata* previous = &reload->previous[*slot - first];
+    const struct reloaded_image key = {previous->img_id, 0};
+    const struct reloaded_image* image = bsearch(&key, reload->images, reload->nb_images,
+                                         sizeof(struct reloaded_image), compare_reloaded_images);
+    if (image == NULL) return 0;
+    const struct img_metadata* metadata = &reload->shard->imgst_file.metadata[image->index];
+    // an image resized in memory (offset 0) is kept until the file holds it
+    if (memcmp(previous->SHA, metadata->SHA, SHA256_DIGEST_LENGTH)
+        || (*offset == 0) != (metadata->offset[resolution] == 0)) {
+        return 0;
+    }
+    *slot = cache_slot(reload->shard, image->index);
+    *offset = metadata->offset[resolution];
+    return 1;
+}
+
+/**
+ * @brief Opens the file of a shard again, e.g. after imgStoreMgr gc replaced
+ * it, and swaps it in. The requests in flight finish on the old file, which is
+ * closed with its last handle; the cached images that are still in the new file
+ * are moved to their new slots, and the variants, cached by SHA, stay valid.
+ *
+ * @param shard the shard
+ * @return int ERR_BUSY if the file of the previous reload is still in use, some
+ * other error code, 0 if no error.
+ */
+static int reload_shard(struct shard* shard)
+{
+    pthread_mutex_lock(&s_retire_lock);
+    const int draining = shard->retired != NULL;
+    pthread_mutex_unlock(&s_retire_lock);
+    if (draining) return ERR_BUSY;
+
+    struct imgst_file fresh;
+    M_EXIT_IF_ERR(do_open(shard->filename, s_options.read_only ? "rb" : "rb+", &fresh));
+    // the slots of the cache keys are bounded by max_files
+    if (!same_resolutions(&fresh.header) || fresh.header.max_files != shard->imgst_file.header.max_files) {
+        do_close(&fresh);
+        return ERR_RESOLUTIONS;
+    }
+    struct reloaded_image* images = calloc(fresh.header.num_files + 1, sizeof(struct reloaded_image));
+    if (images == NULL) {
+        do_close(&fresh);
+        return ERR_OUT_OF_MEMORY;
+    }
+    size_t nb_images = 0;
+    for (size_t i = 0; i < fresh.header.max_files && nb_images < fresh.header.num_files; i++) {
+        if (fresh.metadata[i].is_valid == NON_EMPTY) {
+            images[nb_images].img_id = fresh.metadata[i].img_id;
+            images[nb_images++].index = i;
+        }
+    }
+    qsort(images, nb_images, sizeof(struct reloaded_image), compare_reloaded_images);
+
+    // the readers holding the lock finish first, those that released it hold handles
+    pthread_rwlock_wrlock(&shard->lock);
+    pthread_mutex_lock(&s_memory_lock);
+    const struct imgst_file previous = shard->imgst_file;
+    memcpy(&shard->imgst_file, &fresh, sizeof(struct imgst_file));
+    struct reload reload = {shard, previous.metadata, images, nb_images};
+    mcache_rekey(&s_memory_cache, rekey_cached, &reload);
+    pthread_mutex_lock(&s_retire_lock);
+    if (shard->handles[shard->generation % 2] == 0) {
+        fclose(previous.file);
     } else {
-        // initialize arguments
-        char offset[MAX_OFFSET + 1] = "", name[MAX_FILENAME] = "", path[MAX_FILENAME + DIRECTORY_SIZE + 1] = "";
-
-        // get arguments
-        int offset_l = mg_http_get_var(&hm->query, "offset", offset, MAX_OFFSET);
-        int name_l = mg_http_get_var(&hm->query, "name", name, MAX_FILENAME);
-
-        // check arguments
-        if (offset_l > 0 && name_l > 0) {
-            // insert
-            uint32_t image_size = atouint32(offset);
-            void* buffer = malloc(image_size);
-            snprintf(path, sizeof(path), "%s/%s", DIRECTORY, name);
-            if(name_l > MAX_IMG_ID) {
-                mg_error_msg(nc, ERR_INVALID_IMGID);
-                if (remove(path) != 0) mg_error_msg(nc, ERR_IO);
-            } else {
-                if (buffer == NULL) {
-                    mg_error_msg(nc, ERR_OUT_OF_MEMORY);
-                    if (remove(path) != 0) mg_error_msg(nc, ERR_IO);
-                } else {
-                    FILE* image_file = fopen(path, "rb+");
-                    if(image_file == NULL) {
-                        free(buffer);
-                        buffer = NULL;
-                        if (remove(path) != 0) mg_error_msg(nc, ERR_IO);
-                        mg_error_msg(nc, ERR_IO);
-                    } else {
-                        if(fread(buffer, image_size, 1, image_file) != 1) {
-                            free(buffer);
-                            buffer = NULL;
-                            fclose(image_file);
-                            mg_error_msg(nc, ERR_IO);
-                            if (remove(path) != 0) mg_error_msg(nc, ERR_IO);
-                        } else {
-                            fclose(image_file);
-                            image_file = NULL;
-                            if (remove(path) != 0) mg_error_msg(nc, ERR_IO);
-                            int err = do_insert(buffer, image_size, name, &imgst_file);
-                            free(buffer);
-                            buffer = NULL;
-                            if (err != ERR_NONE) {
-                                mg_error_msg(nc, err);
-                            } else {
-                                mg_printf(nc,
-                                          "HTTP/1.1 302 Found\r\n"
-                                          "Location: %s/index.html\r\n\r\n",
-                                          s_listening_address);
-                                nc->is_draining = 1;
-                            }
-                        }
-                    }
-                }
-            }
+        shard->retired = previous.file;
+    }
+    ++shard->generation;
+    pthread_mutex_unlock(&s_retire_lock);
+    pthread_mutex_unlock(&s_memory_lock);
+    pthread_rwlock_unlock(&shard->lock);
+
+    free(previous.metadata);
+    free(images);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Reloads the files of all the shards, on SIGHUP. Runs in the event loop.
+ */
+static void reload_shards(void)
+{
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        const int err = reload_shard(&s_shards[i]);
+        if (err != ERR_NONE) {
+            fprintf(stderr, "reload of %s: %s\n", s_shards[i].filename, ERR_MESSAGES[err]);
         } else {
-            mg_error_msg(nc, ERR_INVALID_ARGUMENT);
+            printf("Reloaded %s: %" PRIu32 " images\n", s_shards[i].filename, s_shards[i].imgst_file.header.num_files);
         }
     }
 }
 
-
-
-#define NBR_OF_HANDLERS 4
-static const handler_mapping handler_mappings[NBR_OF_HANDLERS] = {
-    {"/imgStore/list", handle_list_call, "GET"},
-    {"/imgStore/read", handle_read_call, "GET"},
-    {"/imgStore/delete", handle_delete_call, "GET"},
-    {"/imgStore/insert", handle_insert_call, "POST"}
-};
-// ======================================================================
 /**
  * @brief Handles server events (eg HTTP requests) and deals with the different urls.
  *
@@ -245,21 +2663,243 @@ static void imgst_event_handler(struct mg_connection *nc,
                                )
 {
     struct mg_http_message *hm = (struct mg_http_message *) ev_data;
-    int matched = 0;
+    handler cmd = NULL;
     switch (ev) {
+    case MG_EV_ACCEPT:
+        if (s_workers.nb_threads > 0) {
+            struct conn_state* state = calloc(1, sizeof(struct conn_state));
+            if (state == NULL) nc->is_closing = 1;
+            else state->nc = nc;
+            nc->fn_data = state;
+        }
+        break;
+    case MG_EV_READ:
+        metrics_count(COUNTER_BYTES_IN, ((struct mg_str*) ev_data)->len);
+        break;
+    case MG_EV_WRITE:
+        metrics_count(COUNTER_BYTES_OUT, (uint64_t) *(int*) ev_data);
+        break;
+    case MG_EV_CLOSE:
+        free_conn_state(fn_data);
+        nc->fn_data = NULL;
+        break;
     case MG_EV_HTTP_MSG:
-        for(int i = 0; i < NBR_OF_HANDLERS && !matched; i++) {
+        refresh_store();
+        if (conn_refused(nc)) break;
+        if (conn_overloaded(nc)) cmd = handle_overloaded;
+        for(int i = 0; i < NBR_OF_HANDLERS && cmd == NULL; i++) {
             if (mg_http_match_uri(hm, handler_mappings[i].uri) && !mg_vcmp(&hm->method, handler_mappings[i].type)) {
-                handler_mappings[i].cmd(nc, hm);
-                ++matched;
+                cmd = handler_mappings[i].cmd;
             }
         }
-        if(!matched) {
+        if (fn_data != NULL) {
+            handle_threaded(nc, hm, cmd);
+        } else if (cmd != NULL) {
+            call_handler(cmd, nc, hm);
+        } else {
             struct mg_http_serve_opts opts = {.root_dir = s_root_dir};
             mg_http_serve_dir(nc, ev_data, &opts);
         }
+        break;
+    }
+}
+
+/**
+ * @brief Parses a comma separated list of widths into s_options.buckets
+ *
+ * @param list the list, e.g. "160,320,640"
+ * @return int Some error code. 0 if no error.
+ */
+static int parse_buckets(const char* list)
+{
+    size_t nb = 0;
+    uint32_t previous = 0;
+    const char* start = list;
+    while (*start != '\0') {
+        char number[MAX_WIDTH_DIGITS + 1] = "";
+        const size_t length = strcspn(start, ",");
+        M_REQUIRE(length > 0 && length <= MAX_WIDTH_DIGITS, ERR_INVALID_ARGUMENT, "invalid bucket", NULL);
+        M_REQUIRE(nb < MAX_BUCKETS, ERR_INVALID_ARGUMENT, "too many buckets", NULL);
+        strncpy(number, start, length);
+        const uint32_t width = atouint32(number);
+        M_REQUIRE(width > previous && width <= MAX_RESIZED_RES, ERR_RESOLUTIONS, "buckets must be increasing widths", NULL);
+        s_options.buckets[nb++] = (uint16_t) width;
+        previous = width;
+        start += length;
+        if (*start == ',') ++start;
+    }
+    M_REQUIRE(nb > 0, ERR_INVALID_ARGUMENT, "no bucket", NULL);
+    s_options.nb_buckets = nb;
+    return ERR_NONE;
+}
+
+#define MAX_WEIGHT 1000
+/**
+ * @brief Parses the weights of the classes of requests into s_options.weights
+ *
+ * @param list the list, e.g. "8,2,1" for reads, resizes and writes
+ * @return int Some error code. 0 if no error.
+ */
+static int parse_weights(const char* list)
+{
+    size_t nb = 0;
+    const char* start = list;
+    while (*start != '\0') {
+        char number[MAX_WIDTH_DIGITS + 1] = "";
+        const size_t length = strcspn(start, ",");
+        M_REQUIRE(length > 0 && length <= MAX_WIDTH_DIGITS, ERR_INVALID_ARGUMENT, "invalid weight", NULL);
+        M_REQUIRE(nb < NB_PRIORITIES, ERR_INVALID_ARGUMENT, "too many weights", NULL);
+        strncpy(number, start, length);
+        const uint32_t weight = atouint32(number);
+        M_REQUIRE(weight > 0 && weight <= MAX_WEIGHT, ERR_INVALID_ARGUMENT, "weights must be positive", NULL);
+        s_options.weights[nb++] = weight;
+        start += length;
+        if (*start == ',') ++start;
+    }
+    M_REQUIRE(nb == NB_PRIORITIES, ERR_INVALID_ARGUMENT, "one weight per class", NULL);
+    return ERR_NONE;
+}
+
+/**
+ * @brief Closes the shards opened by open_shards()
+ */
+static void close_shards(void)
+{
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        do_close(&s_shards[i].imgst_file);
+        if (s_shards[i].retired != NULL) fclose(s_shards[i].retired);
+        s_shards[i].retired = NULL;
+        pthread_rwlock_destroy(&s_shards[i].lock);
+    }
+    s_nb_shards = 0;
+}
+
+/**
+ * @brief Opens the store files served, which must have the same resolutions.
+ * Their order decides the routing of the images, see rank_shards().
+ *
+ * @param nb_files number of files, at most MAX_SHARDS
+ * @param filenames the files
+ * @return int Some error code, and no shard is left open. 0 if no error.
+ */
+static int open_shards(size_t nb_files, char* filenames[])
+{
+    for (size_t i = 0; i < nb_files; i++) {
+        struct shard* shard = &s_shards[i];
+        int err = do_open(filenames[i], s_options.read_only ? "rb" : "rb+", &shard->imgst_file);
+        if (err == ERR_NONE && i > 0 && !same_resolutions(&shard->imgst_file.header)) {
+            do_close(&shard->imgst_file);
+            err = ERR_RESOLUTIONS;
+        }
+        if (err != ERR_NONE) {
+            fprintf(stderr, "%s: ", filenames[i]);
+            close_shards();
+            return err;
+        }
+        shard->filename = filenames[i];
+        pthread_rwlock_init(&shard->lock, NULL);
+        ++s_nb_shards;
+    }
+    return ERR_NONE;
+}
+
+/**
+ * @brief Parses the optional arguments of the server
+ *
+ * @param argc number of arguments, starting with the options
+ * @param argv the options
+ * @return int Some error code. 0 if no error.
+ */
+static int parse_options(int argc, char* argv[])
+{
+    int i = 0;
+    while (i < argc) {
+        if (!strcmp(argv[i], "-buckets") && i + 1 < argc) {
+            M_EXIT_IF_ERR(parse_buckets(argv[i + 1]));
+            i += 2;
+        } else if (!strcmp(argv[i], "-cache_dir") && i + 1 < argc) {
+            s_options.cache_dir = argv[i + 1];
+            i += 2;
+        } else if (!strcmp(argv[i], "-cache_size") && i + 1 < argc) {
+            const uint32_t megabytes = atouint32(argv[i + 1]);
+            M_REQUIRE(megabytes > 0, ERR_INVALID_ARGUMENT, "invalid cache size", NULL);
+            s_options.cache_size = (uint64_t) megabytes * MB;
+            i += 2;
+        } else if (!strcmp(argv[i], "-mem_cache") && i + 1 < argc) {
+            const uint32_t megabytes = atouint32(argv[i + 1]);
+            M_REQUIRE(megabytes > 0 || !strcmp(argv[i + 1], "0"), ERR_INVALID_ARGUMENT,
+                      "invalid memory cache size", NULL);
+            s_options.memory_cache_size = (uint64_t) megabytes * MB;
+            i += 2;
+        } else if (!strcmp(argv[i], "-w_enc") && i + 2 < argc) {
+            const int encoder = encoder_atoi(argv[i + 1]);
+            const uint32_t quality = atouint32(argv[i + 2]);
+            M_REQUIRE(encoder != -1, ERR_INVALID_ARGUMENT, "unrecognised encoder", NULL);
+            M_REQUIRE(quality > 0 && quality <= MAX_QUALITY, ERR_INVALID_ARGUMENT, "invalid quality", NULL);
+            s_options.variant_encoding.encoder = (uint8_t) encoder;
+            s_options.variant_encoding.quality = (uint8_t) quality;
+            i += 3;
+        } else if (!strcmp(argv[i], "-max_pixels") && i + 1 < argc) {
+            const uint32_t pixels = atouint32(argv[i + 1]);
+            M_REQUIRE(pixels > 0, ERR_INVALID_ARGUMENT, "invalid pixel limit", NULL);
+            s_options.max_pixels = pixels;
+            i += 2;
+        } else if (!strcmp(argv[i], "-max_resize_mem") && i + 1 < argc) {
+            const uint32_t megabytes = atouint32(argv[i + 1]);
+            M_REQUIRE(megabytes > 0, ERR_INVALID_ARGUMENT, "invalid resize memory", NULL);
+            s_options.max_resize_memory = (uint64_t) megabytes * MB;
+            i += 2;
+        } else if (!strcmp(argv[i], "-max_upload") && i + 1 < argc) {
+            const uint32_t megabytes = atouint32(argv[i + 1]);
+            M_REQUIRE(megabytes > 0 && megabytes < UINT32_MAX / MB, ERR_INVALID_ARGUMENT, "invalid upload size", NULL);
+            s_options.max_upload = (size_t) megabytes * MB;
+            i += 2;
+        } else if (!strcmp(argv[i], "-max_upload_total") && i + 1 < argc) {
+            const uint32_t megabytes = atouint32(argv[i + 1]);
+            M_REQUIRE(megabytes > 0, ERR_INVALID_ARGUMENT, "invalid upload memory", NULL);
+            s_options.max_upload_total = (size_t) megabytes * MB;
+            i += 2;
+        } else if (!strcmp(argv[i], "-max_resizes") && i + 1 < argc) {
+            const uint32_t resizes = atouint32(argv[i + 1]);
+            M_REQUIRE(resizes > 0, ERR_INVALID_ARGUMENT, "invalid number of resizes", NULL);
+            s_options.max_resizes = resizes;
+            i += 2;
+        } else if (!strcmp(argv[i], "-max_conn_buffer") && i + 1 < argc) {
+            const uint32_t megabytes = atouint32(argv[i + 1]);
+            M_REQUIRE(megabytes > 0, ERR_INVALID_ARGUMENT, "invalid connection buffer", NULL);
+            s_options.max_conn_buffer = (size_t) megabytes * MB;
+            i += 2;
+        } else if (!strcmp(argv[i], "-weights") && i + 1 < argc) {
+            M_EXIT_IF_ERR(parse_weights(argv[i + 1]));
+            i += 2;
+        } else if (!strcmp(argv[i], "-trace_slow") && i + 1 < argc) {
+            const uint32_t milliseconds = atouint32(argv[i + 1]);
+            M_REQUIRE(milliseconds > 0, ERR_INVALID_ARGUMENT, "invalid slow request threshold", NULL);
+            s_options.trace_slow = (uint64_t) milliseconds * 1000000u;
+            i += 2;
+        } else if (!strcmp(argv[i], "-trace_sample") && i + 2 < argc) {
+            const uint32_t every = atouint32(argv[i + 1]);
+            M_REQUIRE(every > 0, ERR_INVALID_ARGUMENT, "invalid trace sampling", NULL);
+            s_options.trace_sample = every;
+            s_options.trace_file = argv[i + 2];
+            i += 3;
+        } else if (!strcmp(argv[i], "-read_only")) {
+            s_options.read_only = 1;
+            ++i;
+        } else if (!strcmp(argv[i], "-reuseport")) {
+            s_options.reuse_port = 1;
+            ++i;
+        } else if (!strcmp(argv[i], "-threads") && i + 1 < argc) {
+            const uint32_t threads = atouint32(argv[i + 1]);
+            M_REQUIRE(threads <= MAX_THREADS && (threads > 0 || !strcmp(argv[i + 1], "0")),
+                      ERR_INVALID_ARGUMENT, "invalid number of threads", NULL);
+            s_options.nb_threads = threads;
+            i += 2;
+        } else {
+            return ERR_INVALID_ARGUMENT;
+        }
     }
-    (void) fn_data;
+    return ERR_NONE;
 }
 
 // ======================================================================
@@ -268,17 +2908,28 @@ int main(int argc, char *argv[])
     if (argc < 2) {
         fprintf(stderr, "%s", ERR_MESSAGES[ERR_NOT_ENOUGH_ARGUMENTS]);
         return EXIT_FAILURE;
-    } else if (argc > 2) {
-        fprintf(stderr, "%s", ERR_MESSAGES[ERR_INVALID_ARGUMENT]);
+    }
+    // the store files come before the options
+    int nb_files = 1;
+    while (nb_files + 1 < argc && argv[nb_files + 1][0] != '-') ++nb_files;
+    int err = nb_files <= MAX_SHARDS ? parse_options(argc - 1 - nb_files, argv + 1 + nb_files) : ERR_INVALID_ARGUMENT;
+    if (err != ERR_NONE) {
+        fprintf(stderr, "%s\n", ERR_MESSAGES[err]);
+        fprintf(stderr, "usage: %s <imgstore_filename>... [-buckets W1,W2,...] [-cache_dir DIR]"
+                " [-cache_size MB] [-mem_cache MB] [-w_enc <jpeg|webp|avif> QUALITY]"
+                " [-max_pixels N] [-max_resize_mem MB] [-max_upload MB] [-max_upload_total MB]"
+                " [-max_resizes N] [-max_conn_buffer MB] [-threads N] [-weights READ,RESIZE,WRITE]"
+                " [-trace_slow MS] [-trace_sample N FILE] [-read_only] [-reuseport]\n", argv[0]);
         return EXIT_FAILURE;
     }
-    const char* imgStore_filename = argv[1];
 
     /* Create server */
     signal(SIGINT, signal_handler);
     signal(SIGTERM, signal_handler);
+    signal(SIGHUP, signal_handler);
     struct mg_mgr mgr;
     mg_mgr_init(&mgr);
+    mgr.reuse_port = s_options.reuse_port;
     if (mg_http_listen(&mgr, s_listening_address, imgst_event_handler, NULL) == NULL) {
         fprintf(stderr, "Error starting server on address %s\n", s_listening_address);
         return EXIT_FAILURE;
@@ -288,26 +2939,72 @@ int main(int argc, char *argv[])
         mg_mgr_free(&mgr);
         vips_error_exit("Error while starting Vips");
     }
-    int err = ERR_NONE;
-    if ((err = do_open(imgStore_filename, "rb+", &imgst_file)) != ERR_NONE) {
+    set_resize_limits(s_options.max_pixels, s_options.max_resize_memory);
+    if ((err = open_shards((size_t) nb_files, argv + 1)) != ERR_NONE) {
         fprintf(stderr, "%s", ERR_MESSAGES[err]);
         vips_shutdown();
         mg_mgr_free(&mgr);
         return EXIT_FAILURE;
     }
+    if ((err = dcache_init(&s_variant_cache, s_options.cache_dir, s_options.cache_size)) != ERR_NONE) {
+        fprintf(stderr, "%s: %s", s_options.cache_dir, ERR_MESSAGES[err]);
+        close_shards();
+        vips_shutdown();
+        mg_mgr_free(&mgr);
+        return EXIT_FAILURE;
+    }
+    FILE* trace_file = NULL;
+    if (s_options.trace_file != NULL && (trace_file = fopen(s_options.trace_file, "a")) == NULL) {
+        fprintf(stderr, "%s: %s", s_options.trace_file, ERR_MESSAGES[ERR_IO]);
+        dcache_free(&s_variant_cache);
+        close_shards();
+        vips_shutdown();
+        mg_mgr_free(&mgr);
+        return EXIT_FAILURE;
+    }
+    if (trace_file != NULL) setvbuf(trace_file, NULL, _IOLBF, 0);
+    // before the workers start tracing
+    trace_configure(s_options.trace_slow, s_options.trace_sample, trace_file);
+    mcache_init(&s_memory_cache, s_options.memory_cache_size);
+    if (s_options.nb_threads > 0 && (err = start_workers(&mgr, s_options.nb_threads)) != ERR_NONE) {
+        fprintf(stderr, "%s", ERR_MESSAGES[err]);
+        stop_workers();
+        if (trace_file != NULL) fclose(trace_file);
+        dcache_free(&s_variant_cache);
+        close_shards();
+        vips_shutdown();
+        mg_mgr_free(&mgr);
+        return EXIT_FAILURE;
+    }
 
-    printf("Starting imgStore server on %s\n", s_listening_address);
-    print_header(&imgst_file.header);
+    printf("Starting %simgStore server on %s with %zu worker threads\n", s_options.read_only ? "read-only " : "",
+           s_listening_address, s_workers.nb_threads);
+    for (size_t i = 0; i < s_nb_shards; i++) {
+        print_header(&s_shards[i].imgst_file.header);
+    }
 
     /* Poll */
-    while (s_signo == 0) mg_mgr_poll(&mgr, 500);
+    while (s_signo == 0) {
+        mg_mgr_poll(&mgr, 500);
+        if (s_reload) {
+            s_reload = 0;
+            reload_shards();
+        }
+        deliver_replies();
+    }
 
     /* Cleanup */
+    stop_workers();
     mg_mgr_free(&mgr);
 
     /* Exit */
     vips_shutdown();
-    do_close(&imgst_file);
+    dcache_free(&s_variant_cache);
+    mcache_free(&s_memory_cache);
+    free_uploads();
+    free_list_cache();
+    close_shards();
+    if (trace_file != NULL) fclose(trace_file);
     printf("Exiting on signal %d", s_signo);
 
     return EXIT_SUCCESS;
@@ -26,12 +26,9 @@ int do_gbcollect(const char* imgst_name, const char* tmp_name)
     M_EXIT_IF_ERR(do_open(imgst_name, "rb", &imgst_file));
     struct imgst_header header = imgst_file.header;
 
-    // initialize temp file
+    // initialize temp file with the same configuration (do_create resets the counters)
     struct imgst_file temp_file = {
-        .header={
-            .max_files = header.max_files,
-            .res_resized = {header.res_resized[0], header.res_resized[1], header.res_resized[2], header.res_resized[3]}
-        }
+        .header = header
     };
     M_EXIT_IF_ERR_DO_SOMETHING(do_create(tmp_name, &temp_file), do_close(&imgst_file));
     do_close(&temp_file);
@@ -49,17 +46,21 @@ int do_gbcollect(const char* imgst_name, const char* tmp_name)
                 do_close(&imgst_file);
                 do_close(&temp_file);
             });
-            // insert
-            M_EXIT_IF_ERR_DO_SOMETHING(do_insert(image_buffer, size_read, imgst_file.metadata[i].img_id, &temp_file), {
+            // insert, even if over the current limits on inserted images
+            M_EXIT_IF_ERR_DO_SOMETHING(do_insert_copy(image_buffer, size_read, imgst_file.metadata[i].SHA,
+                                                      imgst_file.metadata[i].img_id, &temp_file), {
                 do_close(&imgst_file);
                 do_close(&temp_file);
                 free(image_buffer);
                 image_buffer = NULL;
             });
             // lazily_resize
-            for (int res = 0; res < NB_RES; res++) {
+            for (int res = 0; res < MAX_NB_RES; res++) {
                 if (imgst_file.metadata[i].offset[res] != 0) {
-                    M_EXIT_IF_ERR_DO_SOMETHING(lazily_resize(res, &temp_file, valid_images), {
+                    const int err = lazily_resize(res, &temp_file, valid_images);
+                    // a variant over the current limits is left out, like on a read
+                    if (err == ERR_IMAGE_TOO_LARGE) continue;
+                    M_EXIT_IF_ERR_DO_SOMETHING(err, {
                         do_close(&imgst_file);
                         do_close(&temp_file);
                         free(image_buffer);
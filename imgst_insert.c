@@ -6,72 +6,128 @@
 #include "dedup.h"
 #include "image_content.h"
 #include "error.h"
+#include "trace.h"
 
 #include <stdio.h>
 #include <stdint.h>
+#include <string.h>
 #include <openssl/sha.h>
 
 /**
  * @brief Returns the index of an empty image slot in the metadata and updates it. Parameters are expected to be correct.
  *
- * @param buffer Pointer to the raw image content
+ * @param SHA SHA-256 of the image
  * @param size Image size
  * @param img_id Image ID
  * @param imgst_file imgStore file
  * @return size_t index.
  */
-size_t find_empty_and_update_metadata(const char* buffer, size_t size, const char* img_id, const struct imgst_file* imgst_file);
+size_t find_empty_and_update_metadata(const unsigned char SHA[SHA256_DIGEST_LENGTH], size_t size, const char* img_id,
+                                      const struct imgst_file* imgst_file);
 
 /********************************************************************//**
  * Insert image in the imgStore file
  */
 int do_insert(const char* buffer, size_t size, const char* img_id, struct imgst_file* imgst_file)
+{
+    M_REQUIRE_NON_NULL(buffer);
+    unsigned char SHA[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char *) buffer, size, SHA);
+    return do_insert_hashed(buffer, size, SHA, img_id, imgst_file);
+}
+
+/**
+ * @brief Inserts an image whose SHA-256 is known, see do_insert_hashed()
+ *
+ * @param check_size 1 to reject images over the limits of check_image_size()
+ */
+static int insert_hashed(const char* buffer, size_t size, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                         const char* img_id, struct imgst_file* imgst_file, int check_size)
 {
     //fprintf(stderr, "DEBUG: %d\n%s\n", size, img_id);
     // check validity of arguments
     M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(SHA);
     M_REQUIRE_NON_NULL(img_id);
     // file must be already open
     M_REQUIRE_NON_NULL_IMGST_FILE(imgst_file);
     M_CHECK_IMG_ID(img_id);
     M_REQUIRE(imgst_file->header.num_files < imgst_file->header.max_files, ERR_FULL_IMGSTORE, ERR_MESSAGES[ERR_FULL_IMGSTORE], NULL);
 
-    const uint32_t index = (uint32_t) find_empty_and_update_metadata(buffer, size, img_id, imgst_file);
+    // rejects oversized images from their JPEG header, before anything is written
+    uint32_t width = 0, height = 0;
+    M_EXIT_IF_ERR(get_resolution(&height, &width, buffer, size));
+    if (check_size) M_EXIT_IF_ERR(check_image_size(width, height));
+
+    uint64_t start = trace_clock();
+    const uint32_t index = (uint32_t) find_empty_and_update_metadata(SHA, size, img_id, imgst_file);
     M_EXIT_IF_ERR(do_name_and_content_dedup(imgst_file, index));
+    trace_span("dedup", start, trace_clock());
 
     // if there is no duplicate image, write image at the end of file
-    if (imgst_file->metadata[index].offset[RES_ORIG] == 0) {
+    const int duplicate = imgst_file->metadata[index].offset[RES_ORIG] != 0;
+    if (!duplicate) {
         long offset;
+        start = trace_clock();
         M_EXIT_IF_ERR(write_disk_image(imgst_file, (void*)buffer, size, &offset));
+        trace_span("write", start, trace_clock());
         imgst_file->metadata[index].offset[RES_ORIG] = (uint64_t)offset;
-        imgst_file->metadata[index].offset[RES_THUMB] = 0;
-        imgst_file->metadata[index].size[RES_THUMB] = 0;
-        imgst_file->metadata[index].offset[RES_SMALL] = 0;
-        imgst_file->metadata[index].size[RES_SMALL] = 0;
+        for (int res = 0; res < imgst_file->header.nb_resized; res++) {
+            imgst_file->metadata[index].offset[res] = 0;
+            imgst_file->metadata[index].size[res] = 0;
+        }
+    }
+    imgst_file->metadata[index].res_orig[0] = width;
+    imgst_file->metadata[index].res_orig[1] = height;
+    // resolutions the original already fits in simply reuse its bytes
+    if (!duplicate) {
+        alias_small_original(imgst_file, index);
     }
-    M_EXIT_IF_ERR(get_resolution(&imgst_file->metadata[index].res_orig[1], &imgst_file->metadata[index].res_orig[0], buffer, size));
 
-    // updates header
+    // updates metadata, then the header: readers of the store refresh their
+    // metadata when they see the version change
+    imgst_file->metadata[index].is_valid = NON_EMPTY;
+    start = trace_clock();
+    M_EXIT_IF_ERR(update_disk_metadata(imgst_file, index));
+    trace_span("metadata", start, trace_clock());
     imgst_file->header.num_files++;
     imgst_file->header.imgst_version++;
+    start = trace_clock();
     M_EXIT_IF_ERR(update_disk_header(imgst_file));
-    // updates metadata
-    imgst_file->metadata[index].is_valid = NON_EMPTY;
-    M_EXIT_IF_ERR(update_disk_metadata(imgst_file, index));
+    trace_span("header", start, trace_clock());
 
     return ERR_NONE;
 }
 
+/********************************************************************//**
+ * Insert image whose SHA-256 is already known in the imgStore file
+ */
+int do_insert_hashed(const char* buffer, size_t size, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                     const char* img_id, struct imgst_file* imgst_file)
+{
+    return insert_hashed(buffer, size, SHA, img_id, imgst_file, 1);
+}
+
+/********************************************************************//**
+ * Insert image copied from another imgStore file, without the size limits
+ */
+int do_insert_copy(const char* buffer, size_t size, const unsigned char SHA[SHA256_DIGEST_LENGTH],
+                   const char* img_id, struct imgst_file* imgst_file)
+{
+    return insert_hashed(buffer, size, SHA, img_id, imgst_file, 0);
+}
+
 /********************************************************************//**
   * Returns the index of an empty image slot in the metadata and updates it. Parameters are expected to be correct.
   */
-size_t find_empty_and_update_metadata(const char* buffer, size_t size, const char* img_id, const struct imgst_file* imgst_file)
+size_t find_empty_and_update_metadata(const unsigned char SHA[SHA256_DIGEST_LENGTH], size_t size, const char* img_id,
+                                      const struct imgst_file* imgst_file)
 {
     size_t i = 0;
     int found = 0;
     while (i < imgst_file->header.max_files && found == 0) {
         if (imgst_file->metadata[i].is_valid == EMPTY) {
-            SHA256((unsigned char *) buffer, size, imgst_file->metadata[i].SHA);
+            memcpy(imgst_file->metadata[i].SHA, SHA, SHA256_DIGEST_LENGTH);
             strncpy(imgst_file->metadata[i].img_id, img_id, MAX_IMG_ID);
             imgst_file->metadata[i].size[RES_ORIG] = (uint32_t)size;
             found = 1;
@@ -7,6 +7,8 @@
 #include "error.h"
 #include <json-c/json.h>
 #include <stdio.h>
+#include <string.h>
+#include <inttypes.h> // for PRIu64
 
 
 
@@ -28,7 +30,7 @@ char* do_list(const struct imgst_file* imgst_file, const enum do_list_mode mode)
             size_t valid = 0;
             while (valid < imgst_file->header.num_files && i < imgst_file->header.max_files) {
                 if (imgst_file->metadata[i].is_valid == NON_EMPTY) {
-                    print_metadata(&imgst_file->metadata[i]);
+                    print_metadata(&imgst_file->metadata[i], &imgst_file->header);
                     valid++;
                 }
                 i++;
@@ -36,10 +38,26 @@ char* do_list(const struct imgst_file* imgst_file, const enum do_list_mode mode)
         }
         return NULL;
     } else if (mode == JSON) {
-        json_object* array = NULL;
-        array = json_object_new_array();
+        const struct imgst_file* const stores[] = {imgst_file};
+        return do_list_json(stores, 1);
+    } else {
+        char* res = calloc(strlen("unimplemented do_list output mode") + 1, 1);
+        strcpy(res, "unimplemented do_list output mode");
+        return res;
+    }
+}
 
+/********************************************************************//**
+ * Returns the image ids of several imgStores as one JSON object.
+ */
+char* do_list_json(const struct imgst_file* const stores[], size_t nb_stores)
+{
+    if (stores == NULL || nb_stores == 0) return NULL;
+    json_object* array = NULL;
+    array = json_object_new_array();
 
+    for (size_t s = 0; s < nb_stores; s++) {
+        const struct imgst_file* imgst_file = stores[s];
         size_t i = 0;
         uint32_t valid_read = 0;
         while(i < imgst_file->header.max_files && valid_read < imgst_file -> header.num_files) {
@@ -50,20 +68,134 @@ char* do_list(const struct imgst_file* imgst_file, const enum do_list_mode mode)
             }
             i++;
         }
-        json_object* obj = json_object_new_object();
-        //no return type in version 0.12.1 :
-        json_object_object_add(obj, "Images", array);
+    }
+    const struct imgst_header* header = &stores[0]->header;
+    json_object* resolutions = json_object_new_array();
+    for (int res = 0; res < header->nb_resized; res++) {
+        json_object_array_add(resolutions, json_object_new_string(resolution_name(header, res)));
+    }
+    json_object_array_add(resolutions, json_object_new_string(resolution_name(header, RES_ORIG)));
 
-        const char* array_id = json_object_to_json_string(obj);
-        char* res = calloc(strlen(array_id) + 1, 1);
-        strcpy(res, array_id);
+    json_object* obj = json_object_new_object();
+    //no return type in version 0.12.1 :
+    json_object_object_add(obj, "Images", array);
+    json_object_object_add(obj, "Resolutions", resolutions);
 
-        while(json_object_put(obj) != 1) {}
-        return res;
+    const char* array_id = json_object_to_json_string(obj);
+    char* res = calloc(strlen(array_id) + 1, 1);
+    if (res != NULL) strcpy(res, array_id);
+
+    while(json_object_put(obj) != 1) {}
+    return res;
+}
+
+/**
+ * @brief Appends a string as a JSON string literal, if it fits
+ *
+ * @param string the string to append
+ * @param buffer output
+ * @param length current length of buffer, updated
+ * @param room number of bytes that may be written
+ * @return int 1 if the string was appended, 0 if it does not fit
+ */
+static int append_json_string(const char* string, char* buffer, size_t* length, size_t room)
+{
+    // length of the literal first, so that nothing is written if it does not fit
+    size_t needed = 2;
+    for (const char* c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') needed += 2;
+        else if ((unsigned char) *c < 0x20) needed += 6;
+        else needed++;
+    }
+    if (needed > room) return 0;
+
+    char* out = buffer + *length;
+    *out++ = '"';
+    for (const char* c = string; *c != '\0'; c++) {
+        if (*c == '"' || *c == '\\') {
+            *out++ = '\\';
+            *out++ = *c;
+        } else if ((unsigned char) *c < 0x20) {
+            snprintf(out, 7, "\\u%04x", (unsigned) (unsigned char) *c);
+            out += 6;
+        } else {
+            *out++ = *c;
+        }
+    }
+    *out++ = '"';
+    *length += needed;
+    return 1;
+}
+
+/********************************************************************//**
+ * Writes one page of the image ids of one or several imgStores as JSON into a caller buffer.
+ */
+int do_list_page(const struct imgst_file* const stores[], size_t nb_stores, size_t cursor, size_t limit,
+                 char* buffer, size_t buffer_size, size_t* length, size_t* next)
+{
+    M_REQUIRE_NON_NULL(stores);
+    M_REQUIRE(nb_stores > 0, ERR_INVALID_ARGUMENT, "no store to list", NULL);
+    for (size_t s = 0; s < nb_stores; s++) {
+        M_REQUIRE_NON_NULL(stores[s]);
+        M_REQUIRE_NON_NULL(stores[s]->metadata);
+    }
+    M_REQUIRE_NON_NULL(buffer);
+    M_REQUIRE_NON_NULL(length);
+    M_REQUIRE_NON_NULL(next);
+    M_REQUIRE(limit > 0, ERR_INVALID_ARGUMENT, "empty page", NULL);
+    M_REQUIRE(buffer_size >= LIST_PAGE_MIN_SIZE, ERR_INVALID_ARGUMENT, "page buffer too small", NULL);
+
+    // room kept for the end of the object: ],"Next":"<cursor>"}
+    const size_t tail = LIST_PAGE_TAIL;
+    size_t len = 0;
+    const struct imgst_header* header = &stores[0]->header;
+    len += (size_t) snprintf(buffer, buffer_size, "{\"Resolutions\":[");
+    for (int res = 0; res <= header->nb_resized; res++) {
+        // resized resolutions first, then the original, as in do_list
+        const char* name = resolution_name(header, res == header->nb_resized ? RES_ORIG : res);
+        if (res > 0) buffer[len++] = ',';
+        M_REQUIRE(append_json_string(name, buffer, &len, buffer_size - len - tail), ERR_INVALID_ARGUMENT,
+                  "page buffer too small", NULL);
+    }
+    len += (size_t) snprintf(buffer + len, buffer_size - len, "],\"Images\":[");
 
+    size_t s = cursor / MAX_MAX_FILES;
+    size_t i = cursor % MAX_MAX_FILES;
+    size_t listed = 0;
+    int full = 0;
+    for (; s < nb_stores; s++, i = 0) {
+        const struct imgst_file* imgst_file = stores[s];
+        while (i < imgst_file->header.max_files && listed < limit) {
+            if (imgst_file->metadata[i].is_valid == NON_EMPTY) {
+                // the page also stops when the buffer is full
+                const size_t room = buffer_size - len - tail - (listed > 0 ? 1 : 0);
+                const size_t before = len;
+                if (listed > 0) ++len;
+                if (!append_json_string(imgst_file->metadata[i].img_id, buffer, &len, room)) {
+                    len = before;
+                    full = 1;
+                    break;
+                }
+                if (listed > 0) buffer[before] = ',';
+                listed++;
+            }
+            i++;
+        }
+        if (full || listed == limit) break;
+    }
+    // the next page starts at the next image, there is none if no image is left after i
+    for (; s < nb_stores; s++, i = 0) {
+        const struct imgst_file* imgst_file = stores[s];
+        while (i < imgst_file->header.max_files && imgst_file->metadata[i].is_valid != NON_EMPTY) i++;
+        if (i < imgst_file->header.max_files) break;
+    }
+    *next = s < nb_stores ? s * MAX_MAX_FILES + i : 0;
+
+    if (*next != 0) {
+        len += (size_t) snprintf(buffer + len, buffer_size - len, "],\"Next\":\"%" PRIu64 "\"}", (uint64_t) *next);
     } else {
-        char* res = calloc(strlen("unimplemented do_list output mode") + 1, 1);
-        strcpy(res, "unimplemented do_list output mode");
-        return res;
+        len += (size_t) snprintf(buffer + len, buffer_size - len, "],\"Next\":null}");
     }
+    *length = len;
+    return ERR_NONE;
 }
@@ -21,7 +21,7 @@ int do_read(const char* img_id, int resolution, char** image_buffer, uint32_t* i
     M_REQUIRE_NON_NULL(image_buffer);
     M_REQUIRE_NON_NULL_IMGST_FILE(imgst_file);
     M_CHECK_IMG_ID(img_id);
-    M_REQUIRE(resolution < NB_RES && resolution >= 0, ERR_RESOLUTIONS, ERR_MESSAGES[ERR_RESOLUTIONS], NULL);
+    M_REQUIRE(is_valid_resolution(&imgst_file->header, resolution), ERR_RESOLUTIONS, ERR_MESSAGES[ERR_RESOLUTIONS], NULL);
 
 
     size_t index = 0;
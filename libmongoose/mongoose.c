@@ -2097,6 +2097,9 @@ void mg_mgr_free(struct mg_mgr *mgr) {
   struct mg_connection *c;
   for (c = mgr->conns; c != NULL; c = c->next) c->is_closing = 1;
   mg_mgr_poll(mgr, 0);
+#if MG_ENABLE_EPOLL
+  if (mgr->epoll_fd >= 0) close(mgr->epoll_fd);
+#endif
 #if MG_ARCH == MG_ARCH_FREERTOS
   FreeRTOS_DeleteSocketSet(mgr->ss);
 #endif
@@ -2115,6 +2118,10 @@ void mg_mgr_init(struct mg_mgr *mgr) {
   signal(SIGPIPE, SIG_IGN);
 #endif
   memset(mgr, 0, sizeof(*mgr));
+#if MG_ENABLE_EPOLL
+  if ((mgr->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) < 0)
+    LOG(LL_ERROR, ("epoll_create1: %d", errno));
+#endif
   mgr->dnstimeout = 3000;
   mgr->dns4.url = "udp://8.8.8.8:53";
   mgr->dns6.url = "udp://[2001:4860:4860::8888]:53";
@@ -2620,6 +2627,10 @@ int mg_send(struct mg_connection *c, const void *buf, size_t len) {
   int fail, n = c->is_udp
                     ? ll_write(c, buf, (SOCKET) len, &fail)
                     : (int) mg_iobuf_append(&c->send, buf, len, MG_IO_SIZE);
+#if MG_ENABLE_EPOLL
+  // A socket already writable is not reported again
+  if (c->is_writable) c->mgr->io_pending = true;
+#endif
   return n;
 }
 
@@ -2636,7 +2647,7 @@ static void mg_set_non_blocking_mode(SOCKET fd) {
 #endif
 }
 
-SOCKET mg_open_listener(const char *url) {
+SOCKET mg_open_listener(const char *url, bool reuse_port) {
   struct mg_addr addr;
   SOCKET fd = INVALID_SOCKET;
 
@@ -2644,6 +2655,11 @@ SOCKET mg_open_listener(const char *url) {
   addr.port = mg_htons(mg_url_port(url));
   if (!mg_aton(mg_url_host(url), &addr)) {
     LOG(LL_ERROR, ("invalid listening URL: %s", url));
+#ifndef SO_REUSEPORT
+  } else if (reuse_port) {
+    // Listening alone would hide that the port is not shared
+    LOG(LL_ERROR, ("%s: SO_REUSEPORT is not supported", url));
+#endif
   } else {
     union usa usa = tousa(&addr);
     int on = 1, af = AF_INET;
@@ -2671,6 +2687,12 @@ SOCKET mg_open_listener(const char *url) {
         //! &&
         !setsockopt(fd, SOL_SOCKET, SO_EXCLUSIVEADDRUSE, (char *) &on,
                     sizeof(on)) &&
+#endif
+#ifdef SO_REUSEPORT
+        // Several processes may then listen on the same port, the kernel
+        // spreading the incoming connections between them
+        (!reuse_port ||
+         !setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, (char *) &on, sizeof(on))) &&
 #endif
         bind(fd, &usa.sa, slen) == 0 &&
         // NOTE(lsm): FreeRTOS uses backlog value as a connection limit
@@ -2704,19 +2726,119 @@ static void read_conn(struct mg_connection *c,
     struct mg_str evd = mg_str_n((char *) buf, rc);
     c->recv.len += rc;
     mg_call(c, MG_EV_READ, &evd);
+  } else if (fail) {
+    c->is_closing = 1;
   } else {
-    if (fail) c->is_closing = 1;
+    c->is_readable = 0;  // Would block, wait for more data
+  }
+}
+
+#if MG_ENABLE_SENDFILE
+#include <sys/sendfile.h>
+#endif
+
+#if MG_ENABLE_EPOLL
+#ifndef MG_EPOLL_EVENTS
+#define MG_EPOLL_EVENTS 256  // Events fetched per epoll_wait()
+#endif
+
+// Registers a connection once: with edge triggering, the kernel only reports
+// changes, and is_readable / is_writable stay set until an I/O would block
+static void epoll_add(struct mg_connection *c) {
+  struct epoll_event ev;
+  memset(&ev, 0, sizeof(ev));
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = c;
+  if (epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_ADD, FD(c), &ev) != 0) {
+    LOG(LL_ERROR, ("%lu epoll_ctl: %d", c->id, MG_SOCK_ERRNO));
+    c->is_closing = 1;
+  }
+}
+#else
+#define epoll_add(c)
+#endif
+
+// Appends a file range to the send buffer, when it cannot be sent directly
+static bool copy_file_range_to_send(struct mg_connection *c, int fd,
+                                    uint64_t offset, size_t len) {
+  if (c->send.size < c->send.len + len) {
+    mg_iobuf_resize(&c->send, c->send.len + len);
+    if (c->send.size < c->send.len + len) return false;
+  }
+  while (len > 0) {
+    ssize_t rc = pread(fd, c->send.buf + c->send.len, len, (off_t) offset);
+    if (rc <= 0) return false;
+    c->send.len += (size_t) rc;
+    offset += (uint64_t) rc;
+    len -= (size_t) rc;
+  }
+  return true;
+}
+
+// Queues len bytes of fd at offset, after what is already in the send buffer.
+// With sendfile, the bytes go from the file to the socket without being copied
+// to user space; the range is sent once the bytes queued before it are.
+// Otherwise (no sendfile, TLS, or a range already pending), they are copied
+// into the send buffer. fd is not kept: it can be closed after the call.
+bool mg_send_file_range(struct mg_connection *c, int fd, uint64_t offset,
+                        size_t len) {
+  if (len == 0) return true;
+#if MG_ENABLE_EPOLL
+  if (c->is_writable) c->mgr->io_pending = true;
+#endif
+#if MG_ENABLE_SENDFILE
+  if (c->range_len == 0 && !c->is_tls && !c->is_udp) {
+    int range_fd = dup(fd);
+    if (range_fd >= 0) {
+      c->range_fd = range_fd;
+      c->range_after = c->send.len;
+      c->range_offset = offset;
+      c->range_len = len;
+      return true;
+    }
   }
+#endif
+  return copy_file_range_to_send(c, fd, offset, len);
+}
+
+static void free_range(struct mg_connection *c) {
+  if (c->range_len > 0) close(c->range_fd);
+  c->range_len = c->range_after = 0;
 }
 
 static int write_conn(struct mg_connection *c) {
-  int fail, rc = ll_write(c, c->send.buf, (SOCKET) c->send.len, &fail);
+  // bytes queued after a pending range wait for it
+  size_t len = c->range_len > 0 ? c->range_after : c->send.len;
+  int fail = 0, rc = 0;
+  if (len > 0) {
+    rc = ll_write(c, c->send.buf, (SOCKET) len, &fail);
+    if (rc > 0) {
+      mg_iobuf_delete(&c->send, rc);
+      if (c->range_len > 0) c->range_after -= (size_t) rc;
+      if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
+    }
+  }
+#if MG_ENABLE_SENDFILE
+  else if (c->range_len > 0) {
+    off_t offset = (off_t) c->range_offset;
+    ssize_t n = sendfile(FD(c), c->range_fd, &offset, c->range_len);
+    if (n > 0) {
+      rc = (int) n;
+      c->range_offset += (uint64_t) n;
+      c->range_len -= (size_t) n;
+      if (c->range_len == 0) free_range(c);
+    } else {
+      // 0 means the file is shorter than the range
+      fail = n == 0 || mg_sock_failed();
+    }
+  }
+#endif
   if (rc > 0) {
-    mg_iobuf_delete(&c->send, rc);
-    if (c->send.len == 0) mg_iobuf_resize(&c->send, 0);
     mg_call(c, MG_EV_WRITE, &rc);
   } else if (fail) {
     c->is_closing = 1;
+  } else if (len > 0 || c->range_len > 0) {
+    c->is_writable = 0;  // Would block, wait for the socket to drain
   }
   return rc;
 }
@@ -2731,12 +2853,16 @@ static void close_conn(struct mg_connection *c) {
   // while (c->callbacks != NULL) mg_fn_del(c, c->callbacks->fn);
   LOG(LL_DEBUG, ("%lu closed", c->id));
   if (FD(c) != INVALID_SOCKET) {
+#if MG_ENABLE_EPOLL
+    epoll_ctl(c->mgr->epoll_fd, EPOLL_CTL_DEL, FD(c), NULL);
+#endif
     closesocket(FD(c));
 #if MG_ARCH == MG_ARCH_FREERTOS
     FreeRTOS_FD_CLR(c->fd, c->mgr->ss, eSELECT_ALL);
 #endif
   }
   mg_tls_free(c);
+  free_range(c);
   free(c->recv.buf);
   free(c->send.buf);
   memset(c, 0, sizeof(*c));
@@ -2785,6 +2911,7 @@ void mg_connect_resolved(struct mg_connection *c) {
   }
 
   mg_set_non_blocking_mode(FD(c));
+  epoll_add(c);
   mg_call(c, MG_EV_RESOLVE, NULL);
   if (type == SOCK_STREAM) {
     union usa usa = tousa(&c->peer);
@@ -2828,8 +2955,11 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
   socklen_t sa_len = sizeof(usa);
   SOCKET fd = accept(FD(lsn), &usa.sa, &sa_len);
   if (fd == INVALID_SOCKET) {
-    LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
-#if !defined(_WIN32)
+    // Nothing left to accept, or an error: wait for the next connection
+    if (mg_sock_failed())
+      LOG(LL_ERROR, ("%lu accept failed, errno %d", lsn->id, MG_SOCK_ERRNO));
+    lsn->is_readable = 0;
+#if !defined(_WIN32) && !MG_ENABLE_EPOLL
   } else if (fd >= FD_SETSIZE) {
     LOG(LL_ERROR, ("%ld > %ld", (long) fd, (long) FD_SETSIZE));
     closesocket(fd);
@@ -2853,6 +2983,7 @@ static void accept_conn(struct mg_mgr *mgr, struct mg_connection *lsn) {
     mg_set_non_blocking_mode(FD(c));
     setsockopts(c);
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    epoll_add(c);
     c->is_accepted = 1;
     c->is_hexdumping = lsn->is_hexdumping;
     c->pfn = lsn->pfn;
@@ -2909,7 +3040,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
                                 mg_event_handler_t fn, void *fn_data) {
   struct mg_connection *c = NULL;
   int is_udp = strncmp(url, "udp:", 4) == 0;
-  SOCKET fd = mg_open_listener(url);
+  SOCKET fd = mg_open_listener(url, mgr->reuse_port);
   if (fd == INVALID_SOCKET) {
   } else if ((c = alloc_conn(mgr, 0, fd)) == NULL) {
     LOG(LL_ERROR, ("OOM %s", url));
@@ -2920,6 +3051,7 @@ struct mg_connection *mg_listen(struct mg_mgr *mgr, const char *url,
     c->is_udp = is_udp;
     setsockopts(c);
     LIST_ADD_HEAD(struct mg_connection, &mgr->conns, c);
+    epoll_add(c);
     c->fn = fn;
     c->fn_data = fn_data;
     LOG(LL_INFO, ("%lu accepting on %s", c->id, url));
@@ -2941,6 +3073,27 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     c->is_readable = bits & (eSELECT_READ | eSELECT_EXCEPT) ? 1 : 0;
     c->is_writable = bits & eSELECT_WRITE ? 1 : 0;
   }
+#elif MG_ENABLE_EPOLL
+  struct epoll_event events[MG_EPOLL_EVENTS];
+  struct mg_connection *c;
+  int i, n;
+
+  // Readiness left from the last poll is not reported again: do not wait.
+  // mg_mgr_poll and the sends flag it, no need to look at every connection
+  if (mgr->io_pending) ms = 0;
+  mgr->io_pending = false;
+
+  n = epoll_wait(mgr->epoll_fd, events, MG_EPOLL_EVENTS, ms);
+  if (n < 0) {
+    LOG(LL_DEBUG, ("epoll_wait: %d %d", n, MG_SOCK_ERRNO));
+    n = 0;
+  }
+  for (i = 0; i < n; i++) {
+    uint32_t e = events[i].events;
+    c = (struct mg_connection *) events[i].data.ptr;
+    if (e & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)) c->is_readable = 1;
+    if (e & (EPOLLOUT | EPOLLHUP | EPOLLERR)) c->is_writable = 1;
+  }
 #else
   struct timeval tv = {ms / 1000, (ms % 1000) * 1000};
   struct mg_connection *c;
@@ -2958,7 +3111,8 @@ static void mg_iotest(struct mg_mgr *mgr, int ms) {
     if (c->is_closing || c->is_resolving || FD(c) == INVALID_SOCKET) continue;
     FD_SET(FD(c), &rset);
     if (FD(c) > maxfd) maxfd = FD(c);
-    if (c->is_connecting || (c->send.len > 0 && c->is_tls_hs == 0))
+    if (c->is_connecting ||
+        ((c->send.len > 0 || c->range_len > 0) && c->is_tls_hs == 0))
       FD_SET(FD(c), &wset);
   }
 
@@ -3022,8 +3176,18 @@ void mg_mgr_poll(struct mg_mgr *mgr, int ms) {
       if (c->is_writable) write_conn(c);
     }
 
-    if (c->is_draining && c->send.len == 0) c->is_closing = 1;
-    if (c->is_closing) close_conn(c);
+    if (c->is_draining && c->send.len == 0 && c->range_len == 0)
+      c->is_closing = 1;
+    if (c->is_closing) {
+      close_conn(c);
+#if MG_ENABLE_EPOLL
+    } else if (!c->is_resolving &&
+               (c->is_readable ||
+                (c->is_writable && (c->send.len > 0 || c->range_len > 0)))) {
+      // An I/O stopped short of blocking: there may be more to do
+      mgr->io_pending = true;
+#endif
+    }
   }
 }
 #endif
@@ -298,6 +298,28 @@ typedef int socklen_t;
 #define MG_ENABLE_FS 1
 #endif
 
+// Send file ranges with sendfile(2), see mg_send_file_range()
+#ifndef MG_ENABLE_SENDFILE
+#if defined(__linux__) && MG_ENABLE_SOCKET
+#define MG_ENABLE_SENDFILE 1
+#else
+#define MG_ENABLE_SENDFILE 0
+#endif
+#endif
+
+// Poll with edge-triggered epoll(7) instead of select(2), see mg_iotest()
+#ifndef MG_ENABLE_EPOLL
+#if defined(__linux__) && MG_ENABLE_SOCKET
+#define MG_ENABLE_EPOLL 1
+#else
+#define MG_ENABLE_EPOLL 0
+#endif
+#endif
+
+#if MG_ENABLE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 #ifndef MG_ENABLE_SSI
 #define MG_ENABLE_SSI 0
 #endif
@@ -600,6 +622,11 @@ struct mg_mgr {
   struct mg_dns dns6;           // DNS for IPv6
   int dnstimeout;               // DNS resolve timeout in milliseconds
   unsigned long nextid;         // Next connection ID
+  bool reuse_port;              // Listeners bind with SO_REUSEPORT
+#if MG_ENABLE_EPOLL
+  int epoll_fd;     // Connections are registered once, edge-triggered
+  bool io_pending;  // Readiness left over: the next poll does not wait
+#endif
 #if MG_ARCH == MG_ARCH_FREERTOS
   SocketSet_t ss;  // NOTE(lsm): referenced from socket struct
 #endif
@@ -618,6 +645,10 @@ struct mg_connection {
   mg_event_handler_t pfn;      // Protocol-specific handler function
   void *pfn_data;              // Protocol-specific function parameter
   char label[32];              // Arbitrary label
+  int range_fd;                // File of the pending range (dup'ed, ours)
+  size_t range_after;          // Bytes of send to write before the range
+  uint64_t range_offset;       // Next offset of the range in range_fd
+  size_t range_len;            // Bytes of the range left to send, 0 if none
   void *tls;                   // TLS specific data
   unsigned is_listening : 1;   // Listening connection
   unsigned is_client : 1;      // Outbound (client) connection
@@ -631,8 +662,10 @@ struct mg_connection {
   unsigned is_hexdumping : 1;  // Hexdump in/out traffic
   unsigned is_draining : 1;    // Send remaining data, then close and free
   unsigned is_closing : 1;     // Close and free the connection immediately
-  unsigned is_readable : 1;    // Connection is ready to read
-  unsigned is_writable : 1;    // Connection is ready to write
+  unsigned is_readable : 1;    // Connection is ready to read (with epoll:
+                               // until a read would block)
+  unsigned is_writable : 1;    // Connection is ready to write (with epoll:
+                               // until a write would block)
 };
 
 void mg_mgr_poll(struct mg_mgr *, int ms);
@@ -644,6 +677,8 @@ struct mg_connection *mg_listen(struct mg_mgr *, const char *url,
 struct mg_connection *mg_connect(struct mg_mgr *, const char *url,
                                  mg_event_handler_t fn, void *fn_data);
 int mg_send(struct mg_connection *, const void *, size_t);
+bool mg_send_file_range(struct mg_connection *, int fd, uint64_t offset,
+                        size_t len);
 int mg_printf(struct mg_connection *, const char *fmt, ...);
 int mg_vprintf(struct mg_connection *, const char *fmt, va_list ap);
 char *mg_straddr(struct mg_connection *, char *, size_t);
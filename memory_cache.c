@@ -0,0 +1,247 @@
+/**
+ * @file memory_cache.c
+ * @brief Byte-bounded in-memory cache of the images read from the store, with segmented LRU eviction.
+ */
+#include "memory_cache.h"
+#include "error.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * @brief Removes an entry from the LRU list of its segment
+ */
+static void mcache_unlink(struct memory_cache* cache, struct mcache_entry* entry)
+{
+    struct mcache_lru* lru = &cache->segments[entry->segment];
+    if (entry->prev != NULL) entry->prev->next = entry->next;
+    else lru->head = entry->next;
+    if (entry->next != NULL) entry->next->prev = entry->prev;
+    else lru->tail = entry->prev;
+    entry->prev = NULL;
+    entry->next = NULL;
+    lru->bytes -= entry->size;
+}
+
+/**
+ * @brief Inserts an entry at the head (most recently used) of a segment
+ */
+static void mcache_push_front(struct memory_cache* cache, struct mcache_entry* entry, enum mcache_segment segment)
+{
+    struct mcache_lru* lru = &cache->segments[segment];
+    entry->segment = segment;
+    entry->prev = NULL;
+    entry->next = lru->head;
+    if (lru->head != NULL) lru->head->prev = entry;
+    lru->head = entry;
+    if (lru->tail == NULL) lru->tail = entry;
+    lru->bytes += entry->size;
+}
+
+/**
+ * @brief Removes an entry from the cache and frees it
+ */
+static void mcache_remove(struct memory_cache* cache, struct mcache_entry* entry)
+{
+    struct mcache_entry** link = &cache->buckets[entry->slot % MCACHE_NB_BUCKETS];
+    while (*link != entry) {
+        link = &(*link)->chain;
+    }
+    *link = entry->chain;
+    mcache_unlink(cache, entry);
+    --cache->nb_entries;
+    free(entry->data);
+    free(entry);
+}
+
+/**
+ * @brief Total size of the entries
+ */
+static uint64_t mcache_bytes(const struct memory_cache* cache)
+{
+    return cache->segments[MCACHE_PROBATION].bytes + cache->segments[MCACHE_PROTECTED].bytes;
+}
+
+/**
+ * @brief Demotes the least recently used protected entries to probation while
+ * the protected segment is over its share
+ */
+static void mcache_balance(struct memory_cache* cache)
+{
+    const uint64_t protected_max = cache->max_bytes / 100 * MCACHE_PROTECTED_PERCENT;
+    struct mcache_lru* protected_lru = &cache->segments[MCACHE_PROTECTED];
+    while (protected_lru->tail != NULL && protected_lru->bytes > protected_max) {
+        struct mcache_entry* entry = protected_lru->tail;
+        mcache_unlink(cache, entry);
+        mcache_push_front(cache, entry, MCACHE_PROBATION);
+    }
+}
+
+/**
+ * @brief Evicts entries until extra bytes fit in the bound, probation first
+ */
+static void mcache_make_room(struct memory_cache* cache, size_t extra)
+{
+    while (cache->nb_entries > 0 && mcache_bytes(cache) + extra > cache->max_bytes) {
+        struct mcache_entry* victim = cache->segments[MCACHE_PROBATION].tail;
+        if (victim == NULL) victim = cache->segments[MCACHE_PROTECTED].tail;
+        mcache_remove(cache, victim);
+        ++cache->stats.evictions;
+    }
+}
+
+/********************************************************************//**
+ * Initializes an empty cache.
+ */
+void mcache_init(struct memory_cache* cache, uint64_t max_bytes)
+{
+    if (cache == NULL) return;
+    memset(cache, 0, sizeof(struct memory_cache));
+    cache->max_bytes = max_bytes;
+}
+
+/********************************************************************//**
+ * Frees all the entries of a cache.
+ */
+void mcache_free(struct memory_cache* cache)
+{
+    if (cache == NULL) return;
+    for (size_t i = 0; i < MCACHE_NB_BUCKETS; i++) {
+        while (cache->buckets[i] != NULL) {
+            mcache_remove(cache, cache->buckets[i]);
+        }
+    }
+}
+
+/********************************************************************//**
+ * Tells whether an image of a given size would be cached.
+ */
+int mcache_admits(const struct memory_cache* cache, size_t size)
+{
+    return cache != NULL && size > 0 && size <= MCACHE_MAX_ENTRY
+           && size <= cache->max_bytes / MCACHE_ENTRY_FRACTION;
+}
+
+/********************************************************************//**
+ * Looks an image up and marks it as most recently used.
+ */
+const struct mcache_entry* mcache_get(struct memory_cache* cache, uint32_t slot, int resolution, uint64_t offset)
+{
+    if (cache == NULL) return NULL;
+    struct mcache_entry* entry = cache->buckets[slot % MCACHE_NB_BUCKETS];
+    while (entry != NULL && (entry->slot != slot || entry->resolution != resolution || entry->offset != offset)) {
+        entry = entry->chain;
+    }
+    if (entry == NULL) {
+        ++cache->stats.misses;
+        return NULL;
+    }
+    ++cache->stats.hits;
+
+    // a second hit makes it hot
+    mcache_unlink(cache, entry);
+    mcache_push_front(cache, entry, MCACHE_PROTECTED);
+    mcache_balance(cache);
+    return entry;
+}
+
+/********************************************************************//**
+ * Stores an image in the probation segment.
+ */
+int mcache_put(struct memory_cache* cache, uint32_t slot, int resolution, uint64_t offset, char* data, size_t size)
+{
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(cache, ERR_INVALID_ARGUMENT);
+    M_REQUIRE_NON_NULL(data);
+    if (!mcache_admits(cache, size)) {
+        free(data);
+        return ERR_INVALID_ARGUMENT;
+    }
+
+    // another thread may have cached it in the meantime
+    struct mcache_entry* entry = cache->buckets[slot % MCACHE_NB_BUCKETS];
+    while (entry != NULL && (entry->slot != slot || entry->resolution != resolution || entry->offset != offset)) {
+        entry = entry->chain;
+    }
+    if (entry != NULL) mcache_remove(cache, entry);
+    mcache_make_room(cache, size);
+
+    entry = calloc(1, sizeof(struct mcache_entry));
+    if (entry == NULL) {
+        free(data);
+        return ERR_OUT_OF_MEMORY;
+    }
+    entry->slot = slot;
+    entry->resolution = resolution;
+    entry->offset = offset;
+    entry->size = size;
+    entry->data = data;
+    const size_t bucket = slot % MCACHE_NB_BUCKETS;
+    entry->chain = cache->buckets[bucket];
+    cache->buckets[bucket] = entry;
+    mcache_push_front(cache, entry, MCACHE_PROBATION);
+    ++cache->nb_entries;
+    ++cache->stats.insertions;
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Drops all the entries of a slot.
+ */
+void mcache_invalidate_slot(struct memory_cache* cache, uint32_t slot)
+{
+    if (cache == NULL) return;
+    struct mcache_entry* entry = cache->buckets[slot % MCACHE_NB_BUCKETS];
+    while (entry != NULL) {
+        struct mcache_entry* next = entry->chain;
+        if (entry->slot == slot) {
+            mcache_remove(cache, entry);
+            ++cache->stats.invalidations;
+        }
+        entry = next;
+    }
+}
+
+/********************************************************************//**
+ * Drops all the entries.
+ */
+void mcache_clear(struct memory_cache* cache)
+{
+    if (cache == NULL) return;
+    cache->stats.invalidations += cache->nb_entries;
+    mcache_free(cache);
+}
+
+/********************************************************************//**
+ * Moves the entries to new keys.
+ */
+void mcache_rekey(struct memory_cache* cache,
+                  int (*rekey)(void* arg, uint32_t* slot, int resolution, uint64_t* offset), void* arg)
+{
+    if (cache == NULL || rekey == NULL) return;
+    // the entries change buckets: take them all out of the hash table first
+    struct mcache_entry* entries = NULL;
+    for (size_t i = 0; i < MCACHE_NB_BUCKETS; i++) {
+        while (cache->buckets[i] != NULL) {
+            struct mcache_entry* entry = cache->buckets[i];
+            cache->buckets[i] = entry->chain;
+            entry->chain = entries;
+            entries = entry;
+        }
+    }
+    while (entries != NULL) {
+        struct mcache_entry* entry = entries;
+        entries = entry->chain;
+        if (rekey(arg, &entry->slot, entry->resolution, &entry->offset)) {
+            const size_t bucket = entry->slot % MCACHE_NB_BUCKETS;
+            entry->chain = cache->buckets[bucket];
+            cache->buckets[bucket] = entry;
+        } else {
+            // not in a bucket any more, mcache_remove() would look for it
+            mcache_unlink(cache, entry);
+            --cache->nb_entries;
+            ++cache->stats.invalidations;
+            free(entry->data);
+            free(entry);
+        }
+    }
+}
@@ -0,0 +1,147 @@
+/**
+ * @file memory_cache.h
+ * @brief Byte-bounded in-memory cache of the images read from the store, with
+ * segmented LRU eviction.
+ *
+ * Entries are keyed by slot, resolution and offset in the store: a slot reused
+ * for another image gets another offset, so a stale entry is never returned.
+ * New entries go to a probation segment and are only promoted to the protected
+ * segment when hit again, so that reading many images once (e.g. a bulk export)
+ * only evicts other probation entries, not the hot ones.
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+
+#define MCACHE_NB_BUCKETS 4096
+#define MCACHE_PROTECTED_PERCENT 80 // share of the budget the protected segment can hold
+#define MCACHE_ENTRY_FRACTION 8 // images larger than the budget divided by this are not cached
+// nor are images larger than this: thumbnails and small images gain from the
+// cache, larger ones (typically originals) are sent from the file with sendfile
+#define MCACHE_MAX_ENTRY (256u << 10)
+
+enum mcache_segment {MCACHE_PROBATION, MCACHE_PROTECTED, MCACHE_NB_SEGMENTS};
+
+/**
+ * @brief One cached image. Entries are linked both in a hash chain (per slot)
+ * and in the LRU list of their segment (most recently used first).
+ */
+struct mcache_entry {
+    uint32_t slot; // index of the image in the metadata
+    int resolution; // resolution code
+    uint64_t offset; // position of the image in the store
+    size_t size; // size of the image
+    char* data; // the image
+    enum mcache_segment segment;
+    struct mcache_entry* prev; // more recently used entry of the segment
+    struct mcache_entry* next; // less recently used entry of the segment
+    struct mcache_entry* chain; // next entry of the same hash bucket
+};
+
+/**
+ * @brief LRU list of a segment
+ */
+struct mcache_lru {
+    struct mcache_entry* head; // most recently used entry
+    struct mcache_entry* tail; // least recently used entry
+    uint64_t bytes; // total size of the entries
+};
+
+/**
+ * @brief Counters of a cache
+ */
+struct mcache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t insertions;
+    uint64_t evictions; // entries dropped to make room
+    uint64_t invalidations; // entries dropped because the image was deleted or the store changed
+};
+
+/**
+ * @brief The cache
+ */
+struct memory_cache {
+    uint64_t max_bytes; // bound on the total size of the entries, 0 to disable the cache
+    struct mcache_entry* buckets[MCACHE_NB_BUCKETS]; // hash table on the slots
+    struct mcache_lru segments[MCACHE_NB_SEGMENTS];
+    size_t nb_entries;
+    struct mcache_stats stats;
+};
+
+/**
+ * @brief Initializes an empty cache.
+ *
+ * @param cache the cache to initialize
+ * @param max_bytes bound on the total size of the cached images, 0 to disable the cache
+ */
+void mcache_init(struct memory_cache* cache, uint64_t max_bytes);
+
+/**
+ * @brief Frees all the entries of a cache. Counters are kept.
+ *
+ * @param cache the cache to free
+ */
+void mcache_free(struct memory_cache* cache);
+
+/**
+ * @brief Tells whether an image of a given size would be cached: it must
+ * hold in both MCACHE_MAX_ENTRY and the budget divided by MCACHE_ENTRY_FRACTION.
+ *
+ * @param cache the cache
+ * @param size size of the image
+ * @return int 1 if it would be cached
+ */
+int mcache_admits(const struct memory_cache* cache, size_t size);
+
+/**
+ * @brief Looks an image up and marks it as most recently used, promoting it
+ * to the protected segment.
+ *
+ * @param cache the cache
+ * @param slot index of the image in the metadata
+ * @param resolution resolution code
+ * @param offset position of the image in the store
+ * @return const struct mcache_entry* the entry, valid until the next call on the cache; NULL on a miss
+ */
+const struct mcache_entry* mcache_get(struct memory_cache* cache, uint32_t slot, int resolution, uint64_t offset);
+
+/**
+ * @brief Stores an image in the probation segment, evicting least recently used images to stay in bounds.
+ *
+ * @param cache the cache
+ * @param slot index of the image in the metadata
+ * @param resolution resolution code
+ * @param offset position of the image in the store
+ * @param data the image, malloc'ed; the cache owns it after the call, even on error
+ * @param size size of the image
+ * @return int Some error code. 0 if no error.
+ */
+int mcache_put(struct memory_cache* cache, uint32_t slot, int resolution, uint64_t offset, char* data, size_t size);
+
+/**
+ * @brief Drops all the entries of a slot, e.g. when its image is deleted.
+ *
+ * @param cache the cache
+ * @param slot index of the image in the metadata
+ */
+void mcache_invalidate_slot(struct memory_cache* cache, uint32_t slot);
+
+/**
+ * @brief Drops all the entries, e.g. when the store is replaced.
+ *
+ * @param cache the cache
+ */
+void mcache_clear(struct memory_cache* cache);
+
+/**
+ * @brief Moves the entries to new keys, e.g. when the store is compacted and
+ * its images change slots. The entries the callback rejects are dropped.
+ *
+ * @param cache the cache
+ * @param rekey called on each entry with its slot, resolution and offset; updates
+ * the slot and the offset and returns 1 to keep the entry, returns 0 to drop it
+ * @param arg passed to rekey
+ */
+void mcache_rekey(struct memory_cache* cache,
+                  int (*rekey)(void* arg, uint32_t* slot, int resolution, uint64_t* offset), void* arg);
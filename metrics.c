@@ -0,0 +1,131 @@
+/**
+ * @file metrics.c
+ * @brief Counters and latency histograms, recorded per thread without locks.
+ */
+#define _XOPEN_SOURCE 700 // for clock_gettime
+#include "metrics.h"
+
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief The metrics of one thread, on cache lines of their own
+ */
+struct metrics_shard {
+    _Alignas(64) _Atomic uint64_t counters[METRICS_MAX_COUNTERS];
+    struct {
+        _Atomic uint64_t buckets[METRICS_NB_BUCKETS];
+        _Atomic uint64_t sum_ns;
+    } histograms[METRICS_MAX_HISTOGRAMS];
+};
+
+static struct metrics_shard s_shards[METRICS_MAX_SHARDS];
+static atomic_size_t s_nb_shards = 1; // shard 0 is the event loop's
+static _Thread_local size_t t_shard;
+
+/**
+ * @brief Adds to a value only its own thread writes: a plain load and store,
+ * atomic only so that the readers see whole values
+ */
+static void add_relaxed(_Atomic uint64_t* value, uint64_t delta)
+{
+    atomic_store_explicit(value, atomic_load_explicit(value, memory_order_relaxed) + delta,
+                          memory_order_relaxed);
+}
+
+/********************************************************************//**
+ * Gives the calling thread a shard of its own.
+ */
+void metrics_join_thread(void)
+{
+    const size_t shard = atomic_fetch_add(&s_nb_shards, 1);
+    t_shard = shard < METRICS_MAX_SHARDS ? shard : METRICS_MAX_SHARDS - 1;
+}
+
+/********************************************************************//**
+ * Reads the monotonic clock.
+ */
+uint64_t metrics_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/********************************************************************//**
+ * Adds to a counter.
+ */
+void metrics_count(size_t counter, uint64_t value)
+{
+    if (counter >= METRICS_MAX_COUNTERS) return;
+    add_relaxed(&s_shards[t_shard].counters[counter], value);
+}
+
+/********************************************************************//**
+ * Records a duration in a histogram.
+ */
+void metrics_observe(size_t histogram, uint64_t duration_ns)
+{
+    if (histogram >= METRICS_MAX_HISTOGRAMS) return;
+    const uint64_t microseconds = duration_ns / 1000;
+    // number of significant bits: the smallest i with microseconds < 2^i
+    size_t bucket = microseconds == 0 ? 0 : (size_t) (64 - __builtin_clzll(microseconds));
+    if (bucket >= METRICS_NB_BUCKETS) bucket = METRICS_NB_BUCKETS - 1;
+
+    add_relaxed(&s_shards[t_shard].histograms[histogram].buckets[bucket], 1);
+    add_relaxed(&s_shards[t_shard].histograms[histogram].sum_ns, duration_ns);
+}
+
+/********************************************************************//**
+ * Sums a counter over the shards.
+ */
+uint64_t metrics_counter(size_t counter)
+{
+    uint64_t total = 0;
+    if (counter >= METRICS_MAX_COUNTERS) return total;
+    for (size_t i = 0; i < METRICS_MAX_SHARDS; i++) {
+        total += atomic_load_explicit(&s_shards[i].counters[counter], memory_order_relaxed);
+    }
+    return total;
+}
+
+/********************************************************************//**
+ * Sums a histogram over the shards.
+ */
+void metrics_histogram(size_t histogram, struct metrics_histogram* total)
+{
+    if (total == NULL) return;
+    memset(total, 0, sizeof(struct metrics_histogram));
+    if (histogram >= METRICS_MAX_HISTOGRAMS) return;
+    for (size_t i = 0; i < METRICS_MAX_SHARDS; i++) {
+        for (size_t b = 0; b < METRICS_NB_BUCKETS; b++) {
+            const uint64_t count = atomic_load_explicit(&s_shards[i].histograms[histogram].buckets[b],
+                                   memory_order_relaxed);
+            total->buckets[b] += count;
+            // counting the buckets keeps the count consistent with them
+            total->count += count;
+        }
+        total->sum_ns += atomic_load_explicit(&s_shards[i].histograms[histogram].sum_ns, memory_order_relaxed);
+    }
+}
+
+/********************************************************************//**
+ * Writes a histogram in the Prometheus text format.
+ */
+void metrics_print_histogram(FILE* out, const char* name, const char* labels,
+                             const struct metrics_histogram* histogram)
+{
+    if (out == NULL || name == NULL || labels == NULL || histogram == NULL) return;
+    const char* separator = labels[0] != '\0' ? "," : "";
+    uint64_t cumulated = 0;
+    for (size_t b = 0; b + 1 < METRICS_NB_BUCKETS; b++) {
+        cumulated += histogram->buckets[b];
+        fprintf(out, "%s_bucket{%s%sle=\"%g\"} %llu\n", name, labels, separator,
+                (double) (1ull << b) * 1e-6, (unsigned long long) cumulated);
+    }
+    fprintf(out, "%s_bucket{%s%sle=\"+Inf\"} %llu\n", name, labels, separator,
+            (unsigned long long) histogram->count);
+    fprintf(out, "%s_sum{%s} %.9f\n", name, labels, (double) histogram->sum_ns * 1e-9);
+    fprintf(out, "%s_count{%s} %llu\n", name, labels, (unsigned long long) histogram->count);
+}
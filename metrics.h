@@ -0,0 +1,86 @@
+/**
+ * @file metrics.h
+ * @brief Counters and latency histograms, recorded per thread without locks and
+ * summed when they are reported.
+ *
+ * Each thread records into its own shard with relaxed atomic loads and stores:
+ * no lock, no read-modify-write instruction and no cache line shared with the
+ * other threads, so recording costs a few nanoseconds. The thread that did not
+ * call metrics_join_thread() (the event loop) uses shard 0.
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define METRICS_MAX_SHARDS 257 // the event loop and up to 256 workers
+#define METRICS_MAX_COUNTERS 16
+#define METRICS_MAX_HISTOGRAMS 16
+// bucket i counts the durations below 2^i microseconds, the last one all the longer ones
+#define METRICS_NB_BUCKETS 26
+
+/**
+ * @brief Sum of a histogram over the shards
+ */
+struct metrics_histogram {
+    uint64_t buckets[METRICS_NB_BUCKETS]; // number of durations of each bucket, not cumulated
+    uint64_t count; // number of durations, the sum of the buckets
+    uint64_t sum_ns; // total of the durations, in nanoseconds
+};
+
+/**
+ * @brief Gives the calling thread a shard of its own. Threads beyond
+ * METRICS_MAX_SHARDS share the last one, and may then lose some updates.
+ */
+void metrics_join_thread(void);
+
+/**
+ * @brief Reads the monotonic clock.
+ *
+ * @return uint64_t time in nanoseconds
+ */
+uint64_t metrics_now(void);
+
+/**
+ * @brief Adds to a counter.
+ *
+ * @param counter counter number, below METRICS_MAX_COUNTERS
+ * @param value value to add
+ */
+void metrics_count(size_t counter, uint64_t value);
+
+/**
+ * @brief Records a duration in a histogram.
+ *
+ * @param histogram histogram number, below METRICS_MAX_HISTOGRAMS
+ * @param duration_ns the duration, in nanoseconds, e.g. the difference of two metrics_now()
+ */
+void metrics_observe(size_t histogram, uint64_t duration_ns);
+
+/**
+ * @brief Sums a counter over the shards.
+ *
+ * @param counter counter number
+ * @return uint64_t the total
+ */
+uint64_t metrics_counter(size_t counter);
+
+/**
+ * @brief Sums a histogram over the shards.
+ *
+ * @param histogram histogram number
+ * @param total output: the sum
+ */
+void metrics_histogram(size_t histogram, struct metrics_histogram* total);
+
+/**
+ * @brief Writes a histogram in the Prometheus text format: its cumulated
+ * buckets (with bounds in seconds), _sum and _count.
+ *
+ * @param out where to write
+ * @param name name of the metric
+ * @param labels labels of the metric without braces, e.g. handler="read", or ""
+ * @param histogram the histogram
+ */
+void metrics_print_histogram(FILE* out, const char* name, const char* labels,
+                             const struct metrics_histogram* histogram);
@@ -4,7 +4,7 @@
  *
  * @author Mia Primorac
  */
-
+#define _XOPEN_SOURCE 700 // for pread
 #include "imgStore.h"
 #include "error.h"
 
@@ -13,11 +13,20 @@
 #include <openssl/sha.h> // for SHA256_DIGEST_LENGTH
 #include <stdlib.h>
 #include <inttypes.h> // for PRI...
+#include <unistd.h> // for pread
+#include <stddef.h> // for offsetof
+#include <string.h> // for memcpy
+
+static const char* const ENC_NAMES[NB_ENC] = {"jpeg", "webp", "avif"};
+static const char* const ENC_MIME_TYPES[NB_ENC] = {"image/jpeg", "image/webp", "image/avif"};
+static const char* const ENC_EXTENSIONS[NB_ENC] = {".jpg", ".webp", ".avif"};
+static const char* const SUBSAMPLE_NAMES[] = {"auto", "on", "off"};
+#define ORIG_NAME "orig"
 
 /********************************************************************//**
  * Human-readable SHA
  */
-static void
+void
 sha_to_string (const unsigned char* SHA,
                char* sha_string)
 {
@@ -42,7 +51,16 @@ void print_header(const struct imgst_header* header)
         printf("TYPE: %31s\n", header->imgst_name);
         printf("VERSION: %" PRIu32 "\n", header->imgst_version);
         printf("IMAGE COUNT: %" PRIu32 "\t\tMAX IMAGES: %" PRIu32 "\n", header->num_files, header->max_files);
-        printf("THUMBNAIL: %" PRIu16 " x %" PRIu16 "\tSMALL: %" PRIu16 " x %" PRIu16 "\n", header->res_resized[RES_THUMB*2],header->res_resized[RES_THUMB*2 + 1], header->res_resized[RES_SMALL*2], header->res_resized[RES_SMALL*2+1]);
+        printf("RESIZED RESOLUTIONS: %" PRIu16 "\n", header->nb_resized);
+        for (int res = 0; res < header->nb_resized && res < MAX_NB_RES - 1; res++) {
+            const struct res_encoding* enc = &header->res_encoding[res];
+            printf("%-*.*s: %" PRIu16 " x %" PRIu16 "\t%s Q%" PRIu8 " subsample %s%s\n",
+                   MAX_RES_NAME, MAX_RES_NAME, header->res_names[res],
+                   header->res_resized[res*2], header->res_resized[res*2 + 1],
+                   enc->encoder < NB_ENC ? ENC_NAMES[enc->encoder] : "?", enc->quality,
+                   enc->subsample <= SUBSAMPLE_OFF ? SUBSAMPLE_NAMES[enc->subsample] : "?",
+                   enc->strip ? " stripped" : "");
+        }
         puts("***********IMGSTORE HEADER END***********");
         puts("*****************************************");
     }
@@ -51,9 +69,9 @@ void print_header(const struct imgst_header* header)
 /********************************************************************//**
  * Metadata display.
  */
-void print_metadata (const struct img_metadata* metadata)
+void print_metadata (const struct img_metadata* metadata, const struct imgst_header* header)
 {
-    if(metadata != NULL) {
+    if(metadata != NULL && header != NULL) {
         char sha_printable[2*SHA256_DIGEST_LENGTH+1];
         sha_to_string(metadata->SHA, sha_printable);
         printf("IMAGE ID: %s\n", metadata->img_id);
@@ -61,8 +79,11 @@ void print_metadata (const struct img_metadata* metadata)
         printf("VALID: %" PRIu16 "\n", metadata->is_valid);
         printf("UNUSED: %" PRIu16 "\n", metadata->unused_16);
         printf("OFFSET ORIG. : %" PRIu64 "\t\tSIZE ORIG. : %" PRIu32 "\n", metadata->offset[RES_ORIG], metadata->size[RES_ORIG]);
-        printf("OFFSET THUMB.: %" PRIu64 "\t\tSIZE THUMB.: %" PRIu32 "\n", metadata->offset[RES_THUMB], metadata->size[RES_THUMB]);
-        printf("OFFSET SMALL : %" PRIu64 "\t\tSIZE SMALL : %" PRIu32 "\n", metadata->offset[RES_SMALL], metadata->size[RES_SMALL]);
+        for (int res = 0; res < header->nb_resized && res < MAX_NB_RES - 1; res++) {
+            printf("OFFSET %-*.*s: %" PRIu64 "\t\tSIZE %-*.*s: %" PRIu32 "\n",
+                   MAX_RES_NAME, MAX_RES_NAME, header->res_names[res], metadata->offset[res],
+                   MAX_RES_NAME, MAX_RES_NAME, header->res_names[res], metadata->size[res]);
+        }
         printf("ORIGINAL: %" PRIu32 " x %" PRIu32 "\n", metadata->res_orig[0], metadata->res_orig[1]);
         puts("*****************************************");
     }
@@ -88,6 +109,12 @@ int do_open (const char* imgst_filename, const char* open_mode, struct imgst_fil
         fclose(imgst_file->file);
         imgst_file->file = NULL;
     });
+    M_CHECK_WITH_CODE(
+    imgst_file->header.nb_resized < NB_DEFAULT_RESIZED || imgst_file->header.nb_resized > MAX_NB_RES - 1, {
+        fclose(imgst_file->file);
+        imgst_file->file = NULL;
+    },
+    ERR_RESOLUTIONS);
 
     // Initialises the metadata
     imgst_file->metadata = calloc(imgst_file->header.max_files, sizeof(struct img_metadata));
@@ -106,6 +133,55 @@ int do_open (const char* imgst_filename, const char* open_mode, struct imgst_fil
     return ERR_NONE;
 }
 
+/********************************************************************//**
+ * Reads the version of the store on disk.
+ */
+int read_disk_version(const struct imgst_file* imgst_file, uint32_t* version)
+{
+    M_REQUIRE_NON_NULL_IMGST_FILE(imgst_file);
+    M_REQUIRE_NON_NULL(version);
+    M_IO_CHECK(pread(fileno(imgst_file->file), version, sizeof(uint32_t),
+                     (off_t) offsetof(struct imgst_header, imgst_version)), (ssize_t) sizeof(uint32_t));
+    return ERR_NONE;
+}
+
+/********************************************************************//**
+ * Reads the header and the metadata again from disk.
+ */
+int do_refresh(struct imgst_file* imgst_file, struct img_metadata** previous)
+{
+    M_REQUIRE_NON_NULL_IMGST_FILE(imgst_file);
+    if (previous != NULL) *previous = NULL;
+    const int fd = fileno(imgst_file->file);
+
+    struct imgst_header header;
+    M_IO_CHECK(pread(fd, &header, sizeof(struct imgst_header), 0), (ssize_t) sizeof(struct imgst_header));
+    M_REQUIRE(header.max_files == imgst_file->header.max_files, ERR_MAX_FILES,
+              "the store was replaced", NULL);
+
+    const size_t metadata_size = header.max_files * sizeof(struct img_metadata);
+    struct img_metadata* metadata = malloc(metadata_size);
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(metadata, ERR_OUT_OF_MEMORY);
+    M_IO_CHECK_WITH_CODE(
+    pread(fd, metadata, metadata_size, (off_t) sizeof(struct imgst_header)) != (ssize_t) metadata_size,
+    free(metadata));
+
+    // a version that moved while reading means a write in progress: keep the
+    // current metadata, the next refresh will see the new version
+    uint32_t version = 0;
+    M_EXIT_IF_ERR_DO_SOMETHING(read_disk_version(imgst_file, &version), free(metadata));
+    if (version != header.imgst_version) {
+        free(metadata);
+        return ERR_NONE;
+    }
+
+    memcpy(&imgst_file->header, &header, sizeof(struct imgst_header));
+    if (previous != NULL) *previous = imgst_file->metadata;
+    else free(imgst_file->metadata);
+    imgst_file->metadata = metadata;
+    return ERR_NONE;
+}
+
 /********************************************************************//**
  * Do some clean-up for imgStore file handling.
  */
@@ -123,14 +199,90 @@ void do_close (struct imgst_file* imgst_file)
 /********************************************************************//**
  * Transforms resolution string to its int value.
  */
-int resolution_atoi(const char* resolution)
+int resolution_atoi(const char* resolution, const struct imgst_header* header)
 {
-    if (resolution == NULL) return -1;
-    if (!strcmp(resolution, "original") || !strcmp(resolution, "orig")) return RES_ORIG;
-    if (!strcmp(resolution, "thumbnail") || !strcmp(resolution, "thumb")) return RES_THUMB;
-    if (!strcmp(resolution, "small")) return RES_SMALL;
+    if (resolution == NULL || header == NULL) return -1;
+    if (!strcmp(resolution, "original") || !strcmp(resolution, ORIG_NAME)) return RES_ORIG;
+    if (!strcmp(resolution, "thumbnail")) return RES_THUMB;
+    for (int res = 0; res < header->nb_resized && res < MAX_NB_RES - 1; res++) {
+        if (!strncmp(resolution, header->res_names[res], MAX_RES_NAME + 1)) return res;
+    }
     return -1;
 }
+
+/********************************************************************//**
+ * Tells whether a resolution code exists in an imgStore.
+ */
+int is_valid_resolution(const struct imgst_header* header, int resolution)
+{
+    if (header == NULL) return 0;
+    return resolution == RES_ORIG || (resolution >= 0 && resolution < header->nb_resized && resolution < MAX_NB_RES - 1);
+}
+
+/********************************************************************//**
+ * Gives the name of a resolution.
+ */
+const char* resolution_name(const struct imgst_header* header, int resolution)
+{
+    if (!is_valid_resolution(header, resolution)) return NULL;
+    if (resolution == RES_ORIG) return ORIG_NAME;
+    return header->res_names[resolution];
+}
+
+/********************************************************************//**
+ * Transforms encoder string to its int value.
+ */
+int encoder_atoi(const char* encoder)
+{
+    if (encoder == NULL) return -1;
+    if (!strcmp(encoder, "jpg")) return ENC_JPEG;
+    for (int i = 0; i < NB_ENC; i++) {
+        if (!strcmp(encoder, ENC_NAMES[i])) return i;
+    }
+    return -1;
+}
+
+/********************************************************************//**
+ * Transforms chroma subsampling string to its int value.
+ */
+int subsample_atoi(const char* subsample)
+{
+    if (subsample == NULL) return -1;
+    for (int i = SUBSAMPLE_AUTO; i <= SUBSAMPLE_OFF; i++) {
+        if (!strcmp(subsample, SUBSAMPLE_NAMES[i])) return i;
+    }
+    return -1;
+}
+
+/********************************************************************//**
+ * Gives the MIME type of the images produced by an encoder.
+ */
+const char* encoder_mime_type(int encoder)
+{
+    return encoder >= 0 && encoder < NB_ENC ? ENC_MIME_TYPES[encoder] : NULL;
+}
+
+/********************************************************************//**
+ * Gives the file extension of the images produced by an encoder.
+ */
+const char* encoder_extension(int encoder)
+{
+    return encoder >= 0 && encoder < NB_ENC ? ENC_EXTENSIONS[encoder] : NULL;
+}
+
+/********************************************************************//**
+ * Gives the encoder of the bytes stored for an image in a given resolution.
+ * Originals are always JPEG, resized images use the encoder of their
+ * resolution unless they are aliased to the original.
+ */
+int stored_encoder(const struct imgst_file* imgst_file, size_t index, int resolution)
+{
+    if (imgst_file == NULL || imgst_file->metadata == NULL || index >= imgst_file->header.max_files) return -1;
+    if (!is_valid_resolution(&imgst_file->header, resolution)) return -1;
+    const struct img_metadata* metadata = &imgst_file->metadata[index];
+    if (resolution == RES_ORIG || metadata->offset[resolution] == metadata->offset[RES_ORIG]) return ENC_JPEG;
+    return imgst_file->header.res_encoding[resolution].encoder;
+}
 /********************************************************************//**
  * Attempts to find an img_id in an imst_file
  */
@@ -153,45 +305,30 @@ int find_img_id(size_t* const index, const struct imgst_file* imgst_file, const
     return ERR_NONE;
 }
 
-#define THUMB_STR "_thumb"
-#define SMALL_STR "_small"
-#define ORIG_STR "_orig"
-#define MAX_RES_NAME 6 // length of the longest string above
 /********************************************************************//**
  * Creates the name of a picture according to conventions.
  */
-int create_name(const char* img_id, int resolution_code, char** name)
+int create_name(const char* img_id, int resolution_code, const struct imgst_file* imgst_file, char** name)
 {
     M_REQUIRE_NON_NULL(img_id);
+    M_REQUIRE_NON_NULL(imgst_file);
     M_CHECK_IMG_ID(img_id);
-    M_REQUIRE(resolution_code < NB_RES && resolution_code >= 0, ERR_RESOLUTIONS, ERR_MESSAGES[ERR_RESOLUTIONS], NULL);
-
-    char* res = calloc(MAX_RES_NAME + 1, 1);
-    M_EXIT_IF_NULL(res, MAX_RES_NAME + 1);
-    switch(resolution_code) {
-    case RES_THUMB:
-        strcpy(res, THUMB_STR);
-        break;
-    case RES_SMALL:
-        strcpy(res, SMALL_STR);
-        break;
-    case RES_ORIG:
-        strcpy(res, ORIG_STR);
-        break;
-    };
-    *name = calloc(MAX_IMG_ID + MAX_RES_NAME + 5, 1);
-    M_CHECK_WITH_CODE(
-    *name == NULL, {
-        free(res);
-        res = NULL;
-    },
-    ERR_OUT_OF_MEMORY);
+    const struct imgst_header* header = &imgst_file->header;
+    M_REQUIRE(is_valid_resolution(header, resolution_code), ERR_RESOLUTIONS, ERR_MESSAGES[ERR_RESOLUTIONS], NULL);
+    size_t index = 0;
+    M_EXIT_IF_ERR(find_img_id(&index, imgst_file, img_id));
+    const char* extension = encoder_extension(stored_encoder(imgst_file, index, resolution_code));
+    M_REQUIRE_NON_NULL_CUSTOM_ERR(extension, ERR_INVALID_ARGUMENT);
+
+    // name is <img_id>_<resolution name><extension>
+    *name = calloc(MAX_IMG_ID + 1 + MAX_RES_NAME + MAX_EXT_NAME + 1, 1);
+    M_EXIT_IF_NULL(*name, MAX_IMG_ID + 1 + MAX_RES_NAME + MAX_EXT_NAME + 1);
 
     strcat(*name, img_id);
-    strcat(*name, res);
-    strcat(*name, ".jpg");
+    strcat(*name, "_");
+    strncat(*name, resolution_name(header, resolution_code), MAX_RES_NAME);
+    strcat(*name, extension);
 
-    free(res);
     return ERR_NONE;
 }
 
@@ -207,6 +344,7 @@ int update_disk_metadata(struct imgst_file* imgst_file, size_t index)
     // updates metadata
     M_IO_CHECK(fseek(imgst_file->file, offset, SEEK_SET), 0);
     M_IO_CHECK(fwrite(&(imgst_file->metadata[index]), sizeof(imgst_file->metadata[index]), 1, imgst_file->file), 1);
+    M_IO_CHECK(fflush(imgst_file->file), 0);
     return ERR_NONE;
 }
 
@@ -217,6 +355,7 @@ int update_disk_header(struct imgst_file* imgst_file)
 {
     M_IO_CHECK(fseek(imgst_file->file, 0, SEEK_SET), 0);
     M_IO_CHECK(fwrite(&imgst_file->header, sizeof(imgst_file->header), 1, imgst_file->file), 1);
+    M_IO_CHECK(fflush(imgst_file->file), 0);
     return ERR_NONE;
 }
 
@@ -231,6 +370,7 @@ int write_disk_image(struct imgst_file* imgst_file, void* buffer, size_t size, l
     // saves the new position of resized image
     *next_position = ftell(imgst_file->file);
     M_IO_CHECK(fwrite(buffer, size, 1, imgst_file->file), 1);
+    M_IO_CHECK(fflush(imgst_file->file), 0);
     return ERR_NONE;
 }
 
@@ -239,8 +379,8 @@ int write_disk_image(struct imgst_file* imgst_file, void* buffer, size_t size, l
 */
 int read_disk_image(FILE* file, void** buffer, size_t size, long offset)
 {
-    // read original image into buffer
-    M_IO_CHECK(fseek(file, offset, SEEK_SET), 0);
-    M_IO_CHECK(fread(*buffer, size, 1, file), 1);
+    // read original image into buffer, without moving the shared file position
+    M_REQUIRE_NON_NULL(file);
+    M_IO_CHECK(pread(fileno(file), *buffer, size, (off_t) offset), (ssize_t) size);
     return ERR_NONE;
 }
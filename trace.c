@@ -0,0 +1,158 @@
+/**
+ * @file trace.c
+ * @brief Spans of the stages of one request, logged when it is slow or sampled.
+ */
+#define _XOPEN_SOURCE 700 // for clock_gettime
+#include "trace.h"
+
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+
+#define TRACE_LINE_SIZE (512 + 2 * TRACE_MAX_DETAIL + TRACE_MAX_SPANS * 96)
+
+/**
+ * @brief A stage of a request
+ */
+struct trace_span {
+    const char* stage;
+    uint64_t start;
+    uint64_t end;
+};
+
+/**
+ * @brief The request traced by a thread
+ */
+struct trace {
+    int active; // the request may be logged, spans are recorded
+    int sampled; // the request goes to the sample file
+    const char* name;
+    char detail[TRACE_MAX_DETAIL + 1];
+    uint64_t start;
+    size_t nb_spans;
+    struct trace_span spans[TRACE_MAX_SPANS];
+};
+
+static uint64_t s_slow_ns;
+static unsigned s_sample_every;
+static FILE* s_sample_file;
+static atomic_ulong s_requests; // requests begun, for the sampling
+static _Thread_local struct trace t_trace;
+
+/**
+ * @brief Reads the monotonic clock, in nanoseconds
+ */
+static uint64_t trace_now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+/**
+ * @brief Appends a string as a JSON string literal, cut if the line is full
+ *
+ * @param line the line
+ * @param length current length of line, updated
+ * @param string the string
+ */
+static void append_json(char* line, size_t* length, const char* string)
+{
+    // room for an escape, the closing quote and the end of the line
+    const size_t last = TRACE_LINE_SIZE - 16;
+    line[(*length)++] = '"';
+    for (const char* c = string; *c != '\0' && *length < last; c++) {
+        if (*c == '"' || *c == '\\') {
+            line[(*length)++] = '\\';
+            line[(*length)++] = *c;
+        } else if ((unsigned char) *c < 0x20) {
+            *length += (size_t) snprintf(line + *length, 7, "\\u%04x", (unsigned) (unsigned char) *c);
+        } else {
+            line[(*length)++] = *c;
+        }
+    }
+    line[(*length)++] = '"';
+}
+
+/********************************************************************//**
+ * Sets which requests are traced.
+ */
+void trace_configure(uint64_t slow_ns, unsigned sample_every, FILE* sample_file)
+{
+    s_slow_ns = slow_ns;
+    s_sample_every = sample_file != NULL ? sample_every : 0;
+    s_sample_file = sample_file;
+}
+
+/********************************************************************//**
+ * Starts tracing the request handled by the calling thread.
+ */
+void trace_begin(const char* name, const char* detail, size_t detail_len)
+{
+    t_trace.sampled = s_sample_every > 0
+                      && atomic_fetch_add_explicit(&s_requests, 1, memory_order_relaxed) % s_sample_every == 0;
+    t_trace.active = t_trace.sampled || s_slow_ns > 0;
+    if (!t_trace.active) return;
+    t_trace.name = name != NULL ? name : "";
+    if (detail_len > TRACE_MAX_DETAIL) detail_len = TRACE_MAX_DETAIL;
+    if (detail != NULL) memcpy(t_trace.detail, detail, detail_len);
+    t_trace.detail[detail != NULL ? detail_len : 0] = '\0';
+    t_trace.nb_spans = 0;
+    t_trace.start = trace_now();
+}
+
+/********************************************************************//**
+ * Ends the request of the calling thread, and writes it if slow or sampled.
+ */
+void trace_end(void)
+{
+    if (!t_trace.active) return;
+    t_trace.active = 0;
+    const uint64_t end = trace_now();
+    const int slow = s_slow_ns > 0 && end - t_trace.start > s_slow_ns;
+    if (!slow && !t_trace.sampled) return;
+
+    // one write per line, so that the lines of the threads do not mix
+    char line[TRACE_LINE_SIZE];
+    size_t length = (size_t) snprintf(line, sizeof(line), "{\"request\":");
+    append_json(line, &length, t_trace.name);
+    length += (size_t) snprintf(line + length, sizeof(line) - length, ",\"detail\":");
+    append_json(line, &length, t_trace.detail);
+    length += (size_t) snprintf(line + length, sizeof(line) - length,
+                                ",\"slow\":%s,\"start_ns\":%llu,\"total_us\":%llu,\"spans\":[",
+                                slow ? "true" : "false", (unsigned long long) t_trace.start,
+                                (unsigned long long) (end - t_trace.start) / 1000);
+    for (size_t i = 0; i < t_trace.nb_spans; i++) {
+        const struct trace_span* span = &t_trace.spans[i];
+        // stages are names from the code, never escaped
+        length += (size_t) snprintf(line + length, sizeof(line) - length,
+                                    "%s{\"stage\":\"%s\",\"at_us\":%llu,\"us\":%llu}", i > 0 ? "," : "",
+                                    span->stage, (unsigned long long) (span->start - t_trace.start) / 1000,
+                                    (unsigned long long) (span->end - span->start) / 1000);
+    }
+    length += (size_t) snprintf(line + length, sizeof(line) - length, "]}\n");
+
+    if (slow) fwrite(line, 1, length, stderr);
+    if (t_trace.sampled) fwrite(line, 1, length, s_sample_file);
+}
+
+/********************************************************************//**
+ * Reads the monotonic clock, if the calling thread traces a request.
+ */
+uint64_t trace_clock(void)
+{
+    return t_trace.active ? trace_now() : 0;
+}
+
+/********************************************************************//**
+ * Records a stage of the request of the calling thread.
+ */
+void trace_span(const char* stage, uint64_t start, uint64_t end)
+{
+    if (!t_trace.active || start == 0 || t_trace.nb_spans == TRACE_MAX_SPANS) return;
+    struct trace_span* span = &t_trace.spans[t_trace.nb_spans++];
+    span->stage = stage;
+    // spans measured before trace_begin() start with the request
+    span->start = start > t_trace.start ? start : t_trace.start;
+    span->end = end > span->start ? end : span->start;
+}
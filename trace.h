@@ -0,0 +1,58 @@
+/**
+ * @file trace.h
+ * @brief Spans of the stages of one request, with monotonic timestamps,
+ * logged when the request is slow and written to a file for a sample of them.
+ *
+ * A thread traces the request it handles between trace_begin() and
+ * trace_end(). When tracing is off, or the request is not traced, a span costs
+ * one test of a thread-local flag and no clock read: trace_clock() returns 0
+ * and trace_span() ignores spans starting at 0.
+ */
+#pragma once
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+
+#define TRACE_MAX_SPANS 32 // further spans of a request are not recorded
+#define TRACE_MAX_DETAIL 256 // the detail of a request is cut to this length
+
+/**
+ * @brief Sets which requests are traced. Called before any thread traces.
+ *
+ * @param slow_ns requests that take longer are logged to stderr, 0 not to log them
+ * @param sample_every one request in sample_every is written to sample_file, 0 for none
+ * @param sample_file where the sampled requests go, NULL for none
+ */
+void trace_configure(uint64_t slow_ns, unsigned sample_every, FILE* sample_file);
+
+/**
+ * @brief Starts tracing the request handled by the calling thread, if it may
+ * be logged: when a slow threshold is set, or when it is sampled.
+ *
+ * @param name name of the request, e.g. the handler, kept as a pointer
+ * @param detail details of the request, e.g. its query, copied; may be NULL
+ * @param detail_len length of detail
+ */
+void trace_begin(const char* name, const char* detail, size_t detail_len);
+
+/**
+ * @brief Ends the request of the calling thread, and writes its spans as one
+ * JSON line to stderr if it was slow and to the sample file if it was sampled.
+ */
+void trace_end(void);
+
+/**
+ * @brief Reads the monotonic clock, if the calling thread traces a request.
+ *
+ * @return uint64_t time in nanoseconds, 0 if the request is not traced
+ */
+uint64_t trace_clock(void);
+
+/**
+ * @brief Records a stage of the request of the calling thread.
+ *
+ * @param stage name of the stage, kept as a pointer
+ * @param start when it started, from trace_clock() or the same monotonic clock; 0 to record nothing
+ * @param end when it ended
+ */
+void trace_span(const char* stage, uint64_t start, uint64_t end);